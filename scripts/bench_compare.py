@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+
+"""
+Performance regression harness: runs the regression cases of cpm_bench
+(cpm_bench --regression) for two builds, interleaved over several rounds,
+and flags the cases that got significantly slower.
+
+A build is either the path of a cpm_bench binary, or a git revision which
+is checked out in a temporary worktree and built with `make bench`.
+
+For each case, the change is the relative increase in time of the median
+(so +5% means 5% slower, whether the case reports a rate or a duration),
+with a bootstrap confidence interval. The bootstrap resamples whole runs,
+since the timings of one process share its memory layout and the state of
+the machine. A case is flagged when the whole interval lies beyond the
+threshold. The exit status is 1 when a case got slower, so that the script
+can gate a merge.
+
+Example:
+    scripts/bench_compare.py HEAD~1 HEAD --rounds 5 --threshold 0.03
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def build(revision, workdir, jobs):
+    """checks out revision in a worktree under workdir and builds cpm_bench, returns its path"""
+    path = os.path.join(workdir, 'build-' + str(len(os.listdir(workdir))))
+    subprocess.check_call(['git', '-C', ROOT, 'worktree', 'add', '--detach', '--quiet', path, revision])
+    subprocess.check_call(['make', '-C', path, '-j' + str(jobs), 'bench'],
+                          stdout=subprocess.DEVNULL)
+    return path, os.path.join(path, 'bin', 'cpm_bench')
+
+
+def run(binary, args, workdir, pin):
+    """one regression run, returns {case name: result} from the JSON report"""
+    report = os.path.join(workdir, 'report.json')
+    command = [binary, '--regression', '--json', report,
+               '--seed', str(args.seed), '--repeats', str(args.repeats), '--scale', str(args.scale),
+               '--scratch', os.path.join(workdir, 'scratch.svm')]
+    if pin is not None:
+        command = ['taskset', '-c', pin] + command
+    subprocess.check_call(command, stderr=subprocess.DEVNULL)
+    with open(report) as f:
+        return {r['name']: r for r in json.load(f)['results']}
+
+
+def median(xs):
+    xs = sorted(xs)
+    n = len(xs)
+    return xs[n // 2] if n % 2 else 0.5 * (xs[n // 2 - 1] + xs[n // 2])
+
+
+def slowdown(base, new, higher_is_better):
+    """relative time increase from the base to the new median"""
+    if higher_is_better:
+        return median(base) / median(new) - 1.0
+    return median(new) / median(base) - 1.0
+
+
+def flatten(runs):
+    return [x for run in runs for x in run]
+
+
+def interval(base, new, higher_is_better, confidence, resamples, rng):
+    """percentile bootstrap interval of the slowdown, base and new are lists of runs"""
+    def draw(runs):
+        return flatten(rng.choice(runs) for _ in runs)
+    draws = sorted(slowdown(draw(base), draw(new), higher_is_better) for _ in range(resamples))
+    tail = (1.0 - confidence) / 2.0
+    return draws[int(tail * (resamples - 1))], draws[int((1.0 - tail) * (resamples - 1))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('base', help='cpm_bench binary or git revision of the reference build')
+    parser.add_argument('new', help='cpm_bench binary or git revision of the build under test')
+    parser.add_argument('--rounds', type=int, default=5, help='interleaved runs per build (default 5)')
+    parser.add_argument('--repeats', type=int, default=3, help='timings per case and run (default 3)')
+    parser.add_argument('--scale', type=float, default=1.0, help='workload multiplier (default 1)')
+    parser.add_argument('--seed', type=int, default=0, help='dataset seed (default 0)')
+    parser.add_argument('--threshold', type=float, default=0.03,
+                        help='smallest slowdown worth flagging (default 0.03, i.e. 3%%)')
+    parser.add_argument('--confidence', type=float, default=0.95, help='interval confidence (default 0.95)')
+    parser.add_argument('--resamples', type=int, default=2000, help='bootstrap resamples (default 2000)')
+    parser.add_argument('--pin', help='run the benchmarks on this CPU list (taskset -c), reduces the noise')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count() or 1, help='make jobs when building')
+    parser.add_argument('--json', help='also write the comparison to this file')
+    args = parser.parse_args()
+
+    # the intervals resample whole runs, which takes a few of them
+    if args.rounds < 3:
+        parser.error('at least 3 rounds are needed')
+
+    workdir = tempfile.mkdtemp(prefix='cpm_bench_compare_')
+    worktrees = []
+    try:
+        binaries = []
+        for build_or_binary in (args.base, args.new):
+            if os.path.isfile(build_or_binary) and os.access(build_or_binary, os.X_OK):
+                binaries.append(os.path.abspath(build_or_binary))
+            else:
+                print('Building %s' % build_or_binary, file=sys.stderr)
+                worktree, binary = build(build_or_binary, workdir, args.jobs)
+                worktrees.append(worktree)
+                binaries.append(binary)
+
+        # ABBA order, so that drifts of the machine (thermal, background load) hit both builds alike
+        samples = [{}, {}]
+        higher_is_better = {}
+        units = {}
+        for r in range(args.rounds):
+            for side in ((0, 1) if r % 2 == 0 else (1, 0)):
+                print('Round %d/%d, %s' % (r + 1, args.rounds, ('base', 'new')[side]), file=sys.stderr)
+                for name, result in run(binaries[side], args, workdir, args.pin).items():
+                    samples[side].setdefault(name, []).append(result['samples'])
+                    higher_is_better[name] = result['higher_is_better']
+                    units[name] = result['unit']
+    finally:
+        for worktree in worktrees:
+            subprocess.call(['git', '-C', ROOT, 'worktree', 'remove', '--force', worktree])
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    rng = random.Random(args.seed)
+    comparison = []
+    regressions = 0
+    print('%-26s %-8s %12s %12s %8s %19s' % ('case', 'unit', 'base', 'new', 'change', 'interval'))
+    for name in samples[0]:
+        if name not in samples[1]:
+            continue
+        base, new = samples[0][name], samples[1][name]
+        change = slowdown(flatten(base), flatten(new), higher_is_better[name])
+        low, high = interval(base, new, higher_is_better[name], args.confidence, args.resamples, rng)
+
+        verdict = ''
+        if low > args.threshold:
+            verdict = 'SLOWER'
+            regressions += 1
+        elif high < -args.threshold:
+            verdict = 'faster'
+
+        print('%-26s %-8s %12.4g %12.4g %+7.1f%% [%+6.1f%%, %+6.1f%%] %s' %
+              (name, units[name], median(flatten(base)), median(flatten(new)), 100 * change, 100 * low,
+               100 * high, verdict))
+        comparison.append({'name': name, 'unit': units[name], 'base_median': median(flatten(base)),
+                           'new_median': median(flatten(new)), 'slowdown': change, 'interval': [low, high],
+                           'verdict': verdict or 'unchanged'})
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump({'base': args.base, 'new': args.new, 'threshold': args.threshold,
+                       'confidence': args.confidence, 'cases': comparison}, f, indent=2)
+
+    print('%d case(s) slower by more than %g%% at %g%% confidence' %
+          (regressions, 100 * args.threshold, 100 * args.confidence))
+    return 1 if regressions else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -5,19 +5,29 @@ setup.py file for SWIG interface
 """
 
 from distutils.core import setup, Extension
+from distutils.command.build import build
 import numpy as np
 
+# cpm.py is written by swig along with the extension, so the extension goes first
+class BuildExtFirst(build):
+    sub_commands = ([c for c in build.sub_commands if c[0] == 'build_ext'] +
+                    [c for c in build.sub_commands if c[0] != 'build_ext'])
+
 cpm_module = Extension('_cpm',
-                           sources=['src/python_wrap.cpp',
+                           sources=['src/python.i',
                                    'src/sparse_vector.cpp',
                                    'src/stochastic_data_adaptor.cpp',
                                    'src/convex_polytope_machine.cpp',
                                    'src/dense_matrix.cpp',
+                                   'src/page_allocator.cpp',
+                                   'src/instrumentation.cpp',
+                                   'src/telemetry.cpp',
                                    'src/cpm.cpp',
+                                   'src/multiclass_cpm.cpp',
                                    'src/eval_utils.cpp',
                                    'src/parallel_eval.cpp'],
                            language='c++',
-                           swig_opts=['-c++', '-O', '-builtin'],
+                           swig_opts=['-c++', '-O', '-builtin', '-outdir', 'src'],
                            extra_compile_args=['-std=c++11', '-pthread'],
                            include_dirs=[np.get_include(), 'src']
                            )
@@ -28,5 +38,6 @@ setup (name = 'cpm',
        description = """Convex Polytope Machine""",
        ext_modules = [cpm_module],
        py_modules = ["cpm"],
-       package_dir={'': 'src'}
+       package_dir={'': 'src'},
+       cmdclass = {'build': BuildExtFirst}
       )
@@ -0,0 +1,526 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// bench_suite.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "bench_suite.h"
+#include "json_writer.h"
+#include "sparse_vector.h"
+#include "dense_matrix.h"
+#include "stochastic_data_adaptor.h"
+#include "convex_polytope_machine.h"
+#include "cpm.h"
+#include "eval_utils.h"
+
+namespace benchsuite {
+
+// dataset shape, before scaling
+static const size_t base_instances = 50000;
+static const size_t base_steps = 200000;
+static const int dimensions = 1 << 18;
+static const int min_non_zeros = 10;
+static const int max_non_zeros = 70;
+
+// classifiers of the SGD, inference and model file cases
+static const int model_classifiers = 8;
+
+// classifiers of the single instance latency cases
+static const int latency_classifiers = 16;
+
+// keeps the compiler from dropping the benchmarked work
+static volatile double sink;
+
+/* writes a libSVM file of n_instances rows with uniformly many non-zeros each.
+ * Labels are the side of a random hyperplane. Returns the file size in bytes.
+ */
+static size_t writeDataset(const std::string& fname, size_t n_instances, unsigned int seed) {
+    std::mt19937 generator(seed);
+    std::normal_distribution<float> gaussian;
+    std::uniform_int_distribution<int> any_index(0, dimensions - 1);
+    std::uniform_int_distribution<int> any_length(min_non_zeros, max_non_zeros);
+    std::uniform_real_distribution<float> any_value(0.0f, 1.0f);
+    
+    std::vector<float> hyperplane(dimensions);
+    for (auto& w: hyperplane) {
+        w = gaussian(generator);
+    }
+    
+    std::ofstream fout(fname);
+    if (!fout) {
+        throw std::runtime_error("Cannot open the scratch file " + fname + ".");
+    }
+    
+    std::vector<int> indices;
+    std::vector<float> values;
+    char buffer[32];
+    
+    for (size_t i = 0; i < n_instances; ++i) {
+        indices.resize(any_length(generator));
+        for (auto& index: indices) {
+            index = any_index(generator);
+        }
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+        
+        values.resize(indices.size());
+        double side = 0.0;
+        for (size_t j = 0; j < indices.size(); ++j) {
+            values[j] = any_value(generator);
+            side += hyperplane[indices[j]] * values[j];
+        }
+        
+        fout << ((side > 0) ? 1 : -1);
+        for (size_t j = 0; j < indices.size(); ++j) {
+            std::snprintf(buffer, sizeof(buffer), " %d:%.4g", indices[j], values[j]);
+            fout << buffer;
+        }
+        fout << '\n';
+    }
+    
+    size_t bytes = (size_t) fout.tellp();
+    if (!fout) {
+        throw std::runtime_error("Error when writing the scratch file " + fname + ".");
+    }
+    return bytes;
+}
+
+/* times f repeats times, f returns the amount of work it did (bytes, rows, non-zeros...).
+ * Each sample is rate = work / second, or when per_unit ns per unit of work.
+ */
+template <class F>
+static std::vector<double> sample(int repeats, bool per_unit, F f) {
+    std::vector<double> samples;
+    for (int r = 0; r < repeats; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        double work = f();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        samples.push_back(per_unit ? 1e9 * elapsed.count() / work : work / elapsed.count());
+    }
+    return samples;
+}
+
+// one entry of the results array, higher_is_better tells regressions apart
+static void report(JsonWriter& json, const std::string& name, const char* unit, bool higher_is_better,
+                   std::vector<double> samples) {
+    json.beginObject();
+    json.member("name", name);
+    json.member("unit", unit);
+    json.member("higher_is_better", higher_is_better);
+    
+    json.key("samples");
+    json.beginArray();
+    for (double s: samples) {
+        json.value(s);
+    }
+    json.endArray();
+    
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    double median = (n % 2) ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+    json.member("median", median);
+    json.member("min", samples.front());
+    json.member("max", samples.back());
+    json.endObject();
+    
+    std::cerr << name << ": " << median << ' ' << unit << '\n';
+}
+
+// q-quantile of sorted values
+static double quantile(const std::vector<double>& sorted, double q) {
+    return sorted[std::min(sorted.size() - 1, (size_t) (q * sorted.size()))];
+}
+
+/* latency entry: every repeat times each of the calls calls of f separately (ns, the clock
+ * reads included). The samples are the p99 of each repeat, p50 / p99 / p999 the medians over
+ * the repeats.
+ */
+template <class F>
+static void reportLatency(JsonWriter& json, const std::string& name, int repeats, size_t calls, F f) {
+    std::vector<double> p50, p99, p999;
+    std::vector<double> latencies(calls);
+    
+    for (int r = 0; r < repeats; ++r) {
+        for (size_t i = 0; i < calls; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            f(i);
+            latencies[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+        std::sort(latencies.begin(), latencies.end());
+        p50.push_back(quantile(latencies, 0.5));
+        p99.push_back(quantile(latencies, 0.99));
+        p999.push_back(quantile(latencies, 0.999));
+    }
+    
+    std::sort(p50.begin(), p50.end());
+    std::sort(p999.begin(), p999.end());
+    
+    json.beginObject();
+    json.member("name", name);
+    json.member("unit", "ns p99");
+    json.member("higher_is_better", false);
+    
+    json.key("samples");
+    json.beginArray();
+    for (double s: p99) {
+        json.value(s);
+    }
+    json.endArray();
+    
+    std::sort(p99.begin(), p99.end());
+    json.member("median", quantile(p99, 0.5));
+    json.member("min", p99.front());
+    json.member("max", p99.back());
+    json.member("p50", quantile(p50, 0.5));
+    json.member("p99", quantile(p99, 0.5));
+    json.member("p999", quantile(p999, 0.5));
+    json.endObject();
+    
+    std::cerr << name << ": p50 " << quantile(p50, 0.5) << " p99 " << quantile(p99, 0.5) << " p999 "
+              << quantile(p999, 0.5) << " ns\n";
+}
+
+static ConvexPolytopeMachine* newModel(const StochasticDataAdaptor& dataset, int k, bool hashed,
+                                       unsigned int seed) {
+    size_t n_positives = dataset.getCountsPerClass().find(1)->second;
+    return new ConvexPolytopeMachine(1, (int) dataset.getDimensions(), (unsigned short) k,
+                                     1e-4f / dataset.getNInstances(), 0.0f, 0.5f, 0.5f, n_positives, seed,
+                                     false, Pegasos, 0.1f, 0, std::vector<int>(), hashed);
+}
+
+// validates the config and writes the scratch dataset, returns its size in bytes
+static size_t prepare(const SuiteConfig& config, size_t& n_instances, size_t& steps) {
+    if (config.repeats < 1 || config.scale <= 0) {
+        throw std::runtime_error("The suite needs at least one repeat and a positive scale.");
+    }
+    
+    n_instances = std::max((size_t) 100, (size_t) (config.scale * base_instances));
+    steps = std::max((size_t) 1000, (size_t) (config.scale * base_steps));
+    
+    std::cerr << "Writing " << n_instances << " instances to " << config.scratch << '\n';
+    return writeDataset(config.scratch, n_instances, config.seed);
+}
+
+// opens the report object and its results array
+static void beginReport(JsonWriter& json, const char* suite, const SuiteConfig& config, size_t n_instances,
+                        size_t steps, size_t file_bytes) {
+    json.beginObject();
+    json.member("suite", suite);
+    json.member("suite_version", 1);
+    
+    json.key("config");
+    json.beginObject();
+    json.member("seed", (size_t) config.seed);
+    json.member("scale", config.scale);
+    json.member("repeats", config.repeats);
+    json.member("instances", n_instances);
+    json.member("dimensions", dimensions);
+    json.member("steps", steps);
+    json.member("file_bytes", file_bytes);
+    json.endObject();
+    
+    json.key("results");
+    json.beginArray();
+}
+
+static StochasticDataAdaptor* load(const std::string& fname, size_t n_instances) {
+    StochasticDataAdaptor* dataset = new StochasticDataAdaptor(fname.c_str(), n_instances);
+    if (dataset->getNInstances() != n_instances) {
+        delete dataset;
+        throw std::runtime_error("Error when reading back the scratch file " + fname + ".");
+    }
+    return dataset;
+}
+
+void run(const SuiteConfig& config, std::ostream& out) {
+    size_t n_instances, steps;
+    const size_t file_bytes = prepare(config, n_instances, steps);
+    const int repeats = config.repeats;
+    
+    JsonWriter json(out);
+    beginReport(json, "micro", config, n_instances, steps, file_bytes);
+    
+    // parsing, the last dataset loaded is kept for the other cases
+    StochasticDataAdaptor* dataset = nullptr;
+    report(json, "parse libsvm", "MB/s", true, sample(repeats, false, [&]() {
+        delete dataset;
+        dataset = load(config.scratch, n_instances);
+        return file_bytes / (1024.0 * 1024.0);
+    }));
+    std::remove(config.scratch.c_str());
+    
+    std::vector<const SparseVector*> instances;
+    size_t non_zeros = 0;
+    for (size_t i = 0; i < n_instances; ++i) {
+        instances.push_back(&std::get<1>(dataset->getInstance(i)));
+        non_zeros += instances.back()->getSize();
+    }
+    
+    // SparseVector construction, from text (without the label) and from index and value arrays
+    std::vector<std::string> lines;
+    std::vector<int> indices;
+    std::vector<float> values;
+    std::vector<size_t> offsets = {0};
+    for (auto s: instances) {
+        lines.push_back(*s->toLibSVMFormat());
+        
+        char* curr = &lines.back()[0];
+        char* next = nullptr;
+        while (true) {
+            long index = std::strtol(curr, &next, 10);
+            if (next == curr || *next != ':') break;
+            indices.push_back((int) index);
+            values.push_back(std::strtof(next + 1, &curr));
+        }
+        offsets.push_back(indices.size());
+    }
+    
+    report(json, "sparse_vector text", "ns/nnz", false, sample(repeats, true, [&]() {
+        size_t total = 0;
+        for (auto const& line: lines) {
+            total += SparseVector(line.c_str(), 100).getSize();
+        }
+        sink = (double) total;
+        return (double) non_zeros;
+    }));
+    
+    report(json, "sparse_vector arrays", "ns/nnz", false, sample(repeats, true, [&]() {
+        size_t total = 0;
+        for (size_t i = 0; i < n_instances; ++i) {
+            total += SparseVector(indices.data() + offsets[i], values.data() + offsets[i],
+                                  offsets[i + 1] - offsets[i]).getSize();
+        }
+        sink = (double) total;
+        return (double) non_zeros;
+    }));
+    
+    lines.clear();
+    lines.shrink_to_fit();
+    
+    // DenseMatrix kernels, the same steps instances are cycled through for every k
+    size_t step_non_zeros = 0;
+    for (size_t t = 0; t < steps; ++t) {
+        step_non_zeros += instances[t % n_instances]->getSize();
+    }
+    
+    for (int k = 1; k <= 64; k *= 2) {
+        DenseMatrix W(dimensions, k);
+        std::vector<double> res(k), a(k);
+        std::vector<float> buffer(3 * k);
+        for (int j = 0; j < k; ++j) {
+            a[j] = 1e-3 / (j + 1.0);
+        }
+        
+        // touches the rows up front, so that page faults are not timed
+        for (auto s: instances) {
+            W.addInplace(*s, a.data());
+        }
+        
+        const std::string suffix = " k=" + std::to_string(k);
+        
+        report(json, "inner" + suffix, "ns/nnz", false, sample(repeats, true, [&]() {
+            double total = 0.0;
+            for (size_t t = 0; t < steps; ++t) {
+                W.inner(*instances[t % n_instances], res.data(), buffer.data());
+                total += res[0];
+            }
+            sink = total;
+            return (double) step_non_zeros;
+        }));
+        
+        report(json, "addInplace" + suffix, "ns/nnz", false, sample(repeats, true, [&]() {
+            for (size_t t = 0; t < steps; ++t) {
+                a[t % k] = -a[t % k];
+                W.addInplace(*instances[t % n_instances], a.data());
+            }
+            return (double) step_non_zeros;
+        }));
+        
+        report(json, "mulInplace" + suffix, "ns/call", false, sample(repeats, true, [&]() {
+            for (size_t t = 0; t < steps; ++t) {
+                W.mulInplace(1.0 - 1e-7);
+            }
+            return (double) steps;
+        }));
+    }
+    
+    // full SGD steps from scratch, then inference, metrics and model file on the trained model
+    ConvexPolytopeMachine* model = nullptr;
+    const std::string suffix = " k=" + std::to_string(model_classifiers);
+    
+    report(json, "oneStep" + suffix, "steps/s", true, sample(repeats, false, [&]() {
+        delete model;
+        model = newModel(*dataset, model_classifiers, false, config.seed);
+        for (size_t t = 0; t < steps; ++t) {
+            model->oneStep(dataset->getInstance(t % n_instances));
+        }
+        return (double) steps;
+    }));
+    
+    report(json, "predict" + suffix, "rows/s", true, sample(repeats, false, [&]() {
+        double total = 0.0;
+        for (auto s: instances) {
+            total += model->predict(*s).first;
+        }
+        sink = total;
+        return (double) n_instances;
+    }));
+    
+    report(json, "measure" + suffix, "rows/s", true, sample(repeats, false, [&]() {
+        sink = (*evalutils::measure(*dataset, *model))[evalutils::Metric::AUC];
+        return (double) n_instances;
+    }));
+    
+    std::string model_text;
+    report(json, "serialize" + suffix, "MB/s", true, sample(repeats, false, [&]() {
+        std::ostringstream ss;
+        model->serializeModel(ss);
+        model_text = ss.str();
+        return model_text.size() / (1024.0 * 1024.0);
+    }));
+    
+    report(json, "deserialize" + suffix, "MB/s", true, sample(repeats, false, [&]() {
+        std::istringstream ss(model_text);
+        delete ConvexPolytopeMachine::deserializeModel(ss);
+        return model_text.size() / (1024.0 * 1024.0);
+    }));
+    
+    // single instance scoring latency, through a SparseVector and from the raw arrays
+    delete model;
+    model = newModel(*dataset, latency_classifiers, false, config.seed);
+    for (size_t t = 0; t < steps; ++t) {
+        model->oneStep(dataset->getInstance(t % n_instances));
+    }
+    std::stringstream model_stream;
+    model->serializeModel(model_stream);
+    CPM* cpm = CPM::deserializeModel(model_stream);
+    const std::string latency_suffix = " k=" + std::to_string(latency_classifiers);
+    
+    // one untimed pass grows the scratch of the raw arrays
+    double total = 0.0;
+    for (size_t i = 0; i < n_instances; ++i) {
+        total += cpm->predict(indices.data() + offsets[i], values.data() + offsets[i], offsets[i + 1] - offsets[i]).first;
+    }
+    
+    reportLatency(json, "predict latency sparse_vector" + latency_suffix, repeats, n_instances, [&](size_t i) {
+        SparseVector sv(indices.data() + offsets[i], values.data() + offsets[i], offsets[i + 1] - offsets[i]);
+        total += cpm->predict(sv).first;
+    });
+    
+    reportLatency(json, "predict latency arrays" + latency_suffix, repeats, n_instances, [&](size_t i) {
+        total += cpm->predict(indices.data() + offsets[i], values.data() + offsets[i], offsets[i + 1] - offsets[i]).first;
+    });
+    sink = total;
+    delete cpm;
+    
+    json.endArray();
+    json.endObject();
+    
+    delete model;
+    delete dataset;
+}
+
+void regression(const SuiteConfig& config, std::ostream& out) {
+    size_t n_instances, steps;
+    const size_t file_bytes = prepare(config, n_instances, steps);
+    const int repeats = config.repeats;
+    
+    JsonWriter json(out);
+    beginReport(json, "regression", config, n_instances, steps, file_bytes);
+    
+    StochasticDataAdaptor* dataset = nullptr;
+    report(json, "load libsvm", "MB/s", true, sample(repeats, false, [&]() {
+        delete dataset;
+        dataset = load(config.scratch, n_instances);
+        return file_bytes / (1024.0 * 1024.0);
+    }));
+    std::remove(config.scratch.c_str());
+    
+    const std::string cache = config.scratch + ".bin";
+    dataset->saveBinary(cache.c_str());
+    std::ifstream cached(cache, std::ios::binary | std::ios::ate);
+    const double cache_megabytes = cached.tellg() / (1024.0 * 1024.0);
+    cached.close();
+    
+    report(json, "load binary", "MB/s", true, sample(repeats, false, [&]() {
+        delete load(cache, n_instances);
+        return cache_megabytes;
+    }));
+    std::remove(cache.c_str());
+    
+    // training and inference over both storages, for small, typical and large k
+    for (bool hashed: {false, true}) {
+        for (int k: {1, 8, 32}) {
+            const std::string suffix = std::string(hashed ? " hashed" : " dense") + " k=" + std::to_string(k);
+            ConvexPolytopeMachine* model = nullptr;
+            
+            report(json, "train" + suffix, "steps/s", true, sample(repeats, false, [&]() {
+                delete model;
+                model = newModel(*dataset, k, hashed, config.seed);
+                for (size_t t = 0; t < steps; ++t) {
+                    model->oneStep(dataset->getInstance(t % n_instances));
+                }
+                return (double) steps;
+            }));
+            
+            report(json, "predict" + suffix, "rows/s", true, sample(repeats, false, [&]() {
+                double total = 0.0;
+                for (size_t i = 0; i < n_instances; ++i) {
+                    total += model->predict(std::get<1>(dataset->getInstance(i))).first;
+                }
+                sink = total;
+                return (double) n_instances;
+            }));
+            
+            if (!hashed && k == model_classifiers) {
+                std::string model_text;
+                report(json, "model write" + suffix, "MB/s", true, sample(repeats, false, [&]() {
+                    std::ostringstream ss;
+                    model->serializeModel(ss);
+                    model_text = ss.str();
+                    return model_text.size() / (1024.0 * 1024.0);
+                }));
+                
+                report(json, "model read" + suffix, "MB/s", true, sample(repeats, false, [&]() {
+                    std::istringstream ss(model_text);
+                    delete ConvexPolytopeMachine::deserializeModel(ss);
+                    return model_text.size() / (1024.0 * 1024.0);
+                }));
+            }
+            
+            delete model;
+        }
+    }
+    
+    json.endArray();
+    json.endObject();
+    
+    delete dataset;
+}
+
+}
@@ -0,0 +1,59 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// bench_suite.h
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#ifndef __cpm__bench_suite__
+#define __cpm__bench_suite__
+
+#include <iostream>
+#include <string>
+
+/* Fixed micro-benchmark suite over a seeded synthetic dataset: parsing, SparseVector
+ * construction, the DenseMatrix kernels for k in {1, 2, ..., 64}, SGD steps, inference,
+ * evalutils::measure, the model file and the single instance scoring latency (p50, p99, p999). The workloads only depend on the seed, so that
+ * the JSON outputs of two commits can be compared case by case.
+ */
+namespace benchsuite {
+
+struct SuiteConfig {
+    unsigned int seed = 0;
+    
+    // every case is timed this many times, the median is reported
+    int repeats = 3;
+    
+    // multiplies the dataset size and the step counts (quick smoke runs, or longer stabler ones)
+    double scale = 1.0;
+    
+    // scratch libSVM file, removed afterwards
+    std::string scratch = "/tmp/cpm_bench_suite.svm";
+};
+
+// runs all the cases and writes the JSON report to out, progress goes to std::cerr
+void run(const SuiteConfig& config, std::ostream& out);
+
+/* the end to end cases the regression harness (scripts/bench_compare.py) compares across builds:
+ * dataset load (libSVM and binary cache), training steps and inference rows per second for
+ * dense and hashed storages at k = 1, 8, 32, and the model file round trip. Same JSON format.
+ */
+void regression(const SuiteConfig& config, std::ostream& out);
+
+}
+
+#endif /* defined(__cpm__bench_suite__) */
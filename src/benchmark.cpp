@@ -0,0 +1,723 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// benchmark.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+// Micro-benchmarks of the weight storage, on synthetic sparse data.
+// --suite and --regression run the fixed benchmark suites of bench_suite.h instead,
+// --check the numerical checks of make check, and the model checks of check_suite.h on --data.
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <map>
+#include <sstream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "option_parser.h"
+#include "sparse_vector.h"
+#include "dense_matrix.h"
+#include "page_allocator.h"
+#include "stochastic_data_adaptor.h"
+#include "bench_suite.h"
+#include "check_suite.h"
+
+// data TLB load misses of the calling thread, when the kernel lets us count them
+class TLBCounter {
+public:
+    TLBCounter() {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    
+    ~TLBCounter() {
+#ifdef __linux__
+        if (fd >= 0) close(fd);
+#endif
+    }
+    
+    void start() {
+#ifdef __linux__
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+    
+    // misses since start, -1 when not available
+    long long stop() {
+        long long count = -1;
+#ifdef __linux__
+        if (fd < 0) return -1;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) count = -1;
+#endif
+        return count;
+    }
+    
+private:
+    int fd = -1;
+};
+
+// random instances with non_zeros features each, drawn among n_features distinct
+// feature indices spread over [0, dimensions)
+std::vector<SparseVector> makeInstances(size_t n_instances, int non_zeros, int n_features, int dimensions,
+                                        unsigned int seed) {
+    std::mt19937 generator(seed);
+    
+    std::vector<int> features(n_features);
+    std::uniform_int_distribution<int> any_index(0, dimensions - 1);
+    for (auto& f: features) {
+        f = any_index(generator);
+    }
+    
+    std::uniform_int_distribution<int> any_feature(0, n_features - 1);
+    std::uniform_real_distribution<float> any_value(0.0f, 1.0f);
+    
+    std::vector<SparseVector> instances;
+    instances.reserve(n_instances);
+    
+    std::vector<int> indices(non_zeros);
+    std::vector<float> values(non_zeros);
+    
+    for (size_t i = 0; i < n_instances; ++i) {
+        for (int j = 0; j < non_zeros; ++j) {
+            indices[j] = features[any_feature(generator)];
+        }
+        std::sort(indices.begin(), indices.end());
+        int len = (int) (std::unique(indices.begin(), indices.end()) - indices.begin());
+        
+        for (int j = 0; j < len; ++j) {
+            values[j] = any_value(generator);
+        }
+        
+        instances.emplace_back(indices.data(), values.data(), (size_t) len);
+    }
+    
+    return instances;
+}
+
+struct StorageConfig {
+    const char* name;
+    bool hashed;
+    bool huge_pages;
+    Precision precision;
+    
+    /* while at step t, prefetches the instance of step t + 2 * prefetch
+     * and the weight rows of step t + prefetch, as CPM::fit does.
+     */
+    int prefetch;
+    
+    // scores and updates with innerKeepRows / addInplaceKeptRows, as ConvexPolytopeMachine::oneStep does
+    bool fused;
+};
+
+/* SGD-like steps (inner, sparse update, decay) then one inference pass.
+ * Returns the inference scores. The largest deviation from the reference
+ * scores (when not empty) is reported.
+ */
+std::vector<double> benchStorage(const StorageConfig& config, pagealloc::NumaPolicy numa,
+                                 const std::vector<SparseVector>& instances, int dimensions, int classifiers,
+                                 size_t steps, const std::vector<double>& reference) {
+    pagealloc::setPolicy(config.huge_pages, numa);
+    TLBCounter tlb;
+    const int prefetch = config.prefetch;
+    
+    auto start = std::chrono::steady_clock::now();
+    DenseMatrix W(dimensions, classifiers, false, Pegasos, 0.1, config.hashed, config.precision);
+    std::chrono::duration<double> alloc_time = std::chrono::steady_clock::now() - start;
+    
+    double* score = new double[classifiers];
+    double* a = new double[classifiers];
+    std::vector<float> buffer(3 * classifiers);
+    std::vector<double> scores;
+    scores.reserve(instances.size() * classifiers);
+    
+    tlb.start();
+    start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < steps; ++t) {
+        const SparseVector& s = instances[t % instances.size()];
+        
+        if (prefetch > 0) {
+            instances[(t + 2 * prefetch) % instances.size()].prefetch();
+            W.prefetch(instances[(t + prefetch) % instances.size()]);
+        }
+        
+        if (config.fused) {
+            W.innerKeepRows(s, score);
+        } else {
+            W.inner(s, score, buffer.data());
+        }
+        
+        for (int k = 0; k < classifiers; ++k) {
+            a[k] = (score[k] > -1.0) ? -1.0/(t + 2.0) : 0.0;
+        }
+        a[t % classifiers] = 1.0/(t + 2.0);
+        
+        if (config.fused) {
+            W.addInplaceKeptRows(s, a);
+        } else {
+            W.addInplace(s, a);
+        }
+        W.mulInplace(1.0 - 1.0/(t + 2.0));
+    }
+    std::chrono::duration<double> train_time = std::chrono::steady_clock::now() - start;
+    long long train_misses = tlb.stop();
+    
+    start = std::chrono::steady_clock::now();
+    for (auto const& s: instances) {
+        W.inner(s, score, buffer.data());
+        scores.insert(scores.end(), score, score + classifiers);
+    }
+    std::chrono::duration<double> infer_time = std::chrono::steady_clock::now() - start;
+    
+    double deviation = 0.0;
+    double magnitude = 0.0;
+    for (size_t i = 0; i < reference.size(); ++i) {
+        deviation = std::max(deviation, std::fabs(scores[i] - reference[i]));
+        magnitude = std::max(magnitude, std::fabs(reference[i]));
+    }
+    
+    std::cout << config.name << '\t'
+    << (config.precision == SinglePrecision ? "single" : "double") << '\t'
+    << prefetch << '\t'
+    << (config.fused ? "yes" : "no") << '\t'
+    << alloc_time.count() << '\t'
+    << 1e9 * train_time.count() / steps << '\t'
+    << ((train_misses < 0) ? -1.0 : ((double) train_misses) / steps) << '\t'
+    << 1e9 * infer_time.count() / instances.size() << '\t'
+    << W.getNRows() << '\t'
+    << W.memoryUsage() / (1024.0 * 1024.0) << '\t'
+    << ((magnitude > 0) ? deviation / magnitude : 0.0) << '\n';
+    
+    delete[] score;
+    delete[] a;
+    
+    return scores;
+}
+
+/* whole matrix passes over a dense averaged storage, after a few updates.
+ * The rescale is forced by decaying the weights below the rescaling threshold,
+ * and checked against the scores before it.
+ */
+void benchPasses(const std::vector<SparseVector>& instances, int dimensions, int classifiers) {
+    DenseMatrix W(dimensions, classifiers, true);
+    
+    // every row is touched once up front, so that page faults are not timed
+    W.clear();
+    
+    double* a = new double[classifiers];
+    for (int k = 0; k < classifiers; ++k) {
+        a[k] = 1.0/(k + 1.0);
+    }
+    for (size_t t = 0; t < std::min(instances.size(), (size_t) 1000); ++t) {
+        W.addInplace(instances[t], a);
+        W.mulInplace(0.99);
+        W.accumulateAverage();
+    }
+    
+    double* before = new double[classifiers];
+    double* after = new double[classifiers];
+    std::vector<float> buffer(3 * classifiers);
+    W.inner(instances[0], before, buffer.data());
+    
+    auto start = std::chrono::steady_clock::now();
+    W.mulInplace(1e-21);
+    std::chrono::duration<double> rescale_time = std::chrono::steady_clock::now() - start;
+    W.mulInplace(1e21);
+    
+    W.inner(instances[0], after, buffer.data());
+    double deviation = 0.0;
+    for (int k = 0; k < classifiers; ++k) {
+        deviation = std::max(deviation, std::fabs(after[k] - before[k]) / std::max(1e-300, std::fabs(before[k])));
+    }
+    
+    start = std::chrono::steady_clock::now();
+    double norm = W.l2norm();
+    std::chrono::duration<double> l2norm_time = std::chrono::steady_clock::now() - start;
+    
+    start = std::chrono::steady_clock::now();
+    W.clear();
+    std::chrono::duration<double> clear_time = std::chrono::steady_clock::now() - start;
+    
+    std::cout << "\npass\ttime (s)\n"
+    << "rescale\t" << rescale_time.count() << '\n'
+    << "l2norm\t" << l2norm_time.count() << '\n'
+    << "clear\t" << clear_time.count() << '\n'
+    << "(l2 norm " << norm << ", rescale relative deviation " << deviation << ")\n";
+    
+    delete[] a;
+    delete[] before;
+    delete[] after;
+}
+
+// largest of two errors, NaN if either is (std::max would drop a NaN second argument)
+double worst(double a, double b) {
+    return (a >= b || std::isnan(a)) ? a : b;
+}
+
+// dense storages of the checks are skipped beyond this many weights (1GB), e.g. on hashed real datasets
+const size_t max_check_weights = ((size_t) 1) << 28;
+
+bool denseFits(int dimensions, int classifiers) {
+    return (size_t) dimensions * (size_t) classifiers <= max_check_weights;
+}
+
+/* SGD-like steps with score independent coefficients, so that the double and single
+ * precision (or eager and lazy decay) runs see the same updates, then the scores of all instances.
+ */
+std::vector<double> checkScores(const std::vector<SparseVector>& instances, int dimensions, int classifiers,
+                                size_t steps, bool hashed, Precision precision, bool lazy=false) {
+    DenseMatrix W(dimensions, classifiers, false, Pegasos, 0.1, hashed, precision, lazy);
+    double* a = new double[classifiers];
+    double* score = new double[classifiers];
+    std::vector<float> buffer(3 * classifiers);
+    
+    for (size_t t = 0; t < steps; ++t) {
+        for (int k = 0; k < classifiers; ++k) {
+            a[k] = -1.0/((t + 2.0) * classifiers);
+        }
+        a[t % classifiers] = 1.0/(t + 2.0);
+        W.addInplace(instances[t % instances.size()], a);
+        W.mulInplace(1.0 - 1.0/(t + 2.0));
+    }
+    
+    std::vector<double> scores;
+    scores.reserve(instances.size() * classifiers);
+    for (auto const& s: instances) {
+        W.inner(s, score, buffer.data());
+        scores.insert(scores.end(), score, score + classifiers);
+    }
+    
+    delete[] a;
+    delete[] score;
+    return scores;
+}
+
+/* single precision scores against the double precision ones, for both storages: the largest
+ * score difference relative to the largest score must be within tolerance
+ */
+bool checkPrecision(const std::vector<SparseVector>& instances, int dimensions, int classifiers, size_t steps,
+                    double tolerance) {
+    bool ok = true;
+    for (bool hashed: {false, true}) {
+        if (!hashed && !denseFits(dimensions, classifiers)) {
+            std::cout << "single precision, dense: skipped, " << dimensions << " dimensions\n";
+            continue;
+        }
+        auto reference = checkScores(instances, dimensions, classifiers, steps, hashed, DoublePrecision);
+        auto scores = checkScores(instances, dimensions, classifiers, steps, hashed, SinglePrecision);
+        
+        double deviation = 0.0;
+        double magnitude = 0.0;
+        for (size_t i = 0; i < reference.size(); ++i) {
+            deviation = worst(deviation, std::fabs(scores[i] - reference[i]));
+            magnitude = std::max(magnitude, std::fabs(reference[i]));
+        }
+        deviation = (magnitude > 0) ? deviation / magnitude : 0.0;
+        
+        bool passed = deviation <= tolerance;
+        ok = ok && passed;
+        std::cout << "single precision, " << (hashed ? "hashed" : "dense") << ": relative deviation "
+        << deviation << " (tolerance " << tolerance << ") " << (passed ? "ok" : "FAILED") << '\n';
+    }
+    return ok;
+}
+
+/* lazy decay against the scales (eager), for both storages: the scores after the same steps must be
+ * within 1e-5 of the largest score. The lazy float rows are rounded at each catch up, the deviation
+ * grows with the steps, which are capped at 10000: a single missed decay is still beyond tolerance.
+ */
+bool checkLazy(const std::vector<SparseVector>& instances, int dimensions, int classifiers, size_t steps) {
+    const double tolerance = 1e-5;
+    steps = std::min(steps, (size_t) 10000);
+    bool ok = true;
+    for (bool hashed: {false, true}) {
+        if (!hashed && !denseFits(dimensions, classifiers)) {
+            std::cout << "lazy decay, dense: skipped, " << dimensions << " dimensions\n";
+            continue;
+        }
+        auto reference = checkScores(instances, dimensions, classifiers, steps, hashed, DoublePrecision);
+        auto scores = checkScores(instances, dimensions, classifiers, steps, hashed, DoublePrecision, true);
+        
+        double deviation = 0.0;
+        double magnitude = 0.0;
+        for (size_t i = 0; i < reference.size(); ++i) {
+            deviation = worst(deviation, std::fabs(scores[i] - reference[i]));
+            magnitude = std::max(magnitude, std::fabs(reference[i]));
+        }
+        deviation = (magnitude > 0) ? deviation / magnitude : 0.0;
+        
+        bool passed = deviation <= tolerance;
+        ok = ok && passed;
+        std::cout << "lazy decay, " << (hashed ? "hashed" : "dense") << ": relative deviation "
+        << deviation << " (tolerance " << tolerance << ") " << (passed ? "ok" : "FAILED") << '\n';
+    }
+    return ok;
+}
+
+// the non-zeros of s, read back from its libSVM line
+std::vector<std::pair<int, float>> entries(const SparseVector& s) {
+    std::vector<std::pair<int, float>> res;
+    std::istringstream line(*s.toLibSVMFormat());
+    int index;
+    char colon;
+    float value;
+    while (line >> index >> colon >> value) {
+        res.emplace_back(index, value);
+    }
+    return res;
+}
+
+/* L1 truncation of lazy storage against a double precision reference which decays and truncates
+ * every weight at every step (the intercepts are decayed only, as in the storage), for both storages:
+ * the scores must be within 1e-5 of the largest score. The penalties zero a part of the weights.
+ */
+bool checkL1(const std::vector<SparseVector>& instances, int dimensions, int classifiers) {
+    const double tolerance = 1e-5;
+    const size_t steps = 2000;
+    
+    // the rows of the first instances, rebuilt from the entries the reference sees
+    const size_t n = std::min(instances.size(), (size_t) 500);
+    std::vector<std::vector<std::pair<int, float>>> rows;
+    std::vector<SparseVector> vectors;
+    for (size_t i = 0; i < n; ++i) {
+        rows.push_back(entries(instances[i]));
+        std::vector<int> indices;
+        std::vector<float> values;
+        for (auto const& e: rows.back()) {
+            indices.push_back(e.first);
+            values.push_back(e.second);
+        }
+        vectors.emplace_back(indices.data(), values.data(), indices.size());
+    }
+    
+    bool ok = true;
+    for (bool hashed: {false, true}) {
+        if (!hashed && !denseFits(dimensions, classifiers)) {
+            std::cout << "l1 truncation, dense: skipped, " << dimensions << " dimensions\n";
+            continue;
+        }
+        DenseMatrix W(dimensions, classifiers, false, Pegasos, 0.1, hashed, DoublePrecision, true);
+        std::map<int, std::vector<double>> reference;
+        std::vector<double> intercept(classifiers, 0.0);
+        std::vector<double> a(classifiers);
+        
+        for (size_t t = 0; t < steps; ++t) {
+            for (int k = 0; k < classifiers; ++k) {
+                a[k] = -1.0/((t + 2.0) * classifiers);
+            }
+            a[t % classifiers] = 1.0/(t + 2.0);
+            const double decay = 1.0 - 1.0/(t + 2.0);
+            const double penalty = 0.05/((t + 2.0) * classifiers);
+            
+            W.addInplace(vectors[t % n], a.data());
+            W.mulInplace(decay);
+            W.truncate(penalty);
+            
+            for (auto const& e: rows[t % n]) {
+                auto& w = reference[e.first];
+                w.resize(classifiers, 0.0);
+                for (int k = 0; k < classifiers; ++k) {
+                    w[k] += a[k] * e.second;
+                }
+            }
+            for (int k = 0; k < classifiers; ++k) {
+                intercept[k] = (intercept[k] + a[k]) * decay;
+            }
+            for (auto& r: reference) {
+                for (double& w: r.second) {
+                    w = std::copysign(std::max(std::fabs(w * decay) - penalty, 0.0), w);
+                }
+            }
+        }
+        
+        size_t zeros = 0;
+        size_t weights = 0;
+        for (auto const& r: reference) {
+            zeros += std::count(r.second.begin(), r.second.end(), 0.0);
+            weights += r.second.size();
+        }
+        
+        double deviation = 0.0;
+        double magnitude = 0.0;
+        std::vector<double> score(classifiers);
+        std::vector<float> buffer(3 * classifiers);
+        for (size_t i = 0; i < n; ++i) {
+            W.inner(vectors[i], score.data(), buffer.data());
+            for (int k = 0; k < classifiers; ++k) {
+                double expected = intercept[k];
+                for (auto const& e: rows[i]) {
+                    expected += e.second * reference[e.first][k];
+                }
+                deviation = worst(deviation, std::fabs(score[k] - expected));
+                magnitude = std::max(magnitude, std::fabs(expected));
+            }
+        }
+        deviation = (magnitude > 0) ? deviation / magnitude : 0.0;
+        
+        bool passed = deviation <= tolerance;
+        ok = ok && passed;
+        std::cout << "l1 truncation, " << (hashed ? "hashed" : "dense") << ": relative deviation "
+        << deviation << " (tolerance " << tolerance << ") " << (passed ? "ok" : "FAILED") << ", "
+        << (weights > 0 ? 100.0 * zeros / weights : 0.0) << "% of the weights at zero\n";
+    }
+    return ok;
+}
+
+/* rescale and clear of dense storage: a forced rescale must change the scores by at most
+ * 1e-9 relative, and a clear after it must leave an exact, finite storage behind
+ * (clear once reset the scales to 0, which made their reciprocals infinite)
+ */
+bool checkPasses(const std::vector<SparseVector>& instances, int dimensions, int classifiers) {
+    if (!denseFits(dimensions, classifiers)) {
+        std::cout << "rescale and clear: skipped, " << dimensions << " dimensions\n";
+        return true;
+    }
+    
+    bool ok = true;
+    for (bool averaged: {false, true}) {
+        DenseMatrix W(dimensions, classifiers, averaged);
+        double* a = new double[classifiers];
+        double* before = new double[classifiers];
+        double* after = new double[classifiers];
+        std::vector<float> buffer(3 * classifiers);
+        
+        for (int k = 0; k < classifiers; ++k) {
+            a[k] = 1.0/(k + 1.0);
+        }
+        
+        const size_t n = std::min(instances.size(), (size_t) 1000);
+        for (size_t t = 0; t < n; ++t) {
+            W.addInplace(instances[t], a);
+            W.mulInplace(0.99);
+            if (averaged) W.accumulateAverage();
+        }
+        
+        // the decay takes the scales below the rescaling threshold, the growth brings them back
+        std::vector<double> reference;
+        for (size_t t = 0; t < n; ++t) {
+            W.inner(instances[t], before, buffer.data());
+            reference.insert(reference.end(), before, before + classifiers);
+        }
+        W.mulInplace(1e-21);
+        W.mulInplace(1e21);
+        
+        double deviation = 0.0;
+        double magnitude = 0.0;
+        for (size_t t = 0; t < n; ++t) {
+            W.inner(instances[t], after, buffer.data());
+            for (int k = 0; k < classifiers; ++k) {
+                double expected = reference[t * classifiers + k];
+                deviation = worst(deviation, std::fabs(after[k] - expected));
+                magnitude = std::max(magnitude, std::fabs(expected));
+            }
+        }
+        deviation = (magnitude > 0) ? deviation / magnitude : 0.0;
+        bool passed = deviation <= 1e-9;
+        ok = ok && passed;
+        std::cout << "rescale" << (averaged ? ", averaged" : "") << ": relative score change " << deviation
+        << " (tolerance 1e-09) " << (passed ? "ok" : "FAILED") << '\n';
+        
+        // after clear, w_k = a_k * s up to float rounding and the intercepts a_k * bias,
+        // so that s.w_k = a_k (|s|^2 + bias^2)
+        W.mulInplace(1e-21);
+        W.clear();
+        const SparseVector& s = instances[0];
+        W.addInplace(s, a);
+        if (averaged) W.accumulateAverage();
+        W.inner(s, after, buffer.data());
+        
+        const double norm2 = s.getNorm() * s.getNorm();
+        double error = 0.0;
+        for (int k = 0; k < classifiers; ++k) {
+            double expected = a[k] * (norm2 + W.bias * W.bias);
+            error = worst(error, std::fabs(after[k] - expected) / std::max(1e-300, std::fabs(expected)));
+        }
+        passed = std::isfinite(W.l2norm()) && (error <= 1e-6);
+        ok = ok && passed;
+        std::cout << "clear" << (averaged ? ", averaged" : "") << ": relative score error " << error
+        << " (tolerance 1e-06) " << (passed ? "ok" : "FAILED") << '\n';
+        
+        delete[] a;
+        delete[] before;
+        delete[] after;
+    }
+    return ok;
+}
+
+int main(int argc, char* const argv[]) {
+    OptionParser op("Benchmark the dense and hashed weight storages on synthetic sparse data.");
+    
+    op.addOption("number of dimensions (feature index space).", 'd', "dimensions", true, (int) 10000000, nullptr);
+    op.addOption("number of distinct features actually used.", '\0', "features", true, (int) 100000, nullptr);
+    op.addOption("non-zeros per instance.", '\0', "non_zeros", true, (int) 50, nullptr);
+    op.addOption("number of classifiers.", 'k', "classifiers", true, (int) 8, nullptr);
+    op.addOption("number of distinct instances.", '\0', "instances", true, (int) 100000, nullptr);
+    op.addOption("number of update steps.", 'i', "iterations", true, (int) 1000000, nullptr);
+    op.addOption("random seed.", '\0', "seed", true, (int) 0, nullptr);
+    const std::vector<const char*> numa_policies = {"first_touch", "interleave"};
+    op.addOption("NUMA placement of the weights.", '\0', "numa", true, "first_touch", &numa_policies);
+    op.addOption("prefetch distance in steps, each storage is also run without prefetching (0: none).", '\0',
+                 "prefetch", true, (int) 4, nullptr);
+    
+    op.addOption("run the fixed suite (parsing, kernels for k = 1..64, SGD, inference, model file) and report JSON.",
+                 '\0', "suite", true, false);
+    op.addOption("run the end to end cases compared across builds by scripts/bench_compare.py and report JSON.",
+                 '\0', "regression", true, false);
+    op.addOption("suites: JSON report file (default: standard output).", '\0', "json", false, "", nullptr);
+    op.addOption("suites: timings per case, the median is reported.", '\0', "repeats", true, (int) 3, nullptr);
+    op.addOption("suites: multiplier of the dataset size and step counts.", '\0', "scale", true, 1.0f, nullptr);
+    op.addOption("suites: scratch libSVM file.", '\0', "scratch", true, "/tmp/cpm_bench_suite.svm", nullptr);
+    
+    op.addOption("run the numerical checks (single precision deviation, lazy decay, L1, rescale, clear) and, with data, the model checks (model file round trips of hashed and compacted data, prune, early exit, server), exits with 1 if one fails.", '\0',
+                 "check", true, false);
+    op.addOption("checks: libSVM file or binary cache of the instances (default: synthetic ones).", '\0', "data",
+                 false, "", nullptr);
+    op.addOption("checks: largest single precision score deviation, relative to the largest score.", '\0',
+                 "tolerance", true, 1e-5f, nullptr);
+    
+    op.parseCmdString(argc, argv);
+    
+    if (op.getBool("suite") || op.getBool("regression")) {
+        benchsuite::SuiteConfig config;
+        config.seed = (unsigned int) op.getInt("seed");
+        config.repeats = op.getInt("repeats");
+        config.scale = op.getFloat("scale");
+        config.scratch = op.getString("scratch");
+        
+        auto suite = op.getBool("regression") ? benchsuite::regression : benchsuite::run;
+        
+        if (std::strlen(op.getString("json")) == 0) {
+            suite(config, std::cout);
+        } else {
+            std::ofstream fout(op.getString("json"));
+            if (!fout) {
+                std::cerr << "Cannot open " << op.getString("json") << '\n';
+                return 1;
+            }
+            suite(config, fout);
+        }
+        return 0;
+    }
+    
+    int dimensions = op.getInt("dimensions");
+    const int classifiers = op.getInt("classifiers");
+    const size_t steps = (size_t) op.getInt("iterations");
+    
+    if (op.getBool("check")) {
+        std::vector<SparseVector> instances;
+        if (std::strlen(op.getString("data")) > 0) {
+            try {
+                StochasticDataAdaptor dataset(op.getString("data"));
+                for (size_t i = 0; i < dataset.getNInstances(); ++i) {
+                    instances.push_back(std::get<1>(dataset.getInstance(i)));
+                }
+                dimensions = (int) dataset.getDimensions();
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << '\n';
+                return 1;
+            }
+        } else {
+            instances = makeInstances((size_t) op.getInt("instances"), op.getInt("non_zeros"),
+                                      op.getInt("features"), dimensions, (unsigned int) op.getInt("seed"));
+        }
+        if (instances.empty()) {
+            std::cerr << "No instance to check.\n";
+            return 1;
+        }
+        
+        bool ok = checkPrecision(instances, dimensions, classifiers, steps, op.getFloat("tolerance"));
+        ok = checkLazy(instances, dimensions, classifiers, steps) && ok;
+        ok = checkL1(instances, dimensions, classifiers) && ok;
+        ok = checkPasses(instances, dimensions, classifiers) && ok;
+        if (std::strlen(op.getString("data")) > 0) {
+            try {
+                ok = checksuite::hashing(op.getString("data")) && ok;
+                ok = checksuite::compaction(op.getString("data")) && ok;
+                ok = checksuite::pruning(op.getString("data")) && ok;
+                ok = checksuite::earlyExit(op.getString("data")) && ok;
+                ok = checksuite::server(op.getString("data")) && ok;
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << '\n';
+                return 1;
+            }
+        }
+        return ok ? 0 : 1;
+    }
+    
+    auto instances = makeInstances((size_t) op.getInt("instances"), op.getInt("non_zeros"), op.getInt("features"),
+                                   dimensions, (unsigned int) op.getInt("seed"));
+    
+    const pagealloc::NumaPolicy numa = (0 == std::strcmp(op.getString("numa"), "interleave")) ?
+                                       pagealloc::Interleave : pagealloc::FirstTouch;
+    
+    // dTLB misses are -1 when performance counters are not accessible
+    std::vector<int> distances = {0};
+    if (op.getInt("prefetch") > 0) distances.push_back(op.getInt("prefetch"));
+    
+    // the separate score and update passes first, then everything fused
+    std::vector<StorageConfig> configs;
+    configs.push_back({"dense", false, false, DoublePrecision, 0, false});
+    configs.push_back({"hashed", true, false, DoublePrecision, 0, false});
+    for (int d: distances) {
+        for (Precision precision: {DoublePrecision, SinglePrecision}) {
+            configs.push_back({"dense", false, false, precision, d, true});
+            configs.push_back({"dense+huge", false, true, precision, d, true});
+            configs.push_back({"hashed", true, false, precision, d, true});
+            configs.push_back({"hashed+huge", true, true, precision, d, true});
+        }
+    }
+    
+    // deviation: largest score difference to the first (dense, double precision) run,
+    // relative to the largest score
+    std::cout << "storage\tprecision\tprefetch\tfused\talloc (s)\tstep (ns)\tdTLB misses/step\tinference (ns)\trows\t"
+    << "memory (MB)\tdeviation\n";
+    
+    std::vector<double> reference;
+    for (auto const& config: configs) {
+        auto scores = benchStorage(config, numa, instances, dimensions, classifiers, steps, reference);
+        if (reference.empty()) reference = scores;
+    }
+    
+    benchPasses(instances, dimensions, classifiers);
+    
+    return 0;
+}
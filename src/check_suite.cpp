@@ -0,0 +1,426 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// check_suite.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "check_suite.h"
+#include "stochastic_data_adaptor.h"
+#include "cpm.h"
+#include "inference_server.h"
+
+namespace checksuite {
+
+// sub-classifiers of the trained models, and of the pruned ones
+static const int classifiers = 4;
+static const int prune_classifiers = 16;
+
+// the models see each row once, up to this many steps
+static const size_t max_steps = 100000;
+
+// outer class of the checks: the label 1 if present, else the first one
+static int outerLabel(const StochasticDataAdaptor& data) {
+    auto counts = data.getCountsPerClass();
+    if (counts.empty() || counts.count(1) > 0) return 1;
+    return counts.begin()->first;
+}
+
+// a model of the given storage, each row seen once
+static std::unique_ptr<CPM> train(const StochasticDataAdaptor& data, bool sparse_weights, int k=classifiers) {
+    std::unique_ptr<CPM> model(new CPM(k, outerLabel(data), 1e-4f, 0.0f, 1.0f, 1, false, Pegasos, 0.1f,
+                                       sparse_weights));
+    model->fit(data, (int) std::min(data.getNInstances(), max_steps), true, false);
+    return model;
+}
+
+/* largest score difference of the two models, relative to the largest score of reference, each one
+ * scoring its own copy of the rows (hashed or remapped as the model)
+ */
+static double deviation(const CPM& reference, const StochasticDataAdaptor& data,
+                        const CPM& other, const StochasticDataAdaptor& other_data) {
+    double deviation = 0.0;
+    double magnitude = 0.0;
+    for (size_t i = 0; i < data.getNInstances(); ++i) {
+        double expected = reference.predict(std::get<1>(data.getInstance(i))).first;
+        double d = std::fabs(other.predict(std::get<1>(other_data.getInstance(i))).first - expected);
+        deviation = (deviation >= d || std::isnan(deviation)) ? deviation : d;
+        magnitude = std::max(magnitude, std::fabs(expected));
+    }
+    return (magnitude > 0) ? deviation / magnitude : 0.0;
+}
+
+static std::string serialized(const CPM& model) {
+    std::ostringstream ss;
+    model.serializeModel(ss);
+    return ss.str();
+}
+
+// the weights of a model file (the header counts the iterations, which a model read back does not keep)
+static std::string weights(const std::string& file) {
+    size_t start = file.find("### MODEL ###");
+    return (start == std::string::npos) ? std::string() : file.substr(start);
+}
+
+/* prints the line of a case: the deviation must be within tolerance and same true,
+ * failure tells what differed otherwise
+ */
+static bool report(const std::string& name, double deviation, double tolerance, bool same, const char* failure) {
+    bool passed = same && (deviation <= tolerance);
+    std::cout << name << ": relative deviation " << deviation << " (tolerance " << tolerance << ") "
+    << (passed ? "ok" : "FAILED") << (same ? "" : std::string(", ") + failure) << '\n';
+    return passed;
+}
+
+bool hashing(const char* data_file) {
+    // the file rounds the weights to 6 significant digits. The dense encoding needs most rows
+    // to be non-zero, which few hash bits guarantee on any dataset.
+    const double tolerance = 1e-4;
+    
+    struct Case {const char* name; int hash_bits; bool sparse_weights; const char* encoding;};
+    const Case cases[] = {
+        {"model file, 6 hash bits, dense encoding", 6, false, "encoding: dense\n"},
+        {"model file, 18 hash bits, sparse encoding", 18, true, "encoding: sparse\n"}
+    };
+    
+    bool ok = true;
+    for (auto const& c: cases) {
+        StochasticDataAdaptor data(data_file, 1000000, c.hash_bits);
+        auto model = train(data, c.sparse_weights);
+        
+        std::string file = serialized(*model);
+        std::istringstream in(file);
+        std::unique_ptr<CPM> read(CPM::deserializeModel(in));
+        
+        bool same = file.find(c.encoding) != std::string::npos && read->getHashBits() == c.hash_bits &&
+                    weights(serialized(*read)) == weights(file);
+        ok = report(c.name, deviation(*model, data, *read, data), tolerance, same,
+                    "hash bits, encoding or weights changed") && ok;
+    }
+    return ok;
+}
+
+bool compaction(const char* data_file) {
+    const double tolerance = 1e-4;
+    
+    bool ok = true;
+    for (bool sparse_weights: {false, true}) {
+        StochasticDataAdaptor data(data_file);
+        data.compact();
+        auto model = train(data, sparse_weights);
+        
+        std::string file = serialized(*model);
+        std::istringstream in(file);
+        std::unique_ptr<CPM> read(CPM::deserializeModel(in));
+        
+        // the rows as a test set would see them: read again and remapped with the table of the model file
+        StochasticDataAdaptor remapped(data_file);
+        remapped.remap(read->getFeatureIds());
+        
+        // the encoding follows the non-zero rows, the weights part of the file includes it
+        bool dense = file.find("encoding: dense\n") != std::string::npos;
+        std::string name = std::string("model file, compacted, ") + (sparse_weights ? "hashed" : "dense") +
+                           " storage (" + (dense ? "dense" : "sparse") + " encoding)";
+        bool same = read->getFeatureIds() == data.getFeatureIds() && weights(serialized(*read)) == weights(file);
+        ok = report(name, deviation(*model, data, *read, remapped), tolerance, same,
+                    "feature ids or weights changed") && ok;
+    }
+    return ok;
+}
+
+bool pruning(const char* data_file) {
+    // the kept weights are rounded to float once scaled, as in the model file
+    const double tolerance = 1e-5;
+    
+    // compacted, so that the dense storage of 16 classifiers fits
+    StochasticDataAdaptor data(data_file);
+    data.compact();
+    auto model = train(data, false, prune_classifiers);
+    const size_t n = data.getNInstances();
+    
+    std::vector<double> before(n);
+    std::vector<size_t> wins(prune_classifiers, 0);
+    double magnitude = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        auto score_index = model->predict(std::get<1>(data.getInstance(i)));
+        before[i] = score_index.first;
+        wins[score_index.second]++;
+        magnitude = std::max(magnitude, std::fabs(before[i]));
+    }
+    
+    bool ok = true;
+    for (double max_win_rate: {0.0, 0.1}) {
+        PruneReport summary;
+        std::unique_ptr<CPM> pruned(model->prune(data, max_win_rate, &summary));
+        
+        std::vector<int> kept;
+        for (int i = 0; i < prune_classifiers; ++i) {
+            if (wins[i] > max_win_rate * n) kept.push_back(i);
+        }
+        if (kept.empty()) {
+            kept.push_back((int) (std::max_element(wins.begin(), wins.end()) - wins.begin()));
+        }
+        
+        // scores of the pruned model, which only decrease beyond rounding when winning classifiers are dropped
+        double max_change = 0.0;
+        size_t flipped = 0;
+        for (size_t i = 0; i < n; ++i) {
+            double after = pruned->predict(std::get<1>(data.getInstance(i))).first;
+            max_change = std::max(max_change, before[i] - after);
+            if ((before[i] > 0.0) && (after <= 0.0)) flipped++;
+        }
+        
+        // without dropped winners the scores stay, else the report must tell the measured changes
+        double deviation = (max_win_rate == 0.0) ? max_change : std::fabs(max_change - summary.max_change);
+        deviation = (magnitude > 0) ? deviation / magnitude : 0.0;
+        bool same = summary.kept == kept && pruned->k == (int) kept.size() && summary.wins == wins &&
+                    summary.flipped_rows == flipped && (max_win_rate > 0.0 || summary.changed_rows == 0);
+        
+        std::ostringstream name;
+        name << "prune, max win rate " << max_win_rate << " (" << kept.size() << " of " << prune_classifiers
+        << " kept)";
+        ok = report(name.str(), deviation, tolerance, same, "kept classifiers or report differ") && ok;
+    }
+    return ok;
+}
+
+bool earlyExit(const char* data_file) {
+    StochasticDataAdaptor data(data_file);
+    data.compact();
+    const size_t n = data.getNInstances();
+    
+    bool ok = true;
+    for (bool sparse_weights: {false, true}) {
+        auto model = train(data, sparse_weights);
+        model->prepareEarlyExit();
+        
+        std::vector<double> scores(n);
+        std::vector<int> assignments(n);
+        double magnitude = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            std::tie(scores[i], assignments[i]) = model->predict(std::get<1>(data.getInstance(i)));
+            magnitude = std::max(magnitude, std::fabs(scores[i]));
+        }
+        
+        // the bounded sums add the same terms in another order: a score within rounding
+        // of the threshold (the median score is one) may fall on either side
+        const double rounding = 1e-9 * magnitude;
+        std::vector<double> sorted(scores);
+        std::nth_element(sorted.begin(), sorted.begin() + n / 2, sorted.end());
+        
+        // at 0 most rows are far below the threshold, at the median half of them are above it
+        for (double threshold: {0.0, sorted[n / 2]}) {
+            size_t differ = 0;
+            size_t features = 0;
+            size_t total = 0;
+            for (size_t i = 0; i < n; ++i) {
+                const SparseVector& s = std::get<1>(data.getInstance(i));
+                size_t read = 0;
+                bool exceeds = model->exceeds(s, threshold, &read);
+                if (exceeds != (scores[i] > threshold) && std::fabs(scores[i] - threshold) > rounding) differ++;
+                features += read;
+                total += s.getSize();
+            }
+            
+            bool passed = differ == 0;
+            ok = ok && passed;
+            std::cout << "early exit, " << (sparse_weights ? "hashed" : "dense") << " storage, threshold "
+            << threshold << ": " << differ << " of " << n << " decisions differ, "
+            << (total > 0 ? 100.0 * features / total : 0.0) << "% of the features read "
+            << (passed ? "ok" : "FAILED") << '\n';
+        }
+        
+        size_t differ = 0;
+        size_t features = 0;
+        size_t total = 0;
+        for (size_t i = 0; i < n; ++i) {
+            const SparseVector& s = std::get<1>(data.getInstance(i));
+            size_t read = 0;
+            if (model->assign(s, &read) != assignments[i]) differ++;
+            features += read;
+            total += s.getSize();
+        }
+        
+        bool passed = differ == 0;
+        ok = ok && passed;
+        std::cout << "early exit, " << (sparse_weights ? "hashed" : "dense") << " storage, assignment: " << differ
+        << " of " << n << " assignments differ, " << (total > 0 ? 100.0 * features / total : 0.0)
+        << "% of the features read " << (passed ? "ok" : "FAILED") << '\n';
+    }
+    return ok;
+}
+
+bool server(const char* data_file) {
+    // the text answers keep 9 significant digits, the binary ones are exact
+    const double tolerance = 1e-8;
+    const size_t max_rows = 1000;
+    const size_t round = 64;
+    
+    StochasticDataAdaptor data(data_file);
+    data.compact();
+    auto model = train(data, false);
+    
+    const std::string base = "/tmp/cpm_check_" + std::to_string(getpid());
+    const std::string model_file = base + ".model";
+    const std::string endpoint = "unix:" + base + ".sock";
+    std::string file = serialized(*model);
+    std::istringstream in(file);
+    std::unique_ptr<CPM> read_back(CPM::deserializeModel(in));
+    
+    // each raw row as a text and as a binary request, answered as the model file scores its features
+    struct Query {std::string request; bool binary; double score; int assignment;};
+    std::vector<Query> queries;
+    StochasticDataAdaptor raw(data_file);
+    const size_t n = std::min(raw.getNInstances(), max_rows);
+    std::vector<int> indices;
+    std::vector<float> values;
+    for (size_t i = 0; i < n; ++i) {
+        std::string line = *std::get<1>(raw.getInstance(i)).toLibSVMFormat();
+        serving::parseLine(line.data(), line.data() + line.size() - 1, indices, values); // up to the newline
+        auto expected = read_back->predict(indices.data(), values.data(), indices.size());
+        
+        std::string binary;
+        serving::encodeRequest(indices.data(), values.data(), (uint32_t) indices.size(), binary);
+        queries.push_back({line, false, expected.first, expected.second});
+        queries.push_back({binary, true, expected.first, expected.second});
+        
+        if (i == n / 2) {
+            // negative indices, rejected in both formats without closing the connection
+            const int negative[] = {1, -3};
+            const float ones[] = {1.0f, 1.0f};
+            std::string rejected;
+            serving::encodeRequest(negative, ones, 2, rejected);
+            queries.push_back({"1 1:1 -3:1\n", false, 0.0, -1});
+            queries.push_back({rejected, true, 0.0, -1});
+        }
+    }
+    
+    serving::ServerConfig config;
+    config.workers = 2;
+    std::ofstream(model_file) << file;
+    std::unique_ptr<serving::Server> server;
+    try {
+        server.reset(new serving::Server(endpoint, model_file, config));
+    } catch (const std::exception&) {
+        std::remove(model_file.c_str());
+        throw;
+    }
+    std::thread running(&serving::Server::run, server.get());
+    
+    double deviation = 0.0;
+    double magnitude = 0.0;
+    size_t differ = 0;
+    size_t rejected = 0;
+    size_t answered = 0;
+    int fd = -1;
+    try {
+        fd = serving::connectTo(endpoint);
+        
+        // a server which does not answer fails the check instead of blocking it
+        timeval timeout = {10, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        
+        std::string buffer;
+        std::vector<char> chunk(1 << 16);
+        size_t sent = 0;
+        while (answered < queries.size()) {
+            if (sent == answered) {
+                std::string out;
+                for (; sent < std::min(queries.size(), answered + round); ++sent) {
+                    out += queries[sent].request;
+                }
+                if (!serving::sendAll(fd, out.data(), out.size())) break;
+            }
+            
+            ssize_t got = read(fd, chunk.data(), chunk.size());
+            if (got <= 0) break;
+            buffer.append(chunk.data(), (size_t) got);
+            
+            size_t pos = 0;
+            while (answered < sent) {
+                const Query& q = queries[answered];
+                double score;
+                int assignment;
+                bool error;
+                if (q.binary) {
+                    if (buffer.size() - pos < serving::binary_answer_bytes) break;
+                    int32_t answer_assignment;
+                    std::memcpy(&score, buffer.data() + pos + 1, sizeof(score));
+                    std::memcpy(&answer_assignment, buffer.data() + pos + 1 + sizeof(score), sizeof(answer_assignment));
+                    assignment = answer_assignment;
+                    error = (assignment == -1) && std::isnan(score);
+                    pos += serving::binary_answer_bytes;
+                } else {
+                    size_t newline = buffer.find('\n', pos);
+                    if (newline == std::string::npos) break;
+                    error = buffer.compare(pos, 7, "error: ") == 0;
+                    char* end = nullptr;
+                    score = error ? 0.0 : std::strtod(buffer.c_str() + pos, &end);
+                    assignment = error ? -1 : (int) std::strtol(end, nullptr, 10);
+                    pos = newline + 1;
+                }
+                
+                if (q.assignment < 0) {
+                    if (error) rejected++;
+                    else differ++;
+                } else if (error || assignment != q.assignment || (q.binary && score != q.score)) {
+                    differ++;
+                } else {
+                    deviation = std::max(deviation, std::fabs(score - q.score));
+                    magnitude = std::max(magnitude, std::fabs(q.score));
+                }
+                answered++;
+            }
+            buffer.erase(0, pos);
+        }
+    } catch (const std::exception& e) {
+        std::cout << "server: " << e.what() << '\n';
+    }
+    if (fd >= 0) close(fd);
+    server->stop();
+    running.join();
+    std::remove(model_file.c_str());
+    
+    std::ostringstream name;
+    name << "server, " << 2 * n << " text and binary requests";
+    bool ok = report(name.str(), (magnitude > 0) ? deviation / magnitude : 0.0, tolerance,
+                     differ == 0 && answered == queries.size(), "answers differ or missing");
+    
+    bool passed = rejected == 2;
+    std::cout << "server, negative indices: " << rejected << " of 2 requests rejected "
+    << (passed ? "ok" : "FAILED") << '\n';
+    return ok && passed;
+}
+
+}
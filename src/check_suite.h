@@ -0,0 +1,64 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// check_suite.h
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#ifndef __cpm__check_suite__
+#define __cpm__check_suite__
+
+/* Behavior checks of cpm_bench --check (make check) over a labeled libSVM file or binary
+ * cache: each one trains small models on data_file, prints one line per case and returns
+ * false if a case failed. The label 1 is the outer class when present, else the first label.
+ */
+namespace checksuite {
+
+/* model file round trips of hashed data, with the dense encoding and with the sparse one
+ * (hashed storage): the model read back keeps the hashing, scores as the original up to the
+ * float rounding of the file, and writes the same file again
+ */
+bool hashing(const char* data_file);
+
+/* model file round trips of compacted data, with dense and hashed storages:
+ * the model read back keeps the feature ids, and scores the rows read again and remapped with them
+ * as the original scores the compacted rows, up to the float rounding of the file
+ */
+bool compaction(const char* data_file);
+
+/* CPM::prune of a model of 16 sub-classifiers against the wins counted on its scores: with max_win_rate 0
+ * the classifiers which never win are dropped and the scores stay, with 0.1 the report tells the
+ * measured largest score decrease and flipped rows
+ */
+bool pruning(const char* data_file);
+
+/* early exit inference (CPM::exceeds and CPM::assign) against the full scores, with dense and hashed
+ * storages: the decisions at the thresholds 0 and the median score (but for scores within rounding of
+ * the threshold), and the assignments, must all agree
+ */
+bool earlyExit(const char* data_file);
+
+/* inference server (serving::Server) on a scratch Unix socket, serving a model of the compacted data:
+ * the first 1000 raw rows sent as text and as binary requests on one connection must be answered as
+ * the model file scores their features, and a request with a negative index must be rejected in both
+ * formats without closing the connection
+ */
+bool server(const char* data_file);
+
+}
+
+#endif /* defined(__cpm__check_suite__) */
@@ -20,31 +20,85 @@
 // akant@cs.berkeley.edu
 
 #include "convex_polytope_machine.h"
+#include "instrumentation.h"
 #include <sstream>
 #include <fstream>
 #include <cmath>
 #include <iomanip>
+#include <vector>
 
 #include <stdexcept>
 
 ConvexPolytopeMachine::ConvexPolytopeMachine(int outer_label, int dim, unsigned short k, float lambda,
                                              float entropy, float negative_cost,
                                              float positive_cost, size_t n_positives,
-                                             unsigned int seed):
+                                             unsigned int seed, bool average,
+                                             Optimizer optimizer, float learning_rate, int hash_bits,
+                                             const std::vector<int>& feature_ids, bool sparse_weights,
+                                             Precision precision, bool lazy_decay, float l1):
         outer_label(outer_label), k(k), lambda(lambda), entropy(entropy), negative_cost(negative_cost),
-        positive_cost(positive_cost), n_positives(n_positives), seed(seed), W(dim, k) {
+        positive_cost(positive_cost), n_positives(n_positives), seed(seed), average(average),
+        optimizer(optimizer), learning_rate(learning_rate), hash_bits(hash_bits),
+        feature_ids(feature_ids), l1(l1),
+        W(dim, k, average, optimizer, learning_rate, sparse_weights, precision, lazy_decay || (l1 > 0.0f)) {
     
     iter = 0;
     distinct_p = 0;
     score = new double[k];
+    inner_buffer = new float[3 * k];
+    inner_unscaled = new double[k];
+    grad_mul = new double[k];
     assignments = new int[n_positives];
     occupancy = new unsigned int[k]();
+    stats = new ClassifierStats[k]();
     
     for (size_t i = 0; i < n_positives; ++i) {
         assignments[i] = -1;
     }
 }
 
+ConvexPolytopeMachine::ConvexPolytopeMachine(const ConvexPolytopeMachine& other, const std::vector<int>& keep) :
+        outer_label(other.outer_label), k((unsigned short) keep.size()), lambda(other.lambda),
+        entropy(other.entropy), negative_cost(other.negative_cost), positive_cost(other.positive_cost),
+        n_positives(other.n_positives), seed(other.seed), average(false), optimizer(Pegasos),
+        learning_rate(other.learning_rate), hash_bits(other.hash_bits), feature_ids(other.feature_ids), l1(other.l1),
+        W(other.W.selectColumns(keep)) {
+    
+    iter = other.iter;
+    distinct_p = other.distinct_p;
+    score = new double[k];
+    inner_buffer = new float[3 * k];
+    inner_unscaled = new double[k];
+    grad_mul = new double[k];
+    occupancy = new unsigned int[k]();
+    stats = new ClassifierStats[k]();
+    
+    std::vector<int> index(other.k, -1); // new index of each old classifier
+    for (unsigned short i = 0; i < k; ++i) {
+        index[keep[i]] = i;
+        occupancy[i] = other.occupancy[keep[i]];
+        stats[i] = other.stats[keep[i]];
+    }
+    
+    assignments = new int[n_positives];
+    for (size_t i = 0; i < n_positives; ++i) {
+        assignments[i] = (other.assignments[i] >= 0) ? index[other.assignments[i]] : -1;
+    }
+}
+
+ConvexPolytopeMachine* ConvexPolytopeMachine::selectClassifiers(const std::vector<int>& keep) const {
+    if (keep.empty()) {
+        throw std::logic_error("At least one sub-classifier must be kept.");
+    }
+    for (int i: keep) {
+        if (i < 0 || i >= k) {
+            throw std::logic_error("Sub-classifier index out of range.");
+        }
+    }
+    
+    return new ConvexPolytopeMachine(*this, keep);
+}
+
 void ConvexPolytopeMachine::clear() {
     iter = 0;
     distinct_p = 0;
@@ -53,13 +107,18 @@ void ConvexPolytopeMachine::clear() {
 
 void ConvexPolytopeMachine::serializeModel(const char* filename) const {
     std::ofstream ss(filename);
-    
-    ss << "version: " << 2 << '\n';
+    serializeModel(ss);
+}
+
+void ConvexPolytopeMachine::serializeModel(std::ostream& ss) const {
+    ss << "version: " << 4 << '\n';
     
     ss << "\n### DATASET ###\n";
     ss << "outer label: " << outer_label << '\n';
     ss << "outer instances: " << n_positives << '\n';
     ss << "dimensions: " << W.dimensions << '\n';
+    ss << "hash bits: " << hash_bits << '\n';
+    ss << "compacted features: " << feature_ids.size() << '\n';
     
     ss << "\n### CPM PARAMETERS ###\n";
     ss << "hyperplanes: " << k << '\n';
@@ -84,19 +143,42 @@ void ConvexPolytopeMachine::serializeModel(const char* filename) const {
     }
     ss << '\n';
     
+    if (!feature_ids.empty()) {
+        ss << "\n### FEATURE IDS ###\n";
+        ss << "ids: ";
+        for (int id: feature_ids) {
+            ss << id << ' ';
+        }
+        ss << '\n';
+    }
+    
+    // the sparse encoding when shorter, e.g. after L1 truncation: an empty dense row takes 2k + 1 characters,
+    // a kept sparse row its index and a space more. It is read back into hashed storage.
+    size_t rows = W.nonZeroRows();
+    size_t index_width = std::to_string(W.dimensions).size() + 1;
+    bool sparse = W.hashed || (rows * index_width < (W.dimensions - rows) * (2 * (size_t) k + 1));
+    
     ss << "\n### MODEL ###\n";
-    ss << "encoding: " << "dense\n";
-    W.serialize(&ss);
+    ss << "encoding: " << (sparse ? "sparse\n" : "dense\n");
+    W.serialize(&ss, sparse);
 }
 
 ConvexPolytopeMachine* ConvexPolytopeMachine::deserializeModel(const char *filename) {
     std::ifstream ss(filename);
     
+    if (!ss) {
+        throw std::runtime_error("Cannot open model file.");
+    }
+    
+    return deserializeModel(ss);
+}
+
+ConvexPolytopeMachine* ConvexPolytopeMachine::deserializeModel(std::istream& ss) {
     int version;
     ss.ignore(std::numeric_limits<std::streamsize>::max(), ':');
     ss >> version;
     
-    if (version != 2) {
+    if (version < 2 || version > 4) {
         throw std::runtime_error("Unsupported model file version.");
     }
     
@@ -112,6 +194,21 @@ ConvexPolytopeMachine* ConvexPolytopeMachine::deserializeModel(const char *filen
     int dimensions;
     ss >> dimensions;
     
+    int hash_bits = 0;
+    if (version >= 3) {
+        ss.ignore(std::numeric_limits<std::streamsize>::max(), ':');
+        ss >> hash_bits;
+    }
+    if (dimensions < 0 || hash_bits < 0 || hash_bits > max_hash_bits) {
+        throw std::runtime_error("Invalid model dimensions.");
+    }
+    
+    size_t n_features = 0;
+    if (version >= 4) {
+        ss.ignore(std::numeric_limits<std::streamsize>::max(), ':');
+        ss >> n_features;
+    }
+    
     ss.ignore(std::numeric_limits<std::streamsize>::max(), ':');
     int k;
     ss >> k;
@@ -141,17 +238,41 @@ ConvexPolytopeMachine* ConvexPolytopeMachine::deserializeModel(const char *filen
     ss >> active;
     
     ss.ignore(std::numeric_limits<std::streamsize>::max(), ':');
+    std::vector<unsigned int> counts(k);
+    for (int i = 0; i < k; ++i) {
+        ss >> counts[i];
+    }
+    
+    std::vector<int> feature_ids(n_features);
+    if (n_features > 0) {
+        ss.ignore(std::numeric_limits<std::streamsize>::max(), ':');
+        for (size_t i = 0; i < n_features; ++i) {
+            ss >> feature_ids[i];
+        }
+    }
+    
     ss.ignore(std::numeric_limits<std::streamsize>::max(), ':');
-    ss.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    std::string encoding;
+    ss >> encoding;
     
-    ConvexPolytopeMachine* cpm = new ConvexPolytopeMachine(outer_label, dimensions, (unsigned short) active, lambda,
+    if (encoding != "dense" && encoding != "sparse") {
+        throw std::runtime_error("Unknown model encoding.");
+    }
+    
+    // W holds all k columns, including the inactive ones
+    ConvexPolytopeMachine* cpm = new ConvexPolytopeMachine(outer_label, dimensions, (unsigned short) k, lambda,
                                                            entropy,
                                                            cost_ratio/(1.0f + cost_ratio),
                                                            1.0f/(1.0f + cost_ratio),
-                                                           n_positives, seed);
+                                                           n_positives, seed, false, Pegasos, 0.1f,
+                                                           hash_bits, feature_ids, encoding == "sparse");
+    for (int i = 0; i < k; ++i) {
+        cpm->occupancy[i] = counts[i];
+    }
     (cpm->W).deserialize(&ss);
     
     if (ss.fail() | ss.eof() | ss.bad()) {
+        delete cpm;
         throw std::runtime_error("Error when reading model file.");
     }
     
@@ -159,23 +280,66 @@ ConvexPolytopeMachine* ConvexPolytopeMachine::deserializeModel(const char *filen
 }
 
 std::pair<double, int> ConvexPolytopeMachine::predict(const SparseVector& s) {
-    W.inner(s, score);
+    return predict(s, score, inner_buffer, inner_unscaled);
+}
+
+std::pair<double, int> ConvexPolytopeMachine::predict(const SparseVector& s, double* res, float* buffer,
+                                                      double* unscaled) const {
+    if (average) {
+        W.averageInner(s, res, buffer, unscaled);
+    } else {
+        W.inner(s, res, buffer);
+    }
     
     int index = 0;
-    double max_score = score[0];
+    double max_score = res[0];
     
     for (int i=1; i<k; ++i) {
-        if (score[i] > max_score) {
+        if (res[i] > max_score) {
             index = i;
-            max_score = score[i];
+            max_score = res[i];
         }
     }
     
-    return std::make_pair(score[index], index);
+    return std::make_pair(res[index], index);
 }
 
+std::pair<double, int> ConvexPolytopeMachine::predict(const IValue* features, size_t n, double* res,
+                                                      float* buffer, double* unscaled) const {
+    W.innerSpan(features, n, res, average, buffer, unscaled);
+    
+    int index = 0;
+    for (int i=1; i<k; ++i) {
+        if (res[i] > res[index]) index = i;
+    }
+    
+    return std::make_pair(res[index], index);
+}
+
+
+bool ConvexPolytopeMachine::exceeds(const SparseVector& s, double threshold, double* res,
+                                    DenseMatrix::BoundedScratch& work, size_t* features) const {
+    double remaining;
+    size_t processed = W.boundedInner(s, res, ThresholdExit, threshold, &remaining, work);
+    if (features) *features = processed;
+    
+    // decided, or exact when all features were processed
+    return *std::max_element(res, res + k) - remaining > threshold;
+}
+
+int ConvexPolytopeMachine::assign(const SparseVector& s, double* res, DenseMatrix::BoundedScratch& work,
+                                  size_t* features) const {
+    double remaining;
+    size_t processed = W.boundedInner(s, res, ArgmaxExit, 0.0, &remaining, work);
+    if (features) *features = processed;
+    
+    // the first max, as predict
+    return (int) (std::max_element(res, res + k) - res);
+}
 
-std::pair<unsigned short, unsigned short> ConvexPolytopeMachine::heuristicMax(const SparseVector s, size_t cid) {
+std::pair<unsigned short, unsigned short> ConvexPolytopeMachine::heuristicMax(const SparseVector& s, size_t cid) {
+    CPM_TIME_STEP(HeuristicMax);
+    
     // true argmax
     unsigned short true_imax = 0;
     double max_score = score[true_imax];
@@ -287,12 +451,16 @@ void ConvexPolytopeMachine::setHistory(size_t cid, unsigned short imax) {
 
 std::tuple<float, float, unsigned short> ConvexPolytopeMachine::oneStep(const std::tuple<int, const SparseVector, size_t>& lsi) {
     
-    const double eta = 1.0/(lambda * (iter + 2.0)); // learning rate
+    // learning rate: adaptive optimizers get raw gradients and use their own rates
+    const double eta = (optimizer == Pegasos) ? 1.0/(lambda * (iter + 2.0)) : 1.0;
     
     const SparseVector& s = std::get<1>(lsi);
     
-    // get all scores
-    W.inner(s, score);
+    // get all scores, the rows of s are kept for the update below
+    {
+        CPM_TIME_STEP(Score);
+        W.innerKeepRows(s, score);
+    }
     
     unsigned short imax;
     double max_score;
@@ -311,13 +479,22 @@ std::tuple<float, float, unsigned short> ConvexPolytopeMachine::oneStep(const st
         
         // compute exclusion loss
         for (unsigned short i = 0; i < k; ++i) {
+            if (score[i] > 0.0) stats[i].fired++;
             if (i != imax) {
-                eloss += std::max(0.0, score[i]);
+                const double excess = std::max(0.0, score[i]);
+                eloss += excess;
+                stats[i].exclusion_loss += excess;
             }
         }
         
+        stats[imax].assigned++;
+        stats[imax].margin_sum += max_score;
+        stats[true_imax].wins++;
+        
         if (max_score < margin) {
-            W.addInplace(s, eta * positive_cost, imax);
+            CPM_TIME_STEP(Update);
+            stats[imax].active++;
+            W.addInplaceKeptRows(s, eta * positive_cost, imax);
         }
         
         setHistory(std::get<2>(lsi), true_imax);
@@ -328,12 +505,13 @@ std::tuple<float, float, unsigned short> ConvexPolytopeMachine::oneStep(const st
         
         // push down all classifiers as needed
         bool active= false;
-        double* grad_mul = new double[k];
         
         for(unsigned short i = 0; i < k; ++i) {
             if (score[i] > -margin) {
                 grad_mul[i] = -eta * negative_cost;
                 active = true;
+                stats[i].active++;
+                if (score[i] > 0.0) stats[i].fired++;
             } else {
                 grad_mul[i] = 0.0;
             }
@@ -344,13 +522,27 @@ std::tuple<float, float, unsigned short> ConvexPolytopeMachine::oneStep(const st
             }
         }
         
-        if (active) W.addInplace(std::get<1>(lsi), grad_mul);
-        delete[] grad_mul;
+        stats[imax].wins++;
+        
+        if (active) {
+            CPM_TIME_STEP(Update);
+            W.addInplaceKeptRows(s, grad_mul);
+        }
     }
     
-    // L2 penalty
-    double coeff = std::max(0.0, 1.0 - eta*lambda);
-    W.mulInplace(coeff);
+    {
+        CPM_TIME_STEP(Decay);
+        
+        // L2 penalty
+        const double step = (optimizer == Pegasos) ? eta : learning_rate;
+        double coeff = std::max(0.0, 1.0 - step * lambda);
+        W.mulInplace(coeff);
+        
+        // L1 penalty, the base learning rate stands for the per entry ones of the adaptive optimizers
+        if (l1 > 0.0f) W.truncate(step * l1);
+        
+        if (average) W.accumulateAverage();
+    }
     
     iter++;
     return std::make_tuple(max_score, eloss, imax);
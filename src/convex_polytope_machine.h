@@ -25,10 +25,23 @@
 #include <iostream>
 #include <random>
 #include <utility>
+#include <vector>
 
 #include "sparse_vector.h"
 #include "dense_matrix.h"
 
+// running statistics of one sub-classifier, accumulated by the training steps
+struct ClassifierStats {
+    size_t wins = 0;      // samples on which it had the highest score
+    size_t fired = 0;     // samples it scored above 0
+    size_t active = 0;    // steps where its hinge loss was active, i.e. updates
+    size_t assigned = 0;  // positive steps assigned to it
+    double margin_sum = 0.0;     // scores of the positives assigned to it
+    double exclusion_loss = 0.0; // positive parts of its scores on the positives assigned elsewhere
+    
+    double meanMargin() const {return assigned ? margin_sum / assigned : 0.0;}
+};
+
 class ConvexPolytopeMachine{
 public:
     /* Initalizes the parameters of the SGD
@@ -41,22 +54,47 @@ public:
      * negative_cost: cost incurred on false positives
      * positive_cost: cost incurred on true positives
      * n_positives: total number of outer_label samples
+     * average: predict and serialize with the average of all past weights
+     * optimizer: Pegasos learning rate schedule, or per-entry adaptive rates
+     * learning_rate: base learning rate of the adaptive optimizers
+     * hash_bits: feature hashing of the data (model metadata only, 0 for none)
+     * feature_ids: feature compaction table of the data (model metadata only, empty for none)
+     * sparse_weights: hashed weight storage, rows allocated for the updated features only
+     * precision: accumulation precision of the scores and updates
+     * lazy_decay: the L2 decay reaches each weight row when it is next used,
+     *             instead of through per-classifier scales (no averaging)
+     * l1: L1 penalty, taken per iteration. Applied by lazy truncation of the
+     *     weights towards zero, which implies lazy_decay.
      */
     ConvexPolytopeMachine(int outer_label, int dim, unsigned short k,
                           float lambda, float entropy,
                           float negative_cost, float positive_cost, size_t n_positives,
-                          unsigned int seed);
+                          unsigned int seed, bool average=false,
+                          Optimizer optimizer=Pegasos, float learning_rate=0.1f,
+                          int hash_bits=0, const std::vector<int>& feature_ids=std::vector<int>(),
+                          bool sparse_weights=false, Precision precision=DoublePrecision,
+                          bool lazy_decay=false, float l1=0.0f);
     
     // destructor
     ~ConvexPolytopeMachine() {
         delete[] score;
+        delete[] inner_buffer;
+        delete[] inner_unscaled;
+        delete[] grad_mul;
         delete[] assignments;
         delete[] occupancy;
+        delete[] stats;
     }
     
     // perform one SGD step with the given sample
     std::tuple<float, float, unsigned short> oneStep(const std::tuple<int, const SparseVector, size_t>& lsi);
     
+    // hints the cache about the weights a later step with s will touch
+    void prefetch(const SparseVector& s) const {W.prefetch(s);}
+    
+    // see DenseMatrix::setPassThreads
+    void setPassThreads(size_t n) {W.setPassThreads(n);}
+    
     // get number of iterations since beginning
     size_t getIter() const {return iter;};
     
@@ -68,9 +106,32 @@ public:
     // get score and assigned classifier for given instance
     std::pair<double, int> predict(const SparseVector& s);
     
+    /* same, with caller work space (see DenseMatrix::inner), safe to call concurrently.
+     * The sub-classifier scores go to res (k doubles), getScores is left alone.
+     */
+    std::pair<double, int> predict(const SparseVector& s, double* res, float* buffer, double* unscaled) const;
+    
+    /* same, over a span of features with caller work space, see DenseMatrix::innerSpan.
+     * The sub-classifier scores go to res (k doubles), getScores is left alone.
+     */
+    std::pair<double, int> predict(const IValue* features, size_t n, double* res, float* buffer,
+                                   double* unscaled) const;
+    
     // scores for each sub-classifier
     const double* getScores() const {return score;}
     
+    /* early exit inference, see DenseMatrix::boundedInner. prepareEarlyExit must be called once
+     * the weights are final, not with averaging nor lazy decay. features: number processed.
+     */
+    void prepareEarlyExit() {W.computeRowBounds();}
+    bool isEarlyExitReady() const {return W.hasRowBounds();}
+    // whether the score of s is above threshold, res (k doubles) and work are caller work space
+    bool exceeds(const SparseVector& s, double threshold, double* res, DenseMatrix::BoundedScratch& work,
+                 size_t* features=nullptr) const;
+    // sub-classifier with the max score on s, as predict
+    int assign(const SparseVector& s, double* res, DenseMatrix::BoundedScratch& work,
+               size_t* features=nullptr) const;
+    
     // clear W and set iter to 0
     void clear();
     
@@ -79,11 +140,22 @@ public:
     
     const int getAssignment(size_t cid) const {return assignments[cid];}
     
+    // per sub-classifier statistics of the steps since construction (not serialized)
+    const ClassifierStats* getClassifierStats() const {return stats;}
+    
     // write model to disk
     void serializeModel(const char* filename) const;
+    void serializeModel(std::ostream& ss) const;
     
     // read model from disk
     static ConvexPolytopeMachine* deserializeModel(const char* filename);
+    static ConvexPolytopeMachine* deserializeModel(std::istream& ss);
+    
+    /* inference model made of the sub-classifiers in keep only (indices into 0..k-1, in order),
+     * with their weights as serialized, counts, statistics and the assignments to them.
+     * It predicts the max over keep, and assignments in 0..keep.size()-1.
+     */
+    ConvexPolytopeMachine* selectClassifiers(const std::vector<int>& keep) const;
     
     // margin value
     const float margin = 1.0f;
@@ -96,19 +168,31 @@ public:
     const float positive_cost;
     const size_t n_positives;
     const unsigned int seed;
+    const bool average;
+    const Optimizer optimizer;
+    const float learning_rate;
+    const int hash_bits;
+    const std::vector<int> feature_ids;
+    const float l1;
 
 private:
+    ConvexPolytopeMachine(const ConvexPolytopeMachine& other, const std::vector<int>& keep);
+    
     const float pepsilon = 1e-6f;
     double* score; // w's
+    float* inner_buffer; // work space of predict, 3 * k floats
+    double* inner_unscaled; // and k doubles
+    double* grad_mul; // update coefficients of a negative step
     size_t iter;
     DenseMatrix W;
     
     int* assignments; // holds assignments history for outer instances
     unsigned int* occupancy; // holds # of firings per classifier
+    ClassifierStats* stats; // k entries
     size_t distinct_p; // number of entries filled up in history
     
     void setHistory(size_t cid, unsigned short imax);
-    std::pair<unsigned short, unsigned short> heuristicMax(const SparseVector s, size_t cid);
+    std::pair<unsigned short, unsigned short> heuristicMax(const SparseVector& s, size_t cid);
     // computes optimal assignment that will maintain entropy constraint
     // updates all counting-related fields (namely history and occupancy)
 };
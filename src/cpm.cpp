@@ -21,15 +21,31 @@
 
 #include <cmath>
 #include <algorithm>
+#include <chrono>
+#include <limits>
 #include <stdexcept>
 
 #include "eval_utils.h"
+#include "instrumentation.h"
 #include "cpm.h"
 
-CPM::CPM(int k, int outer_label, float lambda, float entropy, float cost_ratio, unsigned int seed) : outer_label(outer_label), k(k), lambda(lambda), entropy(entropy), cost_ratio(cost_ratio), seed(seed), generator(seed) {
+CPM::CPM(int k, int outer_label, float lambda, float entropy, float cost_ratio, unsigned int seed, bool average, Optimizer optimizer, float learning_rate, bool sparse_weights, Precision precision, bool lazy_decay, float l1) : outer_label(outer_label), k(k), lambda(lambda), entropy(entropy), cost_ratio(cost_ratio), seed(seed), average(average), optimizer(optimizer), learning_rate(learning_rate), sparse_weights(sparse_weights), precision(precision), lazy_decay(lazy_decay), l1(l1), generator(seed) {
 }
 
-void CPM::fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuffle, bool verbose){
+// running statistics of the current epoch, see telemetry::TrainingMetrics
+static void publishProgress(telemetry::TrainingMetrics* metrics, size_t iterations, int seen_positives,
+                            int seen_negatives, size_t reassignments, double pos_loss, double neg_loss,
+                            double redundancy) {
+    const double positives = std::max(1, seen_positives);
+    metrics->iterations.store(iterations, std::memory_order_relaxed);
+    metrics->reassignment_rate.store(reassignments / positives, std::memory_order_relaxed);
+    metrics->positive_loss.store(pos_loss / positives, std::memory_order_relaxed);
+    metrics->negative_loss.store(neg_loss / std::max(1, seen_negatives), std::memory_order_relaxed);
+    metrics->redundancy.store(redundancy / positives, std::memory_order_relaxed);
+}
+
+void CPM::fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuffle, bool verbose,
+              const StoppingCriteria& stopping){
     size_t dim = trainset.getDimensions();
     
     size_t n_instances = trainset.getNInstances();
@@ -42,13 +58,33 @@ void CPM::fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuf
     size_t n_positives = trainset.getCountsPerClass().find(outer_label)->second;
     size_t n_negatives = n_instances - n_positives;
     
+    const bool timed = stopping.max_seconds >= 0;
+    if ((iterations <= 0) && !timed) {
+        throw std::runtime_error("Either a positive number of iterations or a time budget is required.");
+    }
+    
+    // number of steps the per-iteration regularization is relative to,
+    // fixed up front so that the learning rate schedule does not depend on the budget
+    size_t horizon = (iterations > 0) ? (size_t) iterations : 10 * n_instances;
+    
     if (verbose){
         std::cout << "Number of dimensions: " << dim <<'\n'
         << "Number of classifiers: " << k << '\n'
         << "Lambda: " << lambda << '\n'
-        << "Iterations: " << iterations << '\n'
+        << "Iterations: " << (iterations > 0 ? std::to_string(iterations) : "unbounded") << '\n'
         << "Cost ratio: " << cost_ratio << '\n'
-        << "Minimum entropy: " << std::exp(entropy) << "\n\n";
+        << "Minimum entropy: " << std::exp(entropy) << '\n'
+        << "Averaging: " << (average ? "yes" : "no") << '\n'
+        << "Optimizer: " << (optimizer == AdaGrad ? "adagrad" : (optimizer == RMSProp ? "rmsprop" : "pegasos")) << '\n'
+        << "Weight storage: " << (sparse_weights ? "sparse" : "dense") << '\n'
+        << "Precision: " << (precision == SinglePrecision ? "single" : "double") << '\n'
+        << "Lazy decay: " << (lazy_decay || (l1 > 0) ? "yes" : "no") << '\n';
+        
+        if (l1 > 0) std::cout << "L1: " << l1 << '\n';
+        
+        if (optimizer != Pegasos) std::cout << "Learning rate: " << learning_rate << '\n';
+        if (timed) std::cout << "Time budget: " << stopping.max_seconds << "s\n";
+        std::cout << '\n';
         
         std::cout << "negatives: " << n_negatives << " ("
         << 100*((float) n_negatives)/n_instances
@@ -56,11 +92,22 @@ void CPM::fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuf
         << 100*((float) n_positives)/n_instances << "%)\n\n";
     }
     
+#if CPM_INSTRUMENTED
+    const instr::Stats before = instr::local();
+    const auto fit_start = std::chrono::steady_clock::now();
+#endif
+    
+    if (dim > (size_t) std::numeric_limits<int>::max()) {
+        throw std::runtime_error("Too many dimensions, the largest feature index must be below 2^31 - 1.");
+    }
+    
     if(model) {
         delete model;
     }
     
-    model = new ConvexPolytopeMachine(outer_label, (int) dim, (unsigned short) k, lambda/iterations, entropy, cost_ratio/(1.0f + cost_ratio), 1.0f/(1.0f+cost_ratio), n_positives, seed);
+    model = new ConvexPolytopeMachine(outer_label, (int) dim, (unsigned short) k, lambda/horizon, entropy, cost_ratio/(1.0f + cost_ratio), 1.0f/(1.0f+cost_ratio), n_positives, seed, average, optimizer, learning_rate, trainset.getHashBits(),
+                                      trainset.getFeatureIds(), sparse_weights, precision, lazy_decay, l1/horizon);
+    model->setPassThreads((size_t) std::max(0, pass_threads));
     
     int seen_positives = 0; // number of positive instances seen
     int seen_negatives = 0; // number of negative instances seen
@@ -70,17 +117,54 @@ void CPM::fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuf
     size_t reassignments = 0;
     int epoch = 0;
     
+    const bool check_statistics = (stopping.max_reassignment_rate >= 0) || (stopping.min_loss_change >= 0);
+    double last_loss = -1.0; // training loss of the previous epoch
+    double best_auc = -1.0; // best validation AUC so far
+    int converged_epochs = 0; // consecutive epochs meeting the statistics conditions
+    int stale_epochs = 0; // consecutive epochs without validation AUC improvement
+    
+    telemetry::TrainingMetrics* metrics = publisher ? publisher->add(outer_label) : nullptr;
+    int publish_countdown = telemetry::publish_every;
+    
     if (verbose){
-        std::cout << "Round\tReassignments\tRedundancy\tEntropy\tNegative loss\tPositive loss\n";
+        std::cout << "Round\tReassignments\tRedundancy\tEntropy\tNegative loss\tPositive loss";
+        if (stopping.validation) std::cout << "\tValidation AUC";
+        std::cout << '\n';
     }
     
     size_t* perm = new size_t[n_instances];
     for (size_t i=0; i < n_instances; i++) { //FIXME
         perm[i] = i;
     }
-    std::shuffle(perm, perm + n_instances, generator);
+    {
+        CPM_TIME(Shuffle);
+        std::shuffle(perm, perm + n_instances, generator);
+    }
     
-    for(int iter = 0; iter < iterations; ++iter) {
+    // the clock is only read every check_every steps
+    const int check_every = std::max(1, stopping.check_every);
+    int countdown = check_every;
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(stopping.max_seconds));
+    
+    for(size_t iter = 0; (iterations <= 0) || (iter < (size_t) iterations); ++iter) {
+        if (timed && (--countdown == 0)) {
+            countdown = check_every;
+            if (std::chrono::steady_clock::now() >= deadline) {
+                if (verbose) std::cout << "Time budget exhausted after " << iter << " iterations.\n";
+                break;
+            }
+        }
+        
+        // the rows of upcoming samples are fetched while this one is processed,
+        // the samples themselves one distance earlier since their indices are needed
+        if (prefetch_distance > 0) {
+            std::get<1>(trainset.getInstance(perm[(iter + 2 * prefetch_distance) % n_instances])).prefetch();
+            model->prefetch(std::get<1>(trainset.getInstance(perm[(iter + prefetch_distance) % n_instances])));
+        }
+        
+        CPM_STEP();
+        
         // sample next instance
         const std::tuple<int, const SparseVector, size_t>& lic = trainset.getInstance(perm[iter%n_instances]);
         
@@ -107,18 +191,70 @@ void CPM::fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuf
             seen_negatives++;
         }
         
+        if (metrics && (--publish_countdown == 0)) {
+            publish_countdown = telemetry::publish_every;
+            publishProgress(metrics, iter + 1, seen_positives, seen_negatives, reassignments, pos_loss, neg_loss,
+                            redundancy);
+        }
+        
         if ((seen_negatives >= (int) n_negatives) &&
             (seen_positives >= (int) n_positives)) {
+            CPM_TIME(Epoch);
+            CPM_COUNT(Epochs, 1);
+            
             float rate = ((float) reassignments) / n_positives;
             float entropy = (float) evalutils::entropy(model->getAssignments(), n_positives, (unsigned short) k);
             
+            bool stop = false;
+            
+            if (check_statistics) {
+                double loss = (neg_loss + pos_loss) / (seen_negatives + seen_positives);
+                
+                bool converged = (stopping.max_reassignment_rate < 0) || (rate <= stopping.max_reassignment_rate);
+                if (stopping.min_loss_change >= 0) {
+                    converged = converged && (last_loss >= 0) &&
+                                (std::fabs(loss - last_loss) <= stopping.min_loss_change * last_loss);
+                }
+                
+                converged_epochs = converged ? converged_epochs + 1 : 0;
+                stop = stop || (converged_epochs >= stopping.patience);
+                last_loss = loss;
+            }
+            
+            double auc = 0.0;
+            if (stopping.validation) {
+                auc = (*evalutils::measure(*stopping.validation, *model))[evalutils::Metric::AUC];
+                
+                if (auc > best_auc + stopping.min_auc_gain) {
+                    best_auc = auc;
+                    stale_epochs = 0;
+                } else {
+                    stale_epochs++;
+                }
+                stop = stop || (stale_epochs >= stopping.patience);
+            }
+            
+            if (metrics) {
+                publishProgress(metrics, iter + 1, seen_positives, seen_negatives, reassignments, pos_loss, neg_loss,
+                                redundancy);
+                metrics->entropy.store(entropy, std::memory_order_relaxed);
+                if (stopping.validation) metrics->validation_auc.store(auc, std::memory_order_relaxed);
+            }
+            
             if(verbose) {
                 std::cout << epoch << '\t'
                 << rate << '\t'
                 << redundancy/n_positives << '\t'
                 << entropy << '\t'
                 << neg_loss/seen_negatives << '\t'
-                << pos_loss/n_positives << std::endl;
+                << pos_loss/n_positives;
+                if (stopping.validation) std::cout << '\t' << auc;
+                std::cout << std::endl;
+            }
+            
+            if (stop) {
+                if (verbose) std::cout << "Converged after " << epoch + 1 << " epochs.\n";
+                break;
             }
             
             seen_positives = 0;
@@ -128,12 +264,42 @@ void CPM::fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuf
             pos_loss = 0.0;
             redundancy = 0.0;
             epoch++;
+            if (metrics) metrics->epoch.store(epoch, std::memory_order_relaxed);
             
-            if (reshuffle) std::shuffle(perm, perm + n_instances, generator);
+            if (reshuffle) {
+                CPM_TIME(Shuffle);
+                std::shuffle(perm, perm + n_instances, generator);
+            }
         }
     }
     
     delete[] perm;
+    CPM_COUNT(Steps, model->getIter());
+    
+    if (metrics) {
+        metrics->iterations.store(model->getIter(), std::memory_order_relaxed);
+        metrics->done.store(true);
+    }
+    
+    if (verbose && (l1 > 0)) {
+        std::cout << "Non zero weights: " << 100.0 * model->getW().nonZeros() / ((double) dim * k) << "%\n";
+    }
+    
+#if CPM_INSTRUMENTED
+    if (verbose) {
+        instr::Stats stats = instr::local();
+        stats -= before;
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - fit_start;
+        instr::printSummary(stats, wall.count(), std::cout);
+    }
+#endif
+}
+
+std::vector<ClassifierStats> CPM::getClassifierStats() const {
+    if (!model) return std::vector<ClassifierStats>();
+    
+    const ClassifierStats* stats = model->getClassifierStats();
+    return std::vector<ClassifierStats>(stats, stats + model->k);
 }
 
 void CPM::predict(const StochasticDataAdaptor& testset, float* scores, int* assignments) const {
@@ -143,15 +309,84 @@ void CPM::predict(const StochasticDataAdaptor& testset, float* scores, int* assi
         throw std::runtime_error("Empty model.");
     }
     
+    if (testset.getHashBits() != model->hash_bits) {
+        throw std::runtime_error("Test set and model feature hashing differ.");
+    }
+    
+    if (testset.getFeatureIds() != model->feature_ids) {
+        throw std::runtime_error("Test set and model feature compaction differ.");
+    }
+    
     for (size_t i = 0; i < n_instances; ++i) {
-        auto sa = model->predict(std::get<1>(testset.getInstance(i)));
+        auto sa = predict(std::get<1>(testset.getInstance(i)));
         scores[i] = (float) sa.first;
         assignments[i] = sa.second;
     }
 }
 
+// work space of the single instance predict, per thread and grown to the largest model seen
+struct ScoringScratch {
+    std::vector<IValue> features;
+    std::vector<double> scores;
+    std::vector<double> unscaled;
+    std::vector<float> buffer;
+    DenseMatrix::BoundedScratch bounded;
+};
+
+static ScoringScratch& scoringScratch(int k) {
+    static thread_local ScoringScratch scratch;
+    if (scratch.scores.size() < (size_t) k) {
+        scratch.scores.resize(k);
+        scratch.unscaled.resize(k);
+        scratch.buffer.resize(3 * k);
+    }
+    return scratch;
+}
+
+std::pair<double, int> CPM::predict(const int* indices, const float* values, size_t n) const {
+    ScoringScratch& scratch = scoringScratch(model->k);
+    const int hash_bits = model->hash_bits;
+    const std::vector<int>& feature_ids = model->feature_ids;
+    
+    // as SparseVector::hash then remap, except that collisions are not merged: the inner is the same
+    scratch.features.clear();
+    for (size_t i = 0; i < n; ++i) {
+        int index = indices[i];
+        float value = values[i];
+        if (index < 0) continue; // not a feature index
+        
+        if (hash_bits > 0) {
+            auto bucket_sign = SparseVector::hashFeature(index, hash_bits);
+            index = bucket_sign.first;
+            value *= bucket_sign.second;
+        }
+        
+        if (!feature_ids.empty()) {
+            auto it = std::lower_bound(feature_ids.begin(), feature_ids.end(), index);
+            if (it == feature_ids.end() || *it != index) continue;
+            index = (int) (it - feature_ids.begin());
+        }
+        
+        scratch.features.emplace_back(index, value);
+    }
+    
+    return model->predict(scratch.features.data(), scratch.features.size(), scratch.scores.data(),
+                          scratch.buffer.data(), scratch.unscaled.data());
+}
+
+std::pair<double, int> CPM::predict(const IValue* features, size_t n) const {
+    ScoringScratch& scratch = scoringScratch(model->k);
+    return model->predict(features, n, scratch.scores.data(), scratch.buffer.data(), scratch.unscaled.data());
+}
+
+const std::vector<int>& CPM::getFeatureIds() const {
+    static const std::vector<int> none;
+    return model ? model->feature_ids : none;
+}
+
 std::pair<double, int> CPM::predict(const SparseVector& sv) const {
-    return model->predict(sv);
+    ScoringScratch& scratch = scoringScratch(model->k);
+    return model->predict(sv, scratch.scores.data(), scratch.buffer.data(), scratch.unscaled.data());
 }
 
 void CPM::serializeModel(const char* filename) const {
@@ -160,12 +395,96 @@ void CPM::serializeModel(const char* filename) const {
     }
 }
 
+void CPM::serializeModel(std::ostream& ss) const {
+    if (!model) {
+        throw std::runtime_error("Empty model.");
+    }
+    model->serializeModel(ss);
+}
+
 CPM* CPM::deserializeModel(const char* filename) {
-    ConvexPolytopeMachine* model = ConvexPolytopeMachine::deserializeModel(filename);
+    return fromModel(ConvexPolytopeMachine::deserializeModel(filename));
+}
+
+CPM* CPM::deserializeModel(std::istream& ss) {
+    return fromModel(ConvexPolytopeMachine::deserializeModel(ss));
+}
+
+CPM* CPM::prune(const StochasticDataAdaptor& data, double max_win_rate, PruneReport* report) const {
+    if (!model) {
+        throw std::logic_error("No model to prune.");
+    }
     
+    const size_t n_instances = data.getNInstances();
+    std::vector<double> before(n_instances);
+    std::vector<size_t> wins(model->k, 0);
+    double magnitude = 1.0;
+    
+    for (size_t i = 0; i < n_instances; ++i) {
+        auto score_index = predict(std::get<1>(data.getInstance(i)));
+        before[i] = score_index.first;
+        wins[score_index.second]++;
+        magnitude = std::max(magnitude, std::fabs(before[i]));
+    }
+    
+    std::vector<int> kept;
+    for (int i = 0; i < model->k; ++i) {
+        if (wins[i] > max_win_rate * n_instances) kept.push_back(i);
+    }
+    if (kept.empty()) {
+        kept.push_back((int) (std::max_element(wins.begin(), wins.end()) - wins.begin()));
+    }
+    
+    CPM* res = fromModel(model->selectClassifiers(kept));
+    res->prefetch_distance = prefetch_distance;
+    res->pass_threads = pass_threads;
+    res->model->setPassThreads((size_t) std::max(0, pass_threads));
+    
+    if (report) {
+        *report = PruneReport();
+        report->kept = kept;
+        report->wins = wins;
+        report->rows = n_instances;
+        
+        double total_change = 0.0;
+        for (size_t i = 0; i < n_instances; ++i) {
+            double after = res->predict(std::get<1>(data.getInstance(i))).first;
+            double change = before[i] - after;
+            
+            // the kept weights are rounded to float once scaled, as in the model file. The rounding
+            // follows the size of the terms, not of the score they sum to, hence the largest score.
+            if (change > 1e-5 * magnitude) report->changed_rows++;
+            if ((before[i] > 0.0) && (after <= 0.0)) report->flipped_rows++;
+            report->max_change = std::max(report->max_change, change);
+            total_change += change;
+        }
+        report->mean_change = n_instances ? total_change / n_instances : 0.0;
+    }
+    
+    return res;
+}
+
+void CPM::prepareEarlyExit() {
+    if (!model) {
+        throw std::logic_error("No model to prepare.");
+    }
+    model->prepareEarlyExit();
+}
+
+bool CPM::exceeds(const SparseVector& sv, double threshold, size_t* features) const {
+    ScoringScratch& scratch = scoringScratch(model->k);
+    return model->exceeds(sv, threshold, scratch.scores.data(), scratch.bounded, features);
+}
+
+int CPM::assign(const SparseVector& sv, size_t* features) const {
+    ScoringScratch& scratch = scoringScratch(model->k);
+    return model->assign(sv, scratch.scores.data(), scratch.bounded, features);
+}
+
+CPM* CPM::fromModel(ConvexPolytopeMachine* model) {
     CPM* res = new CPM(model->k, model->outer_label, model->lambda, model->entropy,
                        model->positive_cost/(model->positive_cost + model->negative_cost),
-                       model->seed);
+                       model->seed, false, Pegasos, 0.1f, model->getW().hashed);
     res->model = model;
     
     return res;
@@ -29,19 +29,142 @@
 #include "stochastic_data_adaptor.h"
 #include "convex_polytope_machine.h"
 #include "sparse_vector.h"
+#include "telemetry.h"
+
+/* Convergence tests run by CPM::fit at the end of each epoch. Training stops
+ * before the iteration count when any enabled test held for patience
+ * consecutive epochs, or when the time budget is exhausted.
+ */
+struct StoppingCriteria {
+    
+    StoppingCriteria() {};
+    
+    StoppingCriteria(float max_reassignment_rate, float min_loss_change, int patience,
+                     const StochasticDataAdaptor* validation, float min_auc_gain,
+                     float max_seconds=-1.0f, int check_every=1024) :
+    max_reassignment_rate(max_reassignment_rate), min_loss_change(min_loss_change), patience(patience),
+    validation(validation), min_auc_gain(min_auc_gain), max_seconds(max_seconds), check_every(check_every) {}
+    
+    // training statistics: the rate of reassigned positives is at most max_reassignment_rate
+    // and the training loss changed by at most min_loss_change (relative) since the previous epoch.
+    // A negative value disables the corresponding condition.
+    float max_reassignment_rate = -1.0f;
+    float min_loss_change = -1.0f;
+    
+    int patience = 3;
+    
+    // held-out set: the AUC on validation did not improve by more than min_auc_gain.
+    // Not owned, nullptr disables the test.
+    const StochasticDataAdaptor* validation = nullptr;
+    float min_auc_gain = 0.0f;
+    
+    // wall-clock training budget in seconds, read every check_every steps. Negative: no budget.
+    float max_seconds = -1.0f;
+    int check_every = 1024;
+};
+
+// effect of CPM::prune on the scores of its reference data
+struct PruneReport {
+    std::vector<int> kept;   // indices of the kept sub-classifiers in the original model
+    std::vector<size_t> wins; // rows of the reference data won by each original sub-classifier
+    size_t rows = 0;
+    size_t changed_rows = 0; // rows whose score decreased beyond float rounding (1e-5 of the largest score)
+    size_t flipped_rows = 0; // rows whose score went from above 0 to at most 0
+    double max_change = 0.0; // largest score decrease
+    double mean_change = 0.0; // mean score decrease over all rows
+};
 
 class CPM {
 public:
-    CPM(int k, int outer_label, float lambda, float entropy, float cost_ratio, unsigned int seed);
+    CPM(int k, int outer_label, float lambda, float entropy, float cost_ratio, unsigned int seed,
+        bool average=false, Optimizer optimizer=Pegasos, float learning_rate=0.1f, bool sparse_weights=false,
+        Precision precision=DoublePrecision, bool lazy_decay=false, float l1=0.0f);
     // lambda is taken as the global penalty constraint in the optimization problem (in praticular,
     // it will later be divided by the number of iterations)
+    // average: use the average of the SGD iterates (Polyak averaging) as final model
+    // optimizer, learning_rate: per-entry adaptive step sizes instead of the Pegasos schedule
+    // sparse_weights: hashed weight storage, memory proportional to the updated features
+    // precision: float accumulation during training, see Precision
+    // lazy_decay: per-row L2 decay applied when a row is next used (not with average)
+    // l1: global L1 penalty, divided by the number of iterations like lambda (elastic net with lambda).
+    //     Weights are truncated to zero lazily, which implies lazy_decay.
     ~CPM() {delete model;};
     
-    void fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuffle, bool verbose);
+    /* iterations is the maximal number of SGD steps, the regularization is still taken relative to it.
+     * With a time budget, iterations <= 0 means no step limit, the regularization is then taken
+     * relative to 10 epochs.
+     */
+    void fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuffle, bool verbose,
+             const StoppingCriteria& stopping=StoppingCriteria());
     void predict(const StochasticDataAdaptor& testset, float* scores, int* assignments) const;
+    // scored in thread local work space, concurrent calls are safe as long as the model is not being trained
     std::pair<double, int> predict(const SparseVector& sv) const;
+    
+    /* Single instance scoring without building a SparseVector: the n raw feature indices
+     * (in any order, as in the data files) are hashed and remapped like the model data,
+     * and scored in thread local work space which is reused across calls, so that no
+     * allocation happens once it has grown. Same result as predict(SparseVector(...)) up to
+     * rounding, exactly for sorted indices without hashing. Negative indices are skipped,
+     * as features the model has not seen. Concurrent calls are safe as long as the model
+     * is not being trained.
+     */
+    std::pair<double, int> predict(const int* indices, const float* values, size_t n) const;
+    // same, for entries already hashed and remapped like those of a SparseVector of the model data
+    std::pair<double, int> predict(const IValue* features, size_t n) const;
+    
+    /* Early exit inference for thresholded decisions: the features of sv are processed by
+     * decreasing bound on their contribution, until the remaining ones cannot change the
+     * decision (or the argmax). prepareEarlyExit must be called after fit or deserializeModel,
+     * models trained with average or lazy decay must be saved and read back (or pruned) first.
+     * features: number of features processed, if not null. Thread local work space, as predict.
+     */
+    void prepareEarlyExit();
+    // whether prepareEarlyExit was called, fit, deserializeModel and prune give a model without the bounds
+    bool isEarlyExitReady() const {return model && model->isEarlyExitReady();}
+    // whether the score of sv is above threshold, as predict(sv).first > threshold
+    bool exceeds(const SparseVector& sv, double threshold, size_t* features=nullptr) const;
+    // assigned sub-classifier, as predict(sv).second
+    int assign(const SparseVector& sv, size_t* features=nullptr) const;
     void serializeModel(const char* filename) const;
+    void serializeModel(std::ostream& ss) const;
     static CPM* deserializeModel(const char* filename);
+    static CPM* deserializeModel(std::istream& ss);
+    
+    /* Dead sub-classifier removal: the rows of data (labels unused) are scored, and the
+     * sub-classifiers winning the max on at most max_win_rate of them are dropped, the
+     * most winning one being always kept. Since the score is the max over the
+     * sub-classifiers, dropping the ones which never win (max_win_rate 0) leaves the
+     * scores of data unchanged. Returns the smaller model (caller owns), for inference,
+     * and fills report if not null.
+     */
+    CPM* prune(const StochasticDataAdaptor& data, double max_win_rate=0.0, PruneReport* report=nullptr) const;
+    
+    // number of SGD steps actually performed by the last fit
+    size_t getIterations() const {return model ? model->getIter() : 0;}
+    
+    // per sub-classifier statistics of the last fit, zeros for a deserialized model
+    std::vector<ClassifierStats> getClassifierStats() const;
+    
+    /* fit prefetches the weight rows of the sample d steps ahead (and the sample
+     * 2d steps ahead) while processing the current one. 0 disables prefetching.
+     */
+    void setPrefetchDistance(int d) {prefetch_distance = d;}
+    int getPrefetchDistance() const {return prefetch_distance;}
+    
+    /* largest number of threads of the whole weight passes of fit (rescale, l2norm, clear),
+     * 0 for the hardware concurrency, see DenseMatrix::setPassThreads
+     */
+    void setPassThreads(int n) {pass_threads = n;}
+    
+    // fit publishes its progress to publisher (not owned), nullptr disables
+    void setTelemetry(telemetry::Publisher* p) {publisher = p;}
+    
+    // feature hashing the model was trained with, data to predict must be hashed the same way
+    int getHashBits() const {return model ? model->hash_bits : 0;}
+    
+    // feature compaction table the model was trained with, empty if none.
+    // Data to predict must be remapped with it, see StochasticDataAdaptor::remap.
+    const std::vector<int>& getFeatureIds() const;
     
     const int outer_label;
     const int k;
@@ -49,10 +172,23 @@ public:
     const float entropy;
     const float cost_ratio;
     const unsigned int seed;
+    const bool average;
+    const Optimizer optimizer;
+    const float learning_rate;
+    const bool sparse_weights;
+    const Precision precision;
+    const bool lazy_decay;
+    const float l1;
     
 private:
     std::mt19937 generator;
     ConvexPolytopeMachine* model = nullptr;
+    int prefetch_distance = 4;
+    int pass_threads = 0;
+    telemetry::Publisher* publisher = nullptr;
+    
+    // wraps a deserialized model, takes ownership
+    static CPM* fromModel(ConvexPolytopeMachine* model);
 };
 
 #endif /* defined(__cpm__cpm__) */
@@ -22,47 +22,400 @@
 #include <random>
 #include <cmath>
 #include <fstream>
+#include <algorithm>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <thread>
 
 #include "dense_matrix.h"
+#include "instrumentation.h"
 
-DenseMatrix::DenseMatrix(int dimensions, int classifiers) : dimensions(dimensions), classifiers(classifiers) {
+DenseMatrix::DenseMatrix(int dimensions, int classifiers, bool averaged, Optimizer optimizer, double learning_rate,
+                         bool hashed, Precision precision, bool lazy) :
+    dimensions(dimensions), classifiers(classifiers), averaged(averaged), optimizer(optimizer), learning_rate(learning_rate),
+    hashed(hashed), precision(precision), lazy(lazy), stride(((averaged ? 2 : 1) + (optimizer != Pegasos ? 1 : 0)) * ((size_t) classifiers) + (lazy ? 4 : 0)),
+    acc_offset((averaged ? 2 : 1) * ((size_t) classifiers)),
+    marks_offset(((averaged ? 2 : 1) + (optimizer != Pegasos ? 1 : 0)) * ((size_t) classifiers)) {
     
-    data = new float[((size_t) dimensions) * ((size_t) classifiers)]();
+    if (averaged && lazy) {
+        throw std::runtime_error("Averaging is not supported with lazy decay or L1.");
+    }
+    
+    decay = 1.0;
+    penalty = 0.0;
+    
+    data = nullptr;
+    row_capacity = 0;
+    row_keys = nullptr;
+    row_slots = nullptr;
+    row_features = nullptr;
+    
+    if (hashed) {
+        clearRows(1024);
+    } else {
+        n_rows = row_capacity = (size_t) dimensions;
+        table_shift = 64;
+        data = pagealloc::allocate(((size_t) dimensions) * stride);
+    }
     
     scales = new double[classifiers];
+    inv_scales = new double[classifiers];
     for (int k = 0; k < classifiers; ++k) {
         scales[k] = 1.0;
+        inv_scales[k] = 1.0;
     }
     
+    coef = new double[classifiers];
+    scratch = new float[3 * classifiers];
+    
     intercept = new double[classifiers]();
+    
+    avg_scales = new double[classifiers]();
+    avg_intercept = new double[classifiers]();
+    avg_count = 0;
+    
+    intercept_acc = new double[classifiers]();
+}
+
+void DenseMatrix::clearRows(size_t capacity) {
+    pagealloc::release(data, row_capacity * stride);
+    delete[] row_keys; delete[] row_slots; delete[] row_features;
+    
+    n_rows = 0;
+    row_capacity = capacity;
+    data = pagealloc::allocate(row_capacity * stride);
+    row_features = new int[row_capacity];
+    
+    // table twice as large as the row capacity
+    table_shift = 64;
+    while (tableCapacity() < 2 * row_capacity) table_shift--;
+    
+    row_keys = new int[tableCapacity()];
+    row_slots = new int[tableCapacity()];
+    for (size_t i = 0; i < tableCapacity(); ++i) {
+        row_keys[i] = -1;
+        row_slots[i] = -1;
+    }
+}
+
+size_t DenseMatrix::addRow(int feature, size_t i) {
+    if (n_rows == row_capacity) {
+        // double the rows, then rehash into a table twice as large
+        float* new_data = pagealloc::allocate(2 * row_capacity * stride);
+        std::memcpy(new_data, data, sizeof(float) * row_capacity * stride);
+        pagealloc::release(data, row_capacity * stride);
+        data = new_data;
+        
+        int* new_features = new int[2 * row_capacity];
+        std::memcpy(new_features, row_features, sizeof(int) * row_capacity);
+        delete[] row_features;
+        row_features = new_features;
+        
+        row_capacity *= 2;
+        
+        delete[] row_keys;
+        delete[] row_slots;
+        table_shift--;
+        row_keys = new int[tableCapacity()];
+        row_slots = new int[tableCapacity()];
+        for (size_t j = 0; j < tableCapacity(); ++j) {
+            row_keys[j] = -1;
+            row_slots[j] = -1;
+        }
+        
+        const size_t mask = tableCapacity() - 1;
+        for (size_t slot = 0; slot < n_rows; ++slot) {
+            size_t j = tableIndex(row_features[slot]);
+            while (row_keys[j] >= 0) j = (j + 1) & mask;
+            row_keys[j] = row_features[slot];
+            row_slots[j] = (int) slot;
+        }
+        
+        i = tableIndex(feature);
+        while (row_keys[i] >= 0) i = (i + 1) & mask;
+    }
+    
+    row_keys[i] = feature;
+    row_slots[i] = (int) n_rows;
+    row_features[n_rows] = feature;
+    
+    return n_rows++;
+}
+
+size_t DenseMatrix::memoryUsage() const {
+    size_t res = sizeof(float) * row_capacity * stride;
+    if (hashed) {
+        res += sizeof(int) * (row_capacity + 2 * tableCapacity());
+    }
+    return res;
+}
+
+size_t DenseMatrix::passThreads() const {
+    size_t n_threads = max_pass_threads ? max_pass_threads : std::max(1u, std::thread::hardware_concurrency());
+    return std::max((size_t) 1, std::min(n_threads, n_rows * ((size_t) classifiers) / min_pass_entries));
+}
+
+template <class F> void DenseMatrix::forRowBlocks(size_t n_threads, F f) const {
+    if (n_threads <= 1) {
+        f((size_t) 0, n_rows, (size_t) 0);
+        return;
+    }
+    
+    const size_t block = (n_rows + n_threads - 1) / n_threads;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n_threads; ++t) {
+        threads.emplace_back(f, std::min(n_rows, t * block), std::min(n_rows, (t + 1) * block), t);
+    }
+    
+    for (auto& thread: threads) {
+        thread.join();
+    }
 }
 
 void DenseMatrix::clear() {
-    for(size_t i = 0; i < ((size_t) dimensions) * ((size_t) classifiers); ++i) {
-        data[i] = 0.0f;
+    if (hashed) {
+        clearRows(1024);
+    } else {
+        // each thread zeroes its own block, which also places it on its node under first touch
+        forRowBlocks(passThreads(), [this](size_t first, size_t last, size_t) {
+            std::memset(data + first * stride, 0, sizeof(float) * (last - first) * stride);
+        });
     }
     
+    decay = 1.0;
+    penalty = 0.0;
+    
     for (int k = 0; k < classifiers; ++k) {
-        scales[k] = 0.0;
+        scales[k] = 1.0;
+        inv_scales[k] = 1.0;
         intercept[k] = 0;
+        avg_scales[k] = 0.0;
+        avg_intercept[k] = 0.0;
+        intercept_acc[k] = 0.0;
     }
+    avg_count = 0;
 }
 
-void DenseMatrix::inner(const SparseVector& s, double* res, const bool* fmask) const {
+void DenseMatrix::inner(const SparseVector& s, double* res, float* buffer, const bool* fmask) const {
+    innerFeatures(s.data.data(), s.data.size(), res, fmask, buffer);
+}
+
+void DenseMatrix::innerFeatures(const IValue* features, size_t n, double* res, const bool* fmask,
+                                float* buffer) const {
+    if (lazy) {
+        innerLazy(features, n, res, fmask, buffer);
+    } else if (precision == SinglePrecision) {
+        innerSingle(features, n, res, fmask, nullptr, buffer);
+    } else {
+        innerDouble(features, n, res, fmask, nullptr);
+    }
+}
+
+void DenseMatrix::innerSpan(const IValue* features, size_t n, double* res, bool average, float* buffer,
+                            double* unscaled) const {
+    // a single instance is latency bound: all its row misses are started before the first use
+    prefetchFeatures(features, n, false);
+    
+    if (average) {
+        averageInnerFeatures(features, n, res, buffer, unscaled);
+    } else {
+        innerFeatures(features, n, res, nullptr, buffer);
+    }
+}
+
+void DenseMatrix::computeRowBounds() {
+    if (averaged || lazy) {
+        throw std::logic_error("Early exit inference needs weights without averaging nor lazy decay.");
+    }
+    
+    row_bounds.assign(row_capacity, 0.0f);
+    for (size_t r = 0; r < n_rows; ++r) {
+        const float* row = data + r * stride;
+        double bound = 0.0;
+        for (int k = 0; k < classifiers; ++k) {
+            bound = std::max(bound, std::fabs(scales[k] * row[k]));
+        }
+        // rounded up, the bound must hold in float
+        row_bounds[r] = std::nextafter((float) bound, std::numeric_limits<float>::infinity());
+    }
+}
+
+size_t DenseMatrix::boundedInner(const SparseVector& s, double* res, EarlyExit rule, double threshold,
+                                 double* remaining, BoundedScratch& work) const {
+    if (row_bounds.size() != row_capacity) {
+        throw std::logic_error("Row bounds missing or out of date, see computeRowBounds.");
+    }
+    
+    // features with a row, by decreasing contribution bound
+    work.features.clear();
+    for (auto const& iv: s.data) {
+        ptrdiff_t slot = findSlot(iv.index);
+        if (slot < 0) continue;
+        work.features.push_back({std::fabs((double) iv.value) * row_bounds[slot], slot, iv.value});
+    }
+    std::sort(work.features.begin(), work.features.end(),
+              [](const BoundedScratch::Feature& a, const BoundedScratch::Feature& b) {return a.bound > b.bound;});
+    
+    // bound on the features from i on, with some slack for the rounding of the sums
+    const size_t n = work.features.size();
+    work.suffix.resize(n + 1);
+    work.suffix[n] = 0.0;
+    for (size_t i = n; i-- > 0;) {
+        work.suffix[i] = work.suffix[i + 1] + work.features[i].bound;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        work.suffix[i] *= 1.0 + 1e-9;
+    }
+    
+    for (int k = 0; k < classifiers; ++k) {
+        res[k] = intercept[k];
+    }
+    
+    size_t i = 0;
+    while (i < n) {
+        const float* row = data + work.features[i].slot * stride;
+        const double value = work.features[i].value;
+        for (int k = 0; k < classifiers; ++k) {
+            res[k] += value * scales[k] * row[k];
+        }
+        ++i;
+        
+        // the two highest partial scores decide both rules
+        const double rest = work.suffix[i];
+        double first = -std::numeric_limits<double>::infinity();
+        double second = first;
+        for (int k = 0; k < classifiers; ++k) {
+            if (res[k] > first) {
+                second = first;
+                first = res[k];
+            } else if (res[k] > second) {
+                second = res[k];
+            }
+        }
+        
+        if (rule == ThresholdExit) {
+            if ((first - rest > threshold) || (first + rest <= threshold)) break;
+        } else if (first - rest >= second + rest) {
+            break;
+        }
+    }
+    
+    *remaining = work.suffix[i];
+    return i;
+}
+
+void DenseMatrix::innerKeepRows(const SparseVector& s, double* res) {
+    // the update will write the rows anyway, they are brought up to date here once
+    if (lazy) {
+        for (auto const& iv: s.data) {
+            ptrdiff_t slot = findSlot(iv.index);
+            if (slot >= 0) catchUp(slot);
+        }
+    }
+    
+    // a dense row lookup is a multiplication, keeping it costs more than it saves
+    if (!hashed) {
+        inner(s, res, scratch);
+        return;
+    }
+    
+    kept_rows.resize(s.data.size());
+    
+    // rows are current, no need for innerLazy
+    if (precision == SinglePrecision) {
+        innerSingle(s.data.data(), s.data.size(), res, nullptr, kept_rows.data(), scratch);
+    } else {
+        innerDouble(s.data.data(), s.data.size(), res, nullptr, kept_rows.data());
+    }
+}
+
+void DenseMatrix::innerDouble(const IValue* features, size_t n, double* res, const bool* fmask,
+                              ptrdiff_t* offsets) const {
+    for(int k = 0; k < classifiers; ++k) {
+        res[k] = 0.0;
+    }
+    
+    int i = 0;
+    for(size_t f = 0; f < n; ++f){
+        const IValue& iv = features[f];
+        if (fmask && fmask[i]) continue; // dropout feature
+        
+        const float* row = findRow(iv.index);
+        if (offsets) *(offsets++) = row ? row - data : -1;
+        if (!row) continue; // extra dimension, or never updated
+        double value = (double) iv.value;
+        
+        for(size_t k = 0; k < (size_t) classifiers; ++k){
+            res[k] += value * ((double) row[k]);
+        }
+        ++i;
+    }
+    
+    for (int k = 0; k < classifiers; ++k) {
+        res[k] = res[k]*scales[k] + intercept[k];
+    }
+}
+
+void DenseMatrix::innerSingle(const IValue* features, size_t n, double* res, const bool* fmask,
+                              ptrdiff_t* offsets, float* buffer) const {
+    float* sum = buffer + classifiers;
+    float* comp = buffer + 2 * classifiers;
+    for(int k = 0; k < classifiers; ++k) {
+        sum[k] = 0.0f;
+        comp[k] = 0.0f;
+    }
+    
+    int i = 0;
+    for(size_t f = 0; f < n; ++f){
+        const IValue& iv = features[f];
+        if (fmask && fmask[i]) continue; // dropout feature
+        
+        const float* row = findRow(iv.index);
+        if (offsets) *(offsets++) = row ? row - data : -1;
+        if (!row) continue; // extra dimension, or never updated
+        const float value = iv.value;
+        
+        // Kahan summation, independent across classifiers
+        for(int k = 0; k < classifiers; ++k){
+            float y = value * row[k] - comp[k];
+            float t = sum[k] + y;
+            comp[k] = (t - sum[k]) - y;
+            sum[k] = t;
+        }
+        ++i;
+    }
+    
+    for (int k = 0; k < classifiers; ++k) {
+        res[k] = ((double) sum[k])*scales[k] + intercept[k];
+    }
+}
+
+void DenseMatrix::innerLazy(const IValue* features, size_t n, double* res, const bool* fmask,
+                            float* buffer) const {
     for(int k = 0; k < classifiers; ++k) {
         res[k] = 0.0;
     }
     
+    float* decayed = buffer;
+    
     int i = 0;
-    for(auto const& iv: s.data){
-        if (iv.index >= dimensions) continue; // ignore extra dimensions
+    for(size_t f = 0; f < n; ++f){
+        const IValue& iv = features[f];
         if (fmask && fmask[i]) continue; // dropout feature
         
-        size_t offset = ((size_t) iv.index) * ((size_t) classifiers);
+        ptrdiff_t slot = findSlot(iv.index);
+        if (slot < 0) continue; // extra dimension, or never updated
+        
+        const float* row = data + slot * stride;
+        if (!isCurrent(slot)) {
+            decayRow(slot, decayed);
+            row = decayed;
+        }
         double value = (double) iv.value;
         
         for(size_t k = 0; k < (size_t) classifiers; ++k){
-            res[k] += value * ((double) data[offset + k]);
+            res[k] += value * ((double) row[k]);
         }
         ++i;
     }
@@ -72,20 +425,86 @@ void DenseMatrix::inner(const SparseVector& s, double* res, const bool* fmask) c
     }
 }
 
+void DenseMatrix::averageInner(const SparseVector& s, double* res, float* buffer, double* unscaled) const {
+    averageInnerFeatures(s.data.data(), s.data.size(), res, buffer, unscaled);
+}
+
+void DenseMatrix::averageInnerFeatures(const IValue* features, size_t n, double* res, float* buffer,
+                                       double* unscaled) const {
+    if (!averaged || avg_count == 0) {
+        innerFeatures(features, n, res, nullptr, buffer);
+        return;
+    }
+    
+    // sum of v.x in res, sum of u.x in unscaled
+    for(int k = 0; k < classifiers; ++k) {
+        res[k] = 0.0;
+        unscaled[k] = 0.0;
+    }
+    
+    for(size_t f = 0; f < n; ++f){
+        const IValue& iv = features[f];
+        const float* row = findRow(iv.index);
+        if (!row) continue; // extra dimension, or never updated
+        
+        double value = (double) iv.value;
+        
+        for(size_t k = 0; k < (size_t) classifiers; ++k){
+            unscaled[k] += value * ((double) row[k]);
+            res[k] += value * ((double) row[classifiers + k]);
+        }
+    }
+    
+    for (int k = 0; k < classifiers; ++k) {
+        res[k] = (res[k] + avg_scales[k] * unscaled[k] + avg_intercept[k]) / avg_count;
+    }
+}
+
 void DenseMatrix::rescale() {
-    for (size_t i = 0; i < ((size_t) dimensions) * ((size_t) classifiers); ++i) {
-        data[i] = (float) (((double) data[i]) +  scales[i%classifiers]);
+    CPM_TIME(Rescale);
+    CPM_COUNT(Rescales, 1);
+    
+    /* folds the power of 2 part of the scales into the weights, the accumulators are left
+     * as is. Multiplying a float by a power of 2 is exact, so that the scores do not change,
+     * and the scales are left in [0.5, 1).
+     */
+    std::vector<double> factors(classifiers);
+    for (int k = 0; k < classifiers; ++k) {
+        int exponent;
+        std::frexp(scales[k], &exponent);
+        factors[k] = std::ldexp(1.0, exponent);
     }
     
+    forRowBlocks(passThreads(), [this, &factors](size_t first, size_t last, size_t) {
+        for (size_t r = first; r < last; ++r) {
+            float* row = data + r * stride;
+            for (int k = 0; k < classifiers; ++k) {
+                row[k] = (float) (((double) row[k]) * factors[k]);
+            }
+        }
+    });
+    
     for (int k = 0; k < classifiers; ++k) {
-        scales[k] = 1.0;
+        // keeps the running sum v + avg_scales * u invariant
+        avg_scales[k] /= factors[k];
+        scales[k] /= factors[k];
+        inv_scales[k] = 1.0 / scales[k];
     }
 }
 
 void DenseMatrix::mulInplace(const double * const a) {
+    if (lazy) {
+        for (int k = 1; k < classifiers; ++k) {
+            if (a[k] != a[0]) throw std::logic_error("Lazy decay requires the same factor for all classifiers.");
+        }
+        mulInplace(a[0]);
+        return;
+    }
+    
     bool torescale = false;
     for (int k = 0; k < classifiers; ++k) {
         scales[k] *= a[k];
+        inv_scales[k] = 1.0 / scales[k];
         intercept[k] *= a[k];
         if (scales[k] < min_scale) torescale = true;
     }
@@ -94,9 +513,21 @@ void DenseMatrix::mulInplace(const double * const a) {
 }
 
 void DenseMatrix::mulInplace(double a) {
+    if (lazy) {
+        decay *= a;
+        for (int k = 0; k < classifiers; ++k) {
+            intercept[k] *= a;
+        }
+        
+        // penalties are divided by the decay, rebase before it gets too small
+        if (decay < min_scale) rebase();
+        return;
+    }
+    
     bool torescale = false;
     for (int k = 0; k < classifiers; ++k) {
         scales[k] *= a;
+        inv_scales[k] = 1.0 / scales[k];
         intercept[k] *= a;
         if (scales[k] < min_scale) torescale = true;
     }
@@ -104,65 +535,367 @@ void DenseMatrix::mulInplace(double a) {
     if (torescale) rescale();
 }
 
+void DenseMatrix::truncate(double penalty) {
+    if (!lazy) {
+        throw std::logic_error("L1 truncation requires lazy decay.");
+    }
+    this->penalty += penalty / decay;
+}
+
+void DenseMatrix::rebase() {
+    CPM_TIME(Rescale);
+    CPM_COUNT(Rescales, 1);
+    
+    forRowBlocks(passThreads(), [this](size_t first, size_t last, size_t) {
+        for (size_t r = first; r < last; ++r) {
+            catchUp(r);
+            setMarks(r, 1.0, 0.0);
+        }
+    });
+    
+    decay = 1.0;
+    penalty = 0.0;
+}
+
+
+void DenseMatrix::accumulateAverage() {
+    if (!averaged) return;
+    
+    for (int k = 0; k < classifiers; ++k) {
+        avg_scales[k] += scales[k];
+        avg_intercept[k] += intercept[k];
+    }
+    avg_count++;
+}
+
+void DenseMatrix::prefetch(const SparseVector& s) const {
+    prefetchFeatures(s.data.data(), s.data.size(), true);
+}
+
+void DenseMatrix::prefetchFeatures(const IValue* features, size_t n, bool write) const {
+    for (size_t f = 0; f < n; ++f) {
+        const IValue& iv = features[f];
+        if (hashed) {
+            size_t i = tableIndex(iv.index);
+            __builtin_prefetch(row_keys + i);
+            __builtin_prefetch(row_slots + i);
+        } else if (iv.index < dimensions) {
+            // rows may straddle two cache lines
+            const float* row = data + ((size_t) iv.index) * stride;
+            if (write) {
+                __builtin_prefetch(row, 1);
+                __builtin_prefetch(row + stride - 1, 1);
+            } else {
+                __builtin_prefetch(row);
+                __builtin_prefetch(row + stride - 1);
+            }
+        }
+    }
+}
+
+void DenseMatrix::setCoefficients(const double * const a) {
+    // unscaled steps are value * a_k / scales_k, the division is done once per call
+    for (int k = 0; k < classifiers; ++k) {
+        coef[k] = a[k] * inv_scales[k];
+        scratch[k] = (float) coef[k];
+    }
+}
+
+inline void DenseMatrix::addToRow(float* row, float value, const double * const a) {
+    const bool adaptive = optimizer != Pegasos;
+    
+    if (precision == SinglePrecision && !adaptive) {
+        // zero coefficients leave the row as is, no need to skip them
+        const float* coef_single = scratch;
+        for (int k = 0; k < classifiers; ++k) {
+            float delta = value * coef_single[k];
+            row[k] += delta;
+            if (averaged) row[classifiers + k] -= ((float) avg_scales[k]) * delta;
+        }
+        return;
+    }
+    
+    for(size_t k = 0; k < ((size_t) classifiers); ++k){
+        if (a[k] == 0.0) continue; // inactive classifier, leave its accumulators alone
+        
+        double delta = adaptive ? adaptiveStep(row[acc_offset + k], value * a[k]) * inv_scales[k] :
+                                  value * coef[k];
+        row[k] = (float) (((double) row[k]) + delta);
+        if (averaged) {
+            row[classifiers + k] = (float) (((double) row[classifiers + k]) - avg_scales[k] * delta);
+        }
+    }
+}
+
+inline void DenseMatrix::addToRow(float* row, float value, double a, double coef_k, int k) {
+    float* w = row + k;
+    double delta = (optimizer != Pegasos) ? adaptiveStep(w[acc_offset], a * value) * inv_scales[k] :
+                                            value * coef_k;
+    w[0] = (float) (((double) w[0]) + delta);
+    if (averaged) {
+        w[classifiers] = (float) (((double) w[classifiers]) - avg_scales[k] * delta);
+    }
+}
+
 void DenseMatrix::addInplace(const SparseVector& s, const double* const a, const bool* fmask) {
+    setCoefficients(a);
+    
     int i = 0;
     for(auto const& iv: s.data) {
         if(fmask && fmask[i]) continue;
         
-        double value = iv.value;
-        size_t offset = ((size_t) iv.index) * ((size_t) classifiers);
-        
-        for(size_t k = 0; k < ((size_t) classifiers); ++k){
-            data[k + offset] = (float) (((double) data[k + offset]) + (value * a[k])/scales[k]);
-        }
+        size_t slot = getSlot(iv.index);
+        if (lazy) catchUp(slot);
+        addToRow(data + slot * stride, iv.value, a);
         ++i;
     }
     
     for(int k = 0; k < classifiers; ++k) {
-        intercept[k] += bias * a[k];
+        if (a[k] == 0.0) continue;
+        intercept[k] += (optimizer != Pegasos) ? adaptiveStep(intercept_acc[k], bias * a[k]) : bias * a[k];
     }
 }
 
 void DenseMatrix::addInplace(const SparseVector& s, double a, int k, const bool* fmask) {
+    const double coef_k = a * inv_scales[k];
+    
     int i = 0;
     for(auto const& iv: s.data) {
         if(fmask && fmask[i]) continue;
         
-        double value = iv.value;
-        size_t index = ((size_t) iv.index) * ((size_t) classifiers) + ((size_t) k);
-        
-        data[index] = (float) (((double) data[index]) + (a * value)/scales[k]);
+        size_t slot = getSlot(iv.index);
+        if (lazy) catchUp(slot);
+        addToRow(data + slot * stride, iv.value, a, coef_k, k);
         ++i;
     }
     
-    intercept[k] += bias * a;
+    intercept[k] += (optimizer != Pegasos) ? adaptiveStep(intercept_acc[k], bias * a) : bias * a;
+}
+
+void DenseMatrix::addInplaceKeptRows(const SparseVector& s, const double* const a) {
+    if (!hashed) {
+        addInplace(s, a);
+        return;
+    }
+    
+    setCoefficients(a);
+    
+    // rows missing at scoring time are allocated here, the others are up to date
+    const ptrdiff_t* offset = kept_rows.data();
+    for (auto const& iv: s.data) {
+        addToRow((*offset >= 0) ? data + *offset : newRow(iv.index), iv.value, a);
+        ++offset;
+    }
+    
+    for(int k = 0; k < classifiers; ++k) {
+        if (a[k] == 0.0) continue;
+        intercept[k] += (optimizer != Pegasos) ? adaptiveStep(intercept_acc[k], bias * a[k]) : bias * a[k];
+    }
+}
+
+void DenseMatrix::addInplaceKeptRows(const SparseVector& s, double a, int k) {
+    if (!hashed) {
+        addInplace(s, a, k);
+        return;
+    }
+    
+    const double coef_k = a * inv_scales[k];
+    
+    const ptrdiff_t* offset = kept_rows.data();
+    for (auto const& iv: s.data) {
+        addToRow((*offset >= 0) ? data + *offset : newRow(iv.index), iv.value, a, coef_k, k);
+        ++offset;
+    }
+    
+    intercept[k] += (optimizer != Pegasos) ? adaptiveStep(intercept_acc[k], bias * a) : bias * a;
+}
+
+void DenseMatrix::countNonZeros(size_t* weights, size_t* rows) const {
+    const size_t n_threads = passThreads();
+    std::vector<size_t> counts(2 * n_threads, 0);
+    
+    forRowBlocks(n_threads, [this, &counts](size_t first, size_t last, size_t t) {
+        std::vector<float> w(classifiers);
+        for (size_t r = first; r < last; ++r) {
+            rowWeights(r, w.data());
+            size_t row_count = 0;
+            for (int k = 0; k < classifiers; ++k) {
+                row_count += (w[k] != 0.0f);
+            }
+            counts[2 * t] += row_count;
+            counts[2 * t + 1] += (row_count > 0);
+        }
+    });
+    
+    *weights = 0;
+    *rows = 0;
+    for (size_t t = 0; t < n_threads; ++t) {
+        *weights += counts[2 * t];
+        *rows += counts[2 * t + 1];
+    }
+}
+
+size_t DenseMatrix::nonZeros() const {
+    size_t weights, rows;
+    countNonZeros(&weights, &rows);
+    return weights;
+}
+
+size_t DenseMatrix::nonZeroRows() const {
+    size_t weights, rows;
+    countNonZeros(&weights, &rows);
+    return rows;
 }
 
 double DenseMatrix::l2norm() const {
+    const bool use_average = averaged && avg_count > 0;
+    const size_t n_threads = passThreads();
+    
+    /* per thread and classifier sums of the squared weights before the final
+     * per classifier factor, scales_k or 1 / avg_count
+     */
+    std::vector<double> sums(n_threads * classifiers, 0.0);
+    
+    forRowBlocks(n_threads, [this, use_average, &sums](size_t first, size_t last, size_t t) {
+        double* sum = sums.data() + t * classifiers;
+        std::vector<float> decayed(lazy ? classifiers : 0);
+        
+        for (size_t r = first; r < last; ++r) {
+            const float* row = data + r * stride;
+            if (lazy && !isCurrent(r)) {
+                decayRow(r, decayed.data());
+                row = decayed.data();
+            }
+            
+            if (use_average) {
+                for (int k = 0; k < classifiers; ++k) {
+                    double w = ((double) row[classifiers + k]) + avg_scales[k] * row[k];
+                    sum[k] += w * w;
+                }
+            } else {
+                for (int k = 0; k < classifiers; ++k) {
+                    sum[k] += ((double) row[k]) * row[k];
+                }
+            }
+        }
+    });
+    
     double res = 0;
-    for(size_t i = 0; i< ((size_t) dimensions) * ((size_t) classifiers); ++i){
-        res += (((double) data[i]) * scales[i%classifiers]) * (((double) data[i]) * scales[i%classifiers]);
+    for (int k = 0; k < classifiers; ++k) {
+        double total = 0;
+        for (size_t t = 0; t < n_threads; ++t) {
+            total += sums[t * classifiers + k];
+        }
+        
+        double factor = use_average ? 1.0 / avg_count : scales[k];
+        res += factor * factor * total;
     }
     
     return std::sqrt(res);
 }
 
-void DenseMatrix::serialize(std::ofstream* outstream) const {
-    for(size_t i = 0; i < ((size_t) dimensions) * ((size_t) classifiers); ++i) {
-        int k = i%classifiers;
-        *outstream << scales[k] * data[i] << ' ';
+void DenseMatrix::rowWeights(size_t row, float* out) const {
+    if (lazy) {
+        // the scales stay at 1
+        decayRow(row, out);
+        return;
+    }
+    
+    const float* w = data + row * stride;
+    if (averaged && avg_count > 0) {
+        for (int k = 0; k < classifiers; ++k) {
+            out[k] = (float) ((w[classifiers + k] + avg_scales[k] * w[k]) / avg_count);
+        }
+    } else {
+        for (int k = 0; k < classifiers; ++k) {
+            out[k] = (float) (scales[k] * w[k]);
+        }
+    }
+}
+
+void DenseMatrix::serialize(std::ostream* outstream, bool sparse) const {
+    std::vector<float> w(classifiers);
+    
+    if (hashed || sparse) {
+        // rows with a non zero weight, by increasing feature
+        std::vector<std::pair<int, size_t>> feature_slots;
+        for (size_t slot = 0; slot < n_rows; ++slot) {
+            rowWeights(slot, w.data());
+            if (std::any_of(w.begin(), w.end(), [](float x) {return x != 0.0f;})) {
+                feature_slots.emplace_back(hashed ? row_features[slot] : (int) slot, slot);
+            }
+        }
+        std::sort(feature_slots.begin(), feature_slots.end());
+        
+        *outstream << feature_slots.size() << '\n';
+        for (auto const& fs: feature_slots) {
+            *outstream << fs.first << ' ';
+            rowWeights(fs.second, w.data());
+            for (int k = 0; k < classifiers; ++k) {
+                *outstream << w[k] << ' ';
+            }
+            *outstream << '\n';
+        }
+    } else {
+        for (size_t r = 0; r < n_rows; ++r) {
+            rowWeights(r, w.data());
+            for (int k = 0; k < classifiers; ++k) {
+                *outstream << w[k] << ' ';
+            }
+        }
     }
     
     for(int i = 0; i < classifiers; ++i){
-        *outstream << intercept[i] << ' ';
+        *outstream << bias_weight(i) << ' ';
     }
     
     *outstream << '\n';
 }
 
-void DenseMatrix::deserialize(std::ifstream* instream) {
-    for (size_t i = 0; i < ((size_t) dimensions) * ((size_t) classifiers); ++i){
-        *instream >> data[i];
+DenseMatrix DenseMatrix::selectColumns(const std::vector<int>& columns) const {
+    DenseMatrix res(dimensions, (int) columns.size(), false, Pegasos, learning_rate, hashed, precision, false);
+    std::vector<float> w(classifiers);
+    
+    for (size_t slot = 0; slot < n_rows; ++slot) {
+        rowWeights(slot, w.data());
+        if (std::none_of(columns.begin(), columns.end(), [&w](int k) {return w[k] != 0.0f;})) continue;
+        
+        float* row = res.getRow(hashed ? row_features[slot] : (int) slot);
+        for (size_t j = 0; j < columns.size(); ++j) {
+            row[j] = w[columns[j]];
+        }
+    }
+    
+    for (size_t j = 0; j < columns.size(); ++j) {
+        res.intercept[j] = bias_weight(columns[j]);
+    }
+    
+    return res;
+}
+
+void DenseMatrix::deserialize(std::istream* instream) {
+    if (hashed) {
+        size_t rows;
+        *instream >> rows;
+        for (size_t r = 0; r < rows && *instream; ++r) {
+            int feature;
+            *instream >> feature;
+            if (feature < 0) {
+                throw std::runtime_error("Negative feature index in model file.");
+            }
+            
+            float* row = getRow(feature);
+            for (int k = 0; k < classifiers; ++k) {
+                *instream >> row[k];
+            }
+        }
+    } else {
+        for (size_t r = 0; r < n_rows; ++r) {
+            float* row = data + r * stride;
+            for (int k = 0; k < classifiers; ++k) {
+                *instream >> row[k];
+            }
+        }
     }
     
     for (int i = 0; i < classifiers; ++i) {
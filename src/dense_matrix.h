@@ -26,79 +26,517 @@
 #include <cstring>
 #include <limits>
 #include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
 
 #include "sparse_vector.h"
+#include "page_allocator.h"
+
+// step size rule of the sparse updates
+enum Optimizer {
+    Pegasos, // the caller provides the step, a * s is added as is
+    AdaGrad, // per entry learning_rate / sqrt(sum of squared gradients)
+    RMSProp  // same, with an exponential moving average of the squared gradients
+};
+
+// arithmetic of inner and of the non adaptive updates
+enum Precision {
+    DoublePrecision, // double accumulators
+    SinglePrecision  // float accumulators, Kahan compensated in inner, twice the SIMD width
+};
+
+// stopping rule of DenseMatrix::boundedInner
+enum EarlyExit {
+    ThresholdExit, // once the max score is known to be above the threshold or not
+    ArgmaxExit     // once the classifier with the max score is known
+};
 
 class DenseMatrix {
 public:
-    DenseMatrix(int dimensions, int classifiers);
+    /* averaged: also maintains the running average of the weights
+     * (Polyak averaging), lazily, see accumulateAverage.
+     * optimizer: with AdaGrad or RMSProp, the a coefficients given to addInplace
+     * are gradients and each (feature, classifier) entry gets its own step size.
+     * hashed: the feature rows live in an open addressing hash table and are
+     * allocated on first update, instead of one row per dimension up front.
+     * Memory is then proportional to the number of updated features.
+     * precision: see Precision, the scales, intercepts and averages stay in double.
+     * lazy: mulInplace and truncate only record the decay and the L1 penalty,
+     * each row gets them when next updated (or on the fly when read), instead of
+     * through the global scales. Costs two doubles per row, not compatible with
+     * averaged.
+     */
+    DenseMatrix(int dimensions, int classifiers, bool averaged=false,
+                Optimizer optimizer=Pegasos, double learning_rate=0.1, bool hashed=false,
+                Precision precision=DoublePrecision, bool lazy=false);
     
-    DenseMatrix(const DenseMatrix& other) : dimensions(other.dimensions), classifiers(other.classifiers) {
+    DenseMatrix(const DenseMatrix& other) : dimensions(other.dimensions), classifiers(other.classifiers),
+    averaged(other.averaged), optimizer(other.optimizer), learning_rate(other.learning_rate), hashed(other.hashed),
+    precision(other.precision), lazy(other.lazy), stride(other.stride), acc_offset(other.acc_offset),
+    marks_offset(other.marks_offset), avg_count(other.avg_count), decay(other.decay), penalty(other.penalty), n_rows(other.n_rows),
+    row_capacity(other.row_capacity), table_shift(other.table_shift), kept_rows(other.kept_rows),
+    row_bounds(other.row_bounds), max_pass_threads(other.max_pass_threads) {
         
-        data = new float[dimensions * ((size_t) classifiers)];
+        data = pagealloc::allocate(row_capacity * stride);
         std::memcpy(data, other.data,
-                    sizeof(float) * ((size_t) dimensions) * ((size_t) classifiers));
+                    sizeof(float) * row_capacity * stride);
+        
+        
+        row_keys = nullptr;
+        row_slots = nullptr;
+        row_features = nullptr;
+        if (hashed) {
+            row_keys = new int[tableCapacity()];
+            std::memcpy(row_keys, other.row_keys, sizeof(int) * tableCapacity());
+            row_slots = new int[tableCapacity()];
+            std::memcpy(row_slots, other.row_slots, sizeof(int) * tableCapacity());
+            row_features = new int[row_capacity];
+            std::memcpy(row_features, other.row_features, sizeof(int) * row_capacity);
+        }
         
         scales = new double[classifiers];
         std::memcpy(scales, other.scales, sizeof(double) * classifiers);
         
+        inv_scales = new double[classifiers];
+        std::memcpy(inv_scales, other.inv_scales, sizeof(double) * classifiers);
+        
+        coef = new double[classifiers];
+        scratch = new float[3 * classifiers];
+        
         intercept = new double[classifiers];
         std::memcpy(intercept, other.intercept, sizeof(double) * classifiers);
+        
+        avg_scales = new double[classifiers];
+        std::memcpy(avg_scales, other.avg_scales, sizeof(double) * classifiers);
+        
+        avg_intercept = new double[classifiers];
+        std::memcpy(avg_intercept, other.avg_intercept, sizeof(double) * classifiers);
+        
+        intercept_acc = new double[classifiers];
+        std::memcpy(intercept_acc, other.intercept_acc, sizeof(double) * classifiers);
     }
     
-    DenseMatrix(DenseMatrix&& other) : dimensions(other.dimensions), classifiers(other.classifiers), data(other.data), scales(other.scales), intercept(other.intercept) {
+    DenseMatrix(DenseMatrix&& other) : dimensions(other.dimensions), classifiers(other.classifiers),
+    averaged(other.averaged), optimizer(other.optimizer), learning_rate(other.learning_rate), hashed(other.hashed),
+    precision(other.precision), lazy(other.lazy), stride(other.stride), acc_offset(other.acc_offset),
+    marks_offset(other.marks_offset), data(other.data),
+    scales(other.scales), inv_scales(other.inv_scales), coef(other.coef), scratch(other.scratch),
+    intercept(other.intercept),
+    avg_scales(other.avg_scales), avg_intercept(other.avg_intercept), avg_count(other.avg_count),
+    intercept_acc(other.intercept_acc), decay(other.decay), penalty(other.penalty),
+    n_rows(other.n_rows), row_capacity(other.row_capacity),
+    row_keys(other.row_keys), row_slots(other.row_slots), table_shift(other.table_shift),
+    row_features(other.row_features), kept_rows(std::move(other.kept_rows)),
+    row_bounds(std::move(other.row_bounds)), max_pass_threads(other.max_pass_threads) {
         
         other.data = nullptr;
+        other.row_keys = nullptr;
+        other.row_slots = nullptr;
+        other.row_features = nullptr;
         other.scales = nullptr;
+        other.inv_scales = nullptr;
+        other.coef = nullptr;
+        other.scratch = nullptr;
         other.intercept = nullptr;
+        other.avg_scales = nullptr;
+        other.avg_intercept = nullptr;
+        other.intercept_acc = nullptr;
         //other.norms2 = nullptr;
     }
     
-    ~DenseMatrix() {delete[] data; delete[] scales; delete[] intercept;};
+    ~DenseMatrix() {
+        pagealloc::release(data, row_capacity * stride);
+        delete[] scales; delete[] inv_scales; delete[] coef; delete[] scratch;
+        delete[] intercept;
+        delete[] avg_scales; delete[] avg_intercept; delete[] intercept_acc;
+        delete[] row_keys; delete[] row_slots; delete[] row_features;
+    };
     
     // res will be zeroed-out
     // res must have 'classifiers' size
-    void inner(const SparseVector& s, double* res, const bool* fmask=nullptr) const;
+    // buffer: 3 * classifiers floats of work space (single precision and lazy storage),
+    // so that concurrent calls are safe as long as the weights do not change
+    void inner(const SparseVector& s, double* res, float* buffer, const bool* fmask=nullptr) const;
+    
+    // same as inner, with the averaged weights
+    // falls back to inner when no average has been accumulated
+    // unscaled: classifiers doubles of work space
+    void averageInner(const SparseVector& s, double* res, float* buffer, double* unscaled) const;
+    
+    /* inner (averageInner with average) over the n features from features, indexed like the
+     * entries of a SparseVector, for single instance scoring. No member work space is used:
+     * buffer must hold 3 * classifiers floats and unscaled classifiers doubles, so that
+     * concurrent calls are safe as long as the weights do not change.
+     */
+    void innerSpan(const IValue* features, size_t n, double* res, bool average, float* buffer,
+                   double* unscaled) const;
+    
+    // work space of boundedInner, kept by the caller (one per thread) so that it grows only once
+    struct BoundedScratch {
+        struct Feature {
+            double bound; // |value| * row bound
+            ptrdiff_t slot;
+            float value;
+        };
+        std::vector<Feature> features; // the features of s with a row
+        std::vector<double> suffix; // bound from each feature on
+    };
+    
+    /* Early exit inner: the features of s are processed by decreasing bound on their
+     * contribution, |value| * max_k |w_k|, until the rule is decided. res gets the
+     * partial scores and remaining a bound on the features left out: each full score
+     * is within res_k +- remaining (0 when all features were processed). Returns the
+     * number of features processed. Requires computeRowBounds since the last update,
+     * no averaging and no lazy storage.
+     */
+    size_t boundedInner(const SparseVector& s, double* res, EarlyExit rule, double threshold,
+                        double* remaining, BoundedScratch& work) const;
+    
+    // max_k |w_k| of each row, for boundedInner
+    void computeRowBounds();
     
+    // whether computeRowBounds was called since the storage last grew (not since the last update)
+    bool hasRowBounds() const {return !row_bounds.empty() && row_bounds.size() == row_capacity;}
+    
+    // l2 norm of the weights (averaged ones if available)
     double l2norm() const;
     
+    // number of non zero weights and of feature rows with at least one, as serialized
+    size_t nonZeros() const;
+    size_t nonZeroRows() const;
+    
     // for all k, w_k += a_k * s
+    // (w_k += step(a_k * s) with an adaptive optimizer, the step is per entry)
     // with optional support for dropout noise
     void addInplace(const SparseVector& s, const double * const a, const bool* fmask=nullptr);
     
     // w_k += a * s
+    // (w_k += step(a * s) with an adaptive optimizer, the step is per entry)
     // with optional support for dropout noise
     void addInplace(const SparseVector& s, double a, int k, const bool* fmask=nullptr);
     
+    /* Fused SGD step: innerKeepRows is inner, and keeps the row of each feature
+     * of s, which the addInplaceKeptRows that follow update without probing the
+     * hash table again. s must be the same, and no other update must happen in
+     * between. No dropout support. Same as inner / addInplace with dense storage.
+     */
+    void innerKeepRows(const SparseVector& s, double* res);
+    void addInplaceKeptRows(const SparseVector& s, const double * const a);
+    void addInplaceKeptRows(const SparseVector& s, double a, int k);
+    
     // for all k, w_k *= a_k
     void mulInplace(const double * const a);
     
     // w *= a
     void mulInplace(double a);
     
+    /* L1 truncation of the weights towards zero by penalty (w = sign(w) * max(0, |w| - penalty)),
+     * lazy storage only. A row gets the decays and penalties it missed in the order they
+     * were recorded, as long as it stays of the same sign (truncated gradient).
+     */
+    void truncate(double penalty);
+    
+    // adds the current weights to the running average, in O(classifiers)
+    void accumulateAverage();
+    
+    // hints the cache about the rows an upcoming inner / addInplace with s will touch
+    // (the hash table entries with hashed storage, the rows are unknown before the lookup)
+    void prefetch(const SparseVector& s) const;
+    
     // zeros-out matrix
     void clear();
     
-    void serialize(std::ofstream* outstream) const;
-    void deserialize(std::ifstream* instream);
+    /* writes the averaged weights if available. The dense encoding writes all
+     * dimensions * classifiers weights. The sparse one, always used by hashed
+     * storage, writes the number of rows followed by one "feature w_0 ... w_k-1"
+     * line per row having a non zero weight, by increasing feature.
+     * deserialize reads the encoding of the storage.
+     */
+    void serialize(std::ostream* outstream, bool sparse=false) const;
+    void deserialize(std::istream* instream);
+    
+    /* inference copy of the given classifiers, in the given order: the weights as
+     * serialize writes them (averaged, decayed), with the same storage and precision,
+     * without averaging, adaptive accumulators nor lazy marks.
+     */
+    DenseMatrix selectColumns(const std::vector<int>& columns) const;
+    
+    // number of feature rows held in memory (dimensions for dense storage)
+    size_t getNRows() const {return n_rows;}
+    
+    // bytes allocated for the weights and the row index
+    size_t memoryUsage() const;
+    
+    /* largest number of threads of the whole matrix passes (rescale, l2norm, clear), 0 for
+     * the hardware concurrency. Lower it when several matrices are trained concurrently.
+     */
+    void setPassThreads(size_t n) {max_pass_threads = n;}
     
     const int dimensions;
     const int classifiers;
+    const bool averaged;
+    const Optimizer optimizer;
+    const double learning_rate;
+    const bool hashed;
+    const Precision precision;
+    const bool lazy;
     
     const double bias = 1.0;
     
 private:
-    // unscaled data
+    /* floats per feature row: the weights, then the average accumulators,
+     * then the squared gradient accumulators of the adaptive optimizers,
+     * then the two double marks of lazy storage.
+     * Everything an update touches for a feature lives in one row.
+     */
+    const size_t stride;
+    
+    // offset of the squared gradient accumulators within a row
+    const size_t acc_offset;
+    
+    // offset of the lazy storage marks within a row
+    const size_t marks_offset;
+    
+    // unscaled data, from pagealloc
     float* data;
     
     // data scales
     double* scales;
     
+    // 1 / scales, refreshed once per mulInplace instead of dividing in the update loops
+    double* inv_scales;
+    
+    // per call coefficients of addInplace, a_k / scales_k
+    double* coef;
+    
+    // work space of the updates: single precision coefficients, then sums and compensations of innerKeepRows
+    float* scratch;
+    
     // bias terms are scaled
     double* intercept;
     
+    /* The sum of all past weights is kept as v + avg_scales * u, where u are the
+     * unscaled weights and v the accumulators stored next to u in each row.
+     * A sparse update u += d only changes v -= avg_scales * d on the same entries,
+     * and each step adds the current scales to avg_scales.
+     */
+    double* avg_scales;
+    
+    // sum of all past bias terms
+    double* avg_intercept;
+    
+    // number of accumulated steps
+    size_t avg_count;
+    
+    // squared gradient accumulators of the bias terms
+    double* intercept_acc;
+    
+    /* lazy storage: product of all decays, and sum of all L1 penalties divided
+     * by the decay at the time they were recorded. The marks of a row hold both
+     * values as of its last catch up, a zero decay mark for a row never written.
+     * Like the scales, the decay is kept above min_scale by rebase.
+     */
+    double decay;
+    double penalty;
+    
+    // rows in use and rows allocated in data
+    size_t n_rows;
+    size_t row_capacity;
+    
+    /* hashed storage: feature index -> row slot, linear probing over a power of
+     * 2 sized table kept at most half full. row_keys and row_slots are -1 for empty
+     * entries, feature indices are non negative.
+     */
+    int* row_keys;
+    int* row_slots;
+    int table_shift; // 64 - log2(table capacity)
+    
+    // feature index of each row
+    int* row_features;
+    
+    inline size_t tableCapacity() const {return ((size_t) 1) << (64 - table_shift);}
+    
+    // fibonacci hashing, the top bits of the product index the table
+    inline size_t tableIndex(int feature) const {
+        return (size_t) ((((uint64_t) (uint32_t) feature) * 0x9E3779B97F4A7C15ULL) >> table_shift);
+    }
+    
+    /* row slot of a feature, -1 if the feature has none (negative features never have one,
+     * the empty entry test comes first so that -1 cannot match an empty entry)
+     */
+    inline ptrdiff_t findSlot(int feature) const {
+        if (!hashed) {
+            return (feature >= 0 && feature < dimensions) ? feature : -1;
+        }
+        
+        const size_t mask = tableCapacity() - 1;
+        for (size_t i = tableIndex(feature); ; i = (i + 1) & mask) {
+            if (row_keys[i] < 0) return -1;
+            if (row_keys[i] == feature) return row_slots[i];
+        }
+    }
+    
+    // row of a feature, nullptr if the feature has none
+    inline const float* findRow(int feature) const {
+        ptrdiff_t slot = findSlot(feature);
+        return (slot >= 0) ? data + slot * stride : nullptr;
+    }
+    
+    // row slot of a feature, allocated on first access with hashed storage (feature >= 0)
+    inline size_t getSlot(int feature) {
+        if (!hashed) return (size_t) feature;
+        
+        const size_t mask = tableCapacity() - 1;
+        for (size_t i = tableIndex(feature); ; i = (i + 1) & mask) {
+            if (row_keys[i] < 0) return addRow(feature, i);
+            if (row_keys[i] == feature) return (size_t) row_slots[i];
+        }
+    }
+    
+    inline float* getRow(int feature) {
+        size_t slot = getSlot(feature); // may reallocate data
+        return data + slot * stride;
+    }
+    
+    // row allocated for a feature the kept rows of the fused step did not have, marked as written
+    inline float* newRow(int feature) {
+        size_t slot = getSlot(feature);
+        if (lazy) setMarks(slot, decay, penalty);
+        return data + slot * stride;
+    }
+    
+    // allocates a zeroed row for feature at empty table entry i, returns its slot
+    size_t addRow(int feature, size_t i);
+    
+    // empties the hashed storage
+    void clearRows(size_t capacity);
+    
+    /* inner with double and float accumulators, over the n features from features. When offsets
+     * is not null, the offset in data of the row of each feature is written to it (-1 for features
+     * without a row). buffer: 3 * classifiers floats of work space.
+     */
+    void innerDouble(const IValue* features, size_t n, double* res, const bool* fmask, ptrdiff_t* offsets) const;
+    void innerSingle(const IValue* features, size_t n, double* res, const bool* fmask, ptrdiff_t* offsets,
+                     float* buffer) const;
+    
+    // inner and averageInner over a span of features, with caller work space (see innerSpan)
+    void innerFeatures(const IValue* features, size_t n, double* res, const bool* fmask, float* buffer) const;
+    
+    // prefetch over a span of features, for writing (the update follows) or reading only
+    void prefetchFeatures(const IValue* features, size_t n, bool write) const;
+    void averageInnerFeatures(const IValue* features, size_t n, double* res, float* buffer, double* unscaled) const;
+    
+    // row offsets kept by innerKeepRows, copies keep them since the rows are at the same offsets
+    std::vector<ptrdiff_t> kept_rows;
+    
+    // per row bound of boundedInner, copies keep them along with the weights
+    std::vector<float> row_bounds;
+    
+    // sets coef (and its single precision copy in scratch) up for the updates of a
+    void setCoefficients(const double * const a);
+    
+    // row += step(value * a) for all classifiers, coef set up for a
+    inline void addToRow(float* row, float value, const double * const a);
+    
+    // row_k += step(value * a), coef_k = a / scales_k
+    inline void addToRow(float* row, float value, double a, double coef_k, int k);
+    
+    /* Threads of the whole matrix passes (rescale, l2norm, clear): one below
+     * min_pass_entries weights per thread, up to max_pass_threads (see setPassThreads).
+     * The threads only pay off on matrices of several millions of weights, where a pass
+     * takes milliseconds, so they are started per pass rather than kept around.
+     */
+    size_t passThreads() const;
+    const size_t min_pass_entries = ((size_t) 1) << 22;
+    size_t max_pass_threads = 0;
+    
+    // calls f(first_row, last_row, thread) over n_threads contiguous blocks of rows
+    template <class F> void forRowBlocks(size_t n_threads, F f) const;
+    
+    // weights of a row to use for serialization (the averaged ones if available)
+    void rowWeights(size_t row, float* out) const;
+    
+    void countNonZeros(size_t* weights, size_t* rows) const;
+    
+    // lazy storage marks, read and written as bytes since rows are floats
+    inline void getMarks(size_t slot, double* mark) const {
+        std::memcpy(mark, data + slot * stride + marks_offset, 2 * sizeof(double));
+    }
+    
+    inline void setMarks(size_t slot, double row_decay, double row_penalty) {
+        const double mark[2] = {row_decay, row_penalty};
+        std::memcpy(data + slot * stride + marks_offset, mark, 2 * sizeof(double));
+    }
+    
+    // lazy storage: weights of the row at slot with the decays and penalties it missed
+    inline void decayRow(size_t slot, float* out) const {
+        double mark[2];
+        getMarks(slot, mark);
+        const float* row = data + slot * stride;
+        
+        if (mark[0] == 0.0) { // never written
+            for (int k = 0; k < classifiers; ++k) {
+                out[k] = 0.0f;
+            }
+            return;
+        }
+        
+        const double factor = decay / mark[0];
+        const double threshold = (penalty - mark[1]) * mark[0];
+        
+        for (int k = 0; k < classifiers; ++k) {
+            double w = row[k];
+            out[k] = (float) (factor * std::copysign(std::max(std::fabs(w) - threshold, 0.0), w));
+        }
+    }
+    
+    inline bool isCurrent(size_t slot) const {
+        double mark[2];
+        getMarks(slot, mark);
+        return mark[0] == decay && mark[1] == penalty;
+    }
+    
+    // lazy storage: applies the missed decays and penalties to the row at slot
+    inline void catchUp(size_t slot) {
+        if (isCurrent(slot)) return;
+        decayRow(slot, data + slot * stride);
+        setMarks(slot, decay, penalty);
+    }
+    
+    // inner of lazy storage, rows are decayed on the fly
+    void innerLazy(const IValue* features, size_t n, double* res, const bool* fmask, float* buffer) const;
+    
+    // catches all the rows up and restarts decay from 1 and penalty from 0, lazy counterpart of rescale
+    void rebase();
+    
     void rescale();
     const double min_scale = std::sqrt(std::numeric_limits<float>::min());
+    
+    const double adaptive_epsilon = 1e-8;
+    const double rmsprop_decay = 0.9;
+    
+    /* Step for gradient g given its squared gradient accumulator acc, in weight
+     * (not unscaled) units. The accumulators only ever see gradients, so the lazy
+     * L2 decay carried by the scales leaves them untouched.
+     */
+    template <class T> inline double adaptiveStep(T& acc, double g) const {
+        if (optimizer == AdaGrad) {
+            acc += g * g;
+        } else {
+            acc = rmsprop_decay * acc + (1.0 - rmsprop_decay) * g * g;
+        }
+        return learning_rate * g / std::sqrt(acc + adaptive_epsilon);
+    }
+    
+    inline double bias_weight(int k) const {
+        if (averaged && avg_count > 0) {
+            return avg_intercept[k] / avg_count;
+        }
+        return intercept[k];
+    }
 };
 
 
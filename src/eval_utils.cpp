@@ -64,6 +64,7 @@ namespace evalutils {
         double cost_exclusion = 0;
         double entropy = 0;
         double l2 = (model.getW()).l2norm();
+        double density = ((double) (model.getW()).nonZeros()) / ((double) (model.getW()).dimensions * k);
         
         int* occ = new int[k]();
         float* p = new float[k]();
@@ -244,6 +245,7 @@ namespace evalutils {
         (*res)[Metric::CostPositives] = cost_pos;
         (*res)[Metric::CostNegatives] = cost_neg;
         (*res)[Metric::L2] = l2;
+        (*res)[Metric::Density] = density;
         
         (*res)[Metric::Redundancy] = cost_exclusion;
         (*res)[Metric::Entropy] = entropy;
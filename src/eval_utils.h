@@ -34,7 +34,8 @@ namespace evalutils {
 
 enum Metric { Accuracy, AbsoluteTop, AUC, AUC01, AUC001,
             Cost, CostPositives, CostNegatives, Redundancy, Entropy, L2,
-    TruePositiveRate, FalsePositiveRate, Precision};
+    TruePositiveRate, FalsePositiveRate, Precision,
+    Density}; // new metrics go last, the values of the others stay
 
 double entropy(const int* assignments, size_t length, unsigned short k);
 
@@ -0,0 +1,418 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// generator.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+/* Synthetic datasets with a known polytope: the positive class is the outside of
+ * k random hyperplanes, as the CPM models it. Written as libsvm text or binary cache.
+ * The polytope and its threshold only depend on the model seed, so that datasets drawn
+ * with different seeds (e.g. a training and a test set) share the same ground truth.
+ * Rows are generated by blocks, each block from its own seed, so that the output only
+ * depends on the seeds and not on the number of threads.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include "option_parser.h"
+#include "sparse_vector.h"
+#include "stochastic_data_adaptor.h"
+
+static const size_t block_rows = 1 << 16;
+
+// values are multiples of 1 / value_steps in (0, 1], so that text and binary files hold the same data
+static const int value_steps = 10000;
+
+/* Zipf distribution over {1, ..., n}, P(r) proportional to r^-exponent, by rejection-inversion
+ * (Hormann and Derflinger 1996): O(1) per draw and no table, whatever n.
+ */
+class ZipfDistribution {
+public:
+    ZipfDistribution(double n, double exponent) : n(n), exponent(exponent) {
+        h_integral_x1 = hIntegral(1.5) - 1.0;
+        h_integral_n = hIntegral(n + 0.5);
+        s = 2.0 - hIntegralInverse(hIntegral(2.5) - h(2.0));
+    }
+    
+    template <class G>
+    int operator()(G& generator) {
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        while (true) {
+            double u = h_integral_n + uniform(generator) * (h_integral_x1 - h_integral_n);
+            double x = hIntegralInverse(u);
+            double r = std::min(n, std::max(1.0, std::floor(x + 0.5)));
+            if ((r - x <= s) || (u >= hIntegral(r + 0.5) - h(r))) return (int) r;
+        }
+    }
+
+private:
+    const double n;
+    const double exponent;
+    double h_integral_x1;
+    double h_integral_n;
+    double s;
+    
+    double h(double x) const {return std::exp(-exponent * std::log(x));}
+    
+    double hIntegral(double x) const {
+        double log_x = std::log(x);
+        return expm1Ratio((1.0 - exponent) * log_x) * log_x;
+    }
+    
+    double hIntegralInverse(double x) const {
+        double t = std::max(-1.0, x * (1.0 - exponent));
+        return std::exp(log1pRatio(t) * x);
+    }
+    
+    // log(1 + x) / x and (exp(x) - 1) / x, stable around 0
+    static double log1pRatio(double x) {
+        return (std::fabs(x) > 1e-8) ? std::log1p(x) / x : 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+    }
+    
+    static double expm1Ratio(double x) {
+        return (std::fabs(x) > 1e-8) ? std::expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x / 3.0 * (1.0 + 0.25 * x));
+    }
+};
+
+struct GeneratorConfig {
+    int dimensions;
+    int non_zeros;
+    bool zipf;
+    double zipf_exponent;
+    int classifiers;
+    double noise;
+    bool binary;
+    unsigned int seed; // rows
+    unsigned int model_seed; // polytope
+    
+    // rows whose largest hyperplane score is above it are positive
+    double threshold;
+};
+
+// per block counts, summed up for the report
+struct BlockStats {
+    size_t non_zeros = 0;
+    size_t positives = 0;
+    size_t flipped = 0;
+    std::vector<size_t> facets; // clean positives per hyperplane of largest score
+};
+
+// entry of hyperplane j for a feature, uniform in [-1, 1) and never stored
+static inline float hyperplaneWeight(unsigned int seed, int j, int index) {
+    uint64_t key = (((uint64_t) j) << 32) | (uint32_t) index;
+    uint64_t h = SparseVector::mixBits(SparseVector::mixBits(seed + 0x9e3779b97f4a7c15ULL) ^ key);
+    return (float) ((h >> 40) * (2.0 / (1 << 24)) - 1.0);
+}
+
+static inline void appendUInt(std::string& out, uint32_t x) {
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = (char) ('0' + x % 10);
+        x /= 10;
+    } while (x);
+    while (n) out += digits[--n];
+}
+
+// q / value_steps with at most 4 decimals, trailing zeros dropped
+static inline void appendValue(std::string& out, int q) {
+    if (q == value_steps) {
+        out += '1';
+        return;
+    }
+    char decimals[4];
+    for (int i = 3; i >= 0; --i) {
+        decimals[i] = (char) ('0' + q % 10);
+        q /= 10;
+    }
+    int len = 4;
+    while (decimals[len - 1] == '0') --len;
+    out += "0.";
+    out.append(decimals, len);
+}
+
+static inline void appendRaw(std::string& out, const void* p, size_t n) {
+    out.append((const char*) p, n);
+}
+
+/* draws one row: sorted distinct indices and quantized values, and the largest
+ * hyperplane score with its hyperplane
+ */
+template <class G>
+static std::pair<double, int> drawRow(const GeneratorConfig& config, G& generator, ZipfDistribution& zipf,
+                                      std::vector<int>& indices, std::vector<int>& values) {
+    std::uniform_int_distribution<int> any_length(std::max(1, config.non_zeros / 2),
+                                                  std::max(1, config.non_zeros + config.non_zeros / 2));
+    std::uniform_int_distribution<int> any_index(0, config.dimensions - 1);
+    std::uniform_int_distribution<int> any_value(1, value_steps);
+    
+    indices.resize(any_length(generator));
+    for (auto& index: indices) {
+        index = config.zipf ? zipf(generator) - 1 : any_index(generator);
+    }
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    
+    values.resize(indices.size());
+    for (auto& q: values) {
+        q = any_value(generator);
+    }
+    
+    double best = -std::numeric_limits<double>::infinity();
+    int facet = 0;
+    for (int j = 0; j < config.classifiers; ++j) {
+        double score = 0.0;
+        for (size_t i = 0; i < indices.size(); ++i) {
+            score += hyperplaneWeight(config.model_seed, j, indices[i]) * (((float) values[i]) / value_steps);
+        }
+        if (score > best) {
+            best = score;
+            facet = j;
+        }
+    }
+    
+    return std::make_pair(best, facet);
+}
+
+static uint64_t blockSeed(unsigned int seed, uint64_t block) {
+    return SparseVector::mixBits(SparseVector::mixBits(seed) + block);
+}
+
+// formats the n_rows rows of block into out
+static void generateBlock(const GeneratorConfig& config, uint64_t block, size_t n_rows, std::string& out,
+                          BlockStats& stats) {
+    std::mt19937_64 generator(blockSeed(config.seed, block));
+    ZipfDistribution zipf(config.dimensions, config.zipf_exponent);
+    std::bernoulli_distribution flip(config.noise);
+    
+    std::vector<int> indices;
+    std::vector<int> values;
+    std::vector<float> float_values;
+    
+    out.clear();
+    stats.facets.assign(config.classifiers, 0);
+    
+    for (size_t r = 0; r < n_rows; ++r) {
+        auto score_facet = drawRow(config, generator, zipf, indices, values);
+        
+        bool positive = score_facet.first > config.threshold;
+        if (positive) stats.facets[score_facet.second]++;
+        if (config.noise > 0 && flip(generator)) {
+            positive = !positive;
+            stats.flipped++;
+        }
+        if (positive) stats.positives++;
+        stats.non_zeros += indices.size();
+        
+        int32_t label = positive ? 1 : -1;
+        if (config.binary) {
+            uint32_t nnz = (uint32_t) indices.size();
+            float_values.resize(nnz);
+            for (size_t i = 0; i < nnz; ++i) {
+                float_values[i] = ((float) values[i]) / value_steps;
+            }
+            appendRaw(out, &label, sizeof(label));
+            appendRaw(out, &nnz, sizeof(nnz));
+            appendRaw(out, indices.data(), nnz * sizeof(int32_t));
+            appendRaw(out, float_values.data(), nnz * sizeof(float));
+        } else {
+            out += positive ? "1" : "-1";
+            for (size_t i = 0; i < indices.size(); ++i) {
+                out += ' ';
+                appendUInt(out, (uint32_t) indices[i]);
+                out += ':';
+                appendValue(out, values[i]);
+            }
+            out += '\n';
+        }
+    }
+}
+
+/* threshold on the largest hyperplane score giving positive_rate positives before noise,
+ * from a pilot sample drawn from the model seed, the same for all the datasets of a polytope
+ */
+static double calibrate(const GeneratorConfig& config, double positive_rate) {
+    const size_t pilot_rows = 20000;
+    std::mt19937_64 generator(blockSeed(config.model_seed, UINT64_MAX));
+    ZipfDistribution zipf(config.dimensions, config.zipf_exponent);
+    
+    std::vector<int> indices;
+    std::vector<int> values;
+    std::vector<double> scores(pilot_rows);
+    for (auto& score: scores) {
+        score = drawRow(config, generator, zipf, indices, values).first;
+    }
+    
+    size_t rank = std::min(pilot_rows - 1, (size_t) ((1.0 - positive_rate) * pilot_rows));
+    std::nth_element(scores.begin(), scores.begin() + rank, scores.end());
+    return scores[rank];
+}
+
+int main(int argc, char* const argv[]) {
+    OptionParser op("Generate a synthetic dataset whose positive class is the outside of a random polytope.");
+    
+    op.addOption("output file.", 'o', "out", false, "", nullptr);
+    const std::vector<const char*> formats = {"libsvm", "binary"};
+    op.addOption("output format, libsvm text or binary cache (read by cpm and the python module alike).", '\0',
+                 "format", true, "libsvm", &formats);
+    op.addOption("number of rows.", 'n', "rows", true, (size_t) 100000, nullptr);
+    op.addOption("number of dimensions (feature index space).", 'd', "dimensions", true, (int) 1000000, nullptr);
+    op.addOption("average number of non-zeros per row, row lengths are uniform within +/- 50%.", '\0',
+                 "non_zeros", true, (int) 50, nullptr);
+    const std::vector<const char*> distributions = {"uniform", "zipf"};
+    op.addOption("distribution of the feature indices. Under zipf, index i is drawn with probability "
+                 "proportional to (i + 1)^-zipf_exponent.", '\0', "distribution", true, "uniform", &distributions);
+    op.addOption("exponent of the zipf distribution.", '\0', "zipf_exponent", true, 1.1f, nullptr);
+    op.addOption("number of hyperplanes of the polytope.", 'k', "classifiers", true, (int) 4, nullptr);
+    op.addOption("fraction of positive rows, before label noise.", '\0', "positive_rate", true, 0.5f, nullptr);
+    op.addOption("probability of flipping each label.", '\0', "noise", true, 0.0f, nullptr);
+    op.addOption("random seed of the rows.", '\0', "seed", true, (int) 0, nullptr);
+    op.addOption("random seed of the polytope, datasets of the same model seed share their ground truth.", '\0',
+                 "model_seed", true, (int) 0, nullptr);
+    op.addOption("number of generating threads (0: all cores).", '\0', "threads", true, (int) 0, nullptr);
+    op.addOption("instead of generating, write the binary cache of this libsvm file.", '\0', "convert", false,
+                 "", nullptr);
+    
+    op.parseCmdString(argc, argv);
+    
+    const char* out = op.getString("out");
+    if (std::strlen(out) == 0) {
+        std::cerr << "An output file is required (--out).\n";
+        return 1;
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    
+    const char* convert = op.getString("convert");
+    if (std::strlen(convert) > 0) {
+        StochasticDataAdaptor dataset(convert);
+        dataset.saveBinary(out);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "Cached " << dataset.getNInstances() << " rows in " << elapsed.count() << "s\n";
+        return 0;
+    }
+    
+    GeneratorConfig config;
+    config.dimensions = op.getInt("dimensions");
+    config.non_zeros = op.getInt("non_zeros");
+    config.zipf = (0 == std::strcmp(op.getString("distribution"), "zipf"));
+    config.zipf_exponent = op.getFloat("zipf_exponent");
+    config.classifiers = op.getInt("classifiers");
+    config.noise = op.getFloat("noise");
+    config.binary = (0 == std::strcmp(op.getString("format"), "binary"));
+    config.seed = (unsigned int) op.getInt("seed");
+    config.model_seed = (unsigned int) op.getInt("model_seed");
+    
+    const size_t n_rows = op.getSizet("rows");
+    const double positive_rate = op.getFloat("positive_rate");
+    
+    if (config.dimensions < 1 || config.non_zeros < 1 || config.classifiers < 1 || config.zipf_exponent <= 0 ||
+        positive_rate <= 0 || positive_rate >= 1 || config.noise < 0 || config.noise > 1) {
+        std::cerr << "Invalid parameters.\n";
+        return 1;
+    }
+    
+    int n_threads = op.getInt("threads");
+    if (n_threads < 1) n_threads = std::max(1, (int) std::thread::hardware_concurrency());
+    
+    config.threshold = calibrate(config, positive_rate);
+    
+    std::ofstream fout(out, std::ios::binary);
+    if (!fout) {
+        std::cerr << "Cannot open " << out << '\n';
+        return 1;
+    }
+    
+    if (config.binary) {
+        uint32_t reserved = 0;
+        uint64_t rows = n_rows;
+        uint64_t dimensions = config.dimensions;
+        fout.write(binary_magic, sizeof(binary_magic));
+        fout.write((const char*) &binary_version, sizeof(binary_version));
+        fout.write((const char*) &reserved, sizeof(reserved));
+        fout.write((const char*) &rows, sizeof(rows));
+        fout.write((const char*) &dimensions, sizeof(dimensions));
+    }
+    
+    // one block per thread and round, written in block order
+    const uint64_t n_blocks = (n_rows + block_rows - 1) / block_rows;
+    std::vector<std::string> buffers(n_threads);
+    std::vector<BlockStats> stats(n_blocks);
+    
+    for (uint64_t round = 0; round < n_blocks; round += n_threads) {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < n_threads && round + t < n_blocks; ++t) {
+            uint64_t block = round + t;
+            size_t rows = std::min(block_rows, n_rows - block * block_rows);
+            threads.emplace_back(generateBlock, std::cref(config), block, rows, std::ref(buffers[t]),
+                                 std::ref(stats[block]));
+        }
+        
+        for (size_t t = 0; t < threads.size(); ++t) {
+            threads[t].join();
+            fout.write(buffers[t].data(), buffers[t].size());
+        }
+        
+        if (!fout) {
+            std::cerr << "Error when writing " << out << '\n';
+            return 1;
+        }
+    }
+    
+    size_t bytes = (size_t) fout.tellp();
+    fout.close();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    
+    BlockStats total;
+    total.facets.assign(config.classifiers, 0);
+    for (auto const& s: stats) {
+        total.non_zeros += s.non_zeros;
+        total.positives += s.positives;
+        total.flipped += s.flipped;
+        for (int j = 0; j < config.classifiers; ++j) {
+            total.facets[j] += s.facets[j];
+        }
+    }
+    
+    // the best achievable accuracy is 1 - noise, the polytope being known
+    std::cerr << "Rows: " << n_rows << '\n'
+    << "Non-zeros: " << total.non_zeros << " (" << ((double) total.non_zeros) / n_rows << " per row)\n"
+    << "Positives: " << total.positives << " (" << 100.0 * total.positives / n_rows << "%)\n"
+    << "Flipped labels: " << total.flipped << '\n'
+    << "Positives per hyperplane (before noise):";
+    for (auto count: total.facets) {
+        std::cerr << ' ' << count;
+    }
+    std::cerr << '\n'
+    << "Written " << bytes / (1024.0 * 1024.0) << "MB in " << elapsed.count() << "s ("
+    << bytes / (1024.0 * 1024.0) / elapsed.count() << "MB/s)\n";
+    
+    return 0;
+}
@@ -0,0 +1,468 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// inference_server.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "inference_server.h"
+
+namespace serving {
+
+static const char* unix_prefix = "unix:";
+static const char* tcp_prefix = "tcp:";
+
+// longest wait of the accept loop, bounds the delay to notice a stop
+static const int poll_ms = 100;
+
+// a text request longer than this closes the connection
+static const size_t max_line_bytes = 64 << 20;
+
+// a peer hanging up must not kill the process with SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int send_flags = MSG_NOSIGNAL;
+#else
+static const int send_flags = 0;
+#endif
+
+static bool hasPrefix(const std::string& s, const char* prefix) {
+    return s.compare(0, std::strlen(prefix), prefix) == 0;
+}
+
+// address of a unix: endpoint
+static sockaddr_un unixAddress(const std::string& path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Invalid socket path: " + path);
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+// loopback address of a tcp: endpoint
+static sockaddr_in tcpAddress(const std::string& port) {
+    char* end = nullptr;
+    long number = std::strtol(port.c_str(), &end, 10);
+    if (port.empty() || *end != '\0' || number <= 0 || number > 65535) {
+        throw std::runtime_error("Invalid TCP port: " + port);
+    }
+    
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t) number);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return address;
+}
+
+// small requests and answers must not wait for Nagle's algorithm
+static void noDelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int listenOn(const std::string& endpoint) {
+    int fd = -1;
+    int status = -1;
+    
+    if (hasPrefix(endpoint, unix_prefix)) {
+        std::string path = endpoint.substr(std::strlen(unix_prefix));
+        sockaddr_un address = unixAddress(path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) throw std::runtime_error("Cannot create a socket.");
+        
+        // a socket file left over by a previous run would fail the bind
+        unlink(path.c_str());
+        status = bind(fd, (sockaddr*) &address, sizeof(address));
+    } else if (hasPrefix(endpoint, tcp_prefix)) {
+        sockaddr_in address = tcpAddress(endpoint.substr(std::strlen(tcp_prefix)));
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) throw std::runtime_error("Cannot create a socket.");
+        
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        status = bind(fd, (sockaddr*) &address, sizeof(address));
+    } else {
+        throw std::runtime_error("Unknown endpoint, expected unix:<path> or tcp:<port>: " + endpoint);
+    }
+    
+    if ((status != 0) || (listen(fd, 128) != 0)) {
+        std::string reason = std::strerror(errno);
+        close(fd);
+        throw std::runtime_error("Cannot listen on " + endpoint + ": " + reason);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+int connectTo(const std::string& endpoint) {
+    int fd = -1;
+    int status = -1;
+    
+    if (hasPrefix(endpoint, unix_prefix)) {
+        sockaddr_un address = unixAddress(endpoint.substr(std::strlen(unix_prefix)));
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) throw std::runtime_error("Cannot create a socket.");
+        status = connect(fd, (sockaddr*) &address, sizeof(address));
+    } else if (hasPrefix(endpoint, tcp_prefix)) {
+        sockaddr_in address = tcpAddress(endpoint.substr(std::strlen(tcp_prefix)));
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) throw std::runtime_error("Cannot create a socket.");
+        status = connect(fd, (sockaddr*) &address, sizeof(address));
+        noDelay(fd);
+    } else {
+        throw std::runtime_error("Unknown endpoint, expected unix:<path> or tcp:<port>: " + endpoint);
+    }
+    
+    if (status != 0) {
+        std::string reason = std::strerror(errno);
+        close(fd);
+        throw std::runtime_error("Cannot connect to " + endpoint + ": " + reason);
+    }
+    return fd;
+}
+
+bool sendAll(int fd, const char* data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = send(fd, data + written, size - written, send_flags);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        written += (size_t) n;
+    }
+    return true;
+}
+
+void encodeRequest(const int* indices, const float* values, uint32_t n, std::string& out) {
+    out.push_back((char) binary_tag);
+    out.append((const char*) &n, sizeof(n));
+    out.append((const char*) indices, n * sizeof(int32_t));
+    out.append((const char*) values, n * sizeof(float));
+}
+
+void parseLine(const char* begin, const char* end, std::vector<int>& indices, std::vector<float>& values) {
+    indices.clear();
+    values.clear();
+    
+    // strtol and strtof stop at the newline, or at the '\0' of a string
+    const char* curr = begin;
+    bool first = true;
+    while (curr < end) {
+        if (*curr == ' ' || *curr == '\t' || *curr == '\r') {
+            ++curr;
+            continue;
+        }
+        if (*curr == '#') break;
+        
+        char* next = nullptr;
+        long index = std::strtol(curr, &next, 10);
+        if (next == curr || next > end) {
+            throw std::runtime_error("Invalid format: expected index:value");
+        }
+        
+        if (next == end || *next != ':') {
+            // the label
+            if (!first) throw std::runtime_error("Invalid format: expected ':'");
+            curr = next;
+            first = false;
+            continue;
+        }
+        first = false;
+        
+        curr = next + 1;
+        float value = std::strtof(curr, &next);
+        if (next == curr || next > end) {
+            throw std::runtime_error("Invalid format: expected a value");
+        }
+        if (index < 0 || index > std::numeric_limits<int>::max()) {
+            throw std::runtime_error("Invalid format: index out of range");
+        }
+        
+        indices.push_back((int) index);
+        values.push_back(value);
+        curr = next;
+    }
+}
+
+Server::Server(const std::string& endpoint, const std::string& model_file, const ServerConfig& config) :
+endpoint(endpoint), model_file(model_file), config(config) {
+    if (config.workers < 1 || config.max_batch < 1 || config.batch_wait_us < 0) {
+        throw std::runtime_error("The server needs at least one worker and a positive batch size.");
+    }
+    
+    model.reset(CPM::deserializeModel(model_file.c_str()));
+    listen_fd = listenOn(endpoint);
+    
+    for (int w = 0; w < config.workers; ++w) {
+        workers.emplace_back(&Server::work, this);
+    }
+}
+
+Server::~Server() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queued.notify_all();
+    for (auto& worker: workers) {
+        worker.join();
+    }
+    
+    close(listen_fd);
+    if (hasPrefix(endpoint, unix_prefix)) unlink(endpoint.substr(std::strlen(unix_prefix)).c_str());
+}
+
+void Server::run() {
+    while (!stop_requested) {
+        pollfd pfd = {listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, poll_ms) <= 0) continue;
+        
+        int fd;
+        while ((fd = accept(listen_fd, nullptr, nullptr)) >= 0) {
+            // accepted sockets may inherit the non blocking flag
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            if (hasPrefix(endpoint, tcp_prefix)) noDelay(fd);
+            
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                connections.push_back(fd);
+            }
+            std::thread(&Server::serve, this, fd).detach();
+        }
+    }
+    
+    // the connections stop reading, answer what they have queued and close
+    std::unique_lock<std::mutex> lock(connections_mutex);
+    for (int fd: connections) {
+        shutdown(fd, SHUT_RD);
+    }
+    closed.wait(lock, [this] {return connections.empty();});
+}
+
+void Server::stop() {
+    stop_requested = true;
+}
+
+bool Server::reload(std::string& error) {
+    // loaded outside of the lock, the workers keep scoring with the current model meanwhile
+    std::shared_ptr<const CPM> loaded;
+    try {
+        loaded.reset(CPM::deserializeModel(model_file.c_str()));
+    } catch (const std::exception& e) {
+        error = e.what();
+        return false;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        model.swap(loaded);
+    }
+    reloads++;
+    
+    // the previous model is released here, or by the last batch using it
+    return true;
+}
+
+std::shared_ptr<const CPM> Server::currentModel() {
+    std::lock_guard<std::mutex> lock(model_mutex);
+    return model;
+}
+
+void Server::work() {
+    std::vector<std::pair<Request*, Pending*>> batch;
+    
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queued.wait(lock, [this] {return stopping || !queue.empty();});
+            if (queue.empty()) return; // stopping, and nothing left to answer
+            
+            if ((config.batch_wait_us > 0) && (queue.size() < config.max_batch)) {
+                queued.wait_for(lock, std::chrono::microseconds(config.batch_wait_us),
+                                [this] {return stopping || queue.size() >= config.max_batch;});
+                if (queue.empty()) continue; // taken by another worker
+            }
+            
+            size_t n = std::min(queue.size(), config.max_batch);
+            batch.assign(queue.begin(), queue.begin() + n);
+            queue.erase(queue.begin(), queue.begin() + n);
+        }
+        
+        // one model for the whole batch, kept alive by the reference even if a reload happens
+        std::shared_ptr<const CPM> scorer = currentModel();
+        for (auto& rp: batch) {
+            Request* r = rp.first;
+            auto score_sub = scorer->predict(r->indices.data(), r->values.data(), r->indices.size());
+            r->score = score_sub.first;
+            r->assignment = score_sub.second;
+        }
+        scorer.reset();
+        
+        requests += batch.size();
+        batches++;
+        
+        for (auto& rp: batch) {
+            Pending* pending = rp.second;
+            std::lock_guard<std::mutex> lock(pending->mutex);
+            rp.first->done = true;
+            if (--pending->remaining == 0) pending->completed.notify_one();
+        }
+    }
+}
+
+void Server::serve(int fd) {
+    std::vector<Request> pool;
+    Pending pending;
+    std::string buffer;
+    std::string answers;
+    std::vector<char> chunk(1 << 16);
+    bool open = true;
+    
+    while (open) {
+        ssize_t n = read(fd, chunk.data(), chunk.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buffer.append(chunk.data(), (size_t) n);
+        
+        // every complete request of the buffer
+        size_t count = 0;
+        size_t pos = 0;
+        while (pos < buffer.size()) {
+            if ((unsigned char) buffer[pos] == binary_tag) {
+                uint32_t n_features;
+                if (buffer.size() - pos < 1 + sizeof(n_features)) break;
+                std::memcpy(&n_features, buffer.data() + pos + 1, sizeof(n_features));
+                if (n_features > max_binary_features) {
+                    open = false; // the stream cannot be trusted anymore
+                    break;
+                }
+                
+                const size_t bytes = 1 + sizeof(n_features) + n_features * (sizeof(int32_t) + sizeof(float));
+                if (buffer.size() - pos < bytes) break;
+                
+                if (count == pool.size()) pool.emplace_back();
+                Request& r = pool[count++];
+                r.binary = true;
+                r.error.clear();
+                r.indices.resize(n_features);
+                r.values.resize(n_features);
+                const char* features = buffer.data() + pos + 1 + sizeof(n_features);
+                std::memcpy(r.indices.data(), features, n_features * sizeof(int32_t));
+                std::memcpy(r.values.data(), features + n_features * sizeof(int32_t), n_features * sizeof(float));
+                // as parseLine, answered by an error frame
+                for (int index: r.indices) {
+                    if (index < 0) {
+                        r.error = "Invalid format: index out of range";
+                        break;
+                    }
+                }
+                pos += bytes;
+            } else {
+                const char* begin = buffer.data() + pos;
+                const char* newline = (const char*) std::memchr(begin, '\n', buffer.size() - pos);
+                if (!newline) {
+                    if (buffer.size() - pos > max_line_bytes) open = false;
+                    break;
+                }
+                
+                if (count == pool.size()) pool.emplace_back();
+                Request& r = pool[count++];
+                r.binary = false;
+                r.error.clear();
+                try {
+                    parseLine(begin, newline, r.indices, r.values);
+                } catch (const std::runtime_error& e) {
+                    r.error = e.what();
+                }
+                pos = newline - buffer.data() + 1;
+            }
+        }
+        buffer.erase(0, pos);
+        if (count == 0) continue;
+        
+        // queued at once, so that the workers can batch them
+        size_t queued_requests = 0;
+        for (size_t i = 0; i < count; ++i) {
+            pool[i].done = false;
+            if (pool[i].error.empty()) queued_requests++;
+        }
+        pending.remaining = queued_requests;
+        if (queued_requests > 0) {
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                for (size_t i = 0; i < count; ++i) {
+                    if (pool[i].error.empty()) queue.emplace_back(&pool[i], &pending);
+                }
+            }
+            if (queued_requests > 1) {
+                queued.notify_all();
+            } else {
+                queued.notify_one();
+            }
+            
+            std::unique_lock<std::mutex> lock(pending.mutex);
+            pending.completed.wait(lock, [&pending] {return pending.remaining == 0;});
+        }
+        
+        answers.clear();
+        char text[64];
+        for (size_t i = 0; i < count; ++i) {
+            const Request& r = pool[i];
+            if (r.binary) {
+                double score = r.error.empty() ? r.score : std::numeric_limits<double>::quiet_NaN();
+                int32_t assignment = r.error.empty() ? r.assignment : -1;
+                answers.push_back((char) binary_tag);
+                answers.append((const char*) &score, sizeof(score));
+                answers.append((const char*) &assignment, sizeof(assignment));
+            } else if (!r.error.empty()) {
+                answers += "error: " + r.error + '\n';
+            } else {
+                int length = std::snprintf(text, sizeof(text), "%.9g %d\n", r.score, r.assignment);
+                answers.append(text, (size_t) length);
+            }
+        }
+        if (!sendAll(fd, answers.data(), answers.size())) break;
+    }
+    
+    // closed under the lock, run must not shut a reused descriptor down
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    connections.erase(std::find(connections.begin(), connections.end(), fd));
+    close(fd);
+    closed.notify_all();
+}
+
+}
@@ -0,0 +1,164 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// inference_server.h
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#ifndef __cpm__inference_server__
+#define __cpm__inference_server__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpm.h"
+
+/* Local inference server of a CPM model (cpm_server), and its protocol.
+ *
+ * Endpoints are "unix:<path>" for a Unix domain socket or "tcp:<port>" for the
+ * loopback interface. A connection carries any mix of two kinds of requests, each
+ * answered in order:
+ *  - text: a libSVM line, "[label] index:value ...\n" (the label is ignored, the
+ *    indices need not be sorted). Answer: "score assignment\n", or "error: ...\n".
+ *  - binary: binary_tag, uint32 n, n int32 indices, n float32 values, native byte
+ *    order. Answer: binary_tag, float64 score, int32 assignment (the assignment is
+ *    -1 and the score NaN for a rejected request).
+ * Indices are raw feature indices, hashed and compacted as the model was trained. A
+ * negative index rejects the request, in both formats.
+ *
+ * Connection threads parse the requests and queue them. The workers take them by
+ * batches and score each batch with the model current at that time, so that a
+ * reload (Server::reload) never fails nor drops a request: the batches already taken
+ * finish with the previous model.
+ */
+namespace serving {
+
+// first byte of a binary request or answer, never the first byte of a libSVM line
+const unsigned char binary_tag = 0x01;
+
+// size of a binary answer
+const size_t binary_answer_bytes = 1 + sizeof(double) + sizeof(int32_t);
+
+// largest number of features of a binary request
+const uint32_t max_binary_features = 1 << 24;
+
+// listening socket on endpoint, throws std::runtime_error
+int listenOn(const std::string& endpoint);
+
+// connected socket to endpoint, throws std::runtime_error
+int connectTo(const std::string& endpoint);
+
+// writes all of data, false if the peer is gone
+bool sendAll(int fd, const char* data, size_t size);
+
+// appends the binary request of the n features to out
+void encodeRequest(const int* indices, const float* values, uint32_t n, std::string& out);
+
+/* parses the features of a libSVM line (a leading label is skipped) into indices and values,
+ * throws std::runtime_error on a malformed line
+ */
+void parseLine(const char* begin, const char* end, std::vector<int>& indices, std::vector<float>& values);
+
+struct ServerConfig {
+    int workers = 1;
+    
+    // largest batch a worker scores at once
+    size_t max_batch = 64;
+    
+    // how long a worker waits for a batch to fill up (microseconds), 0: takes what is queued
+    int batch_wait_us = 0;
+};
+
+class Server {
+public:
+    // serves model_file on endpoint, the workers start right away
+    Server(const std::string& endpoint, const std::string& model_file, const ServerConfig& config);
+    ~Server();
+    
+    /* accepts connections until stop is called, answering the requests queued before.
+     * Safe to call reload and stop from another thread (not from a signal handler).
+     */
+    void run();
+    void stop();
+    
+    /* reads the model file again and swaps it in once loaded. On failure the current
+     * model stays and false is returned, with the reason in error.
+     */
+    bool reload(std::string& error);
+    
+    size_t getRequests() const {return requests;}
+    size_t getBatches() const {return batches;}
+    size_t getReloads() const {return reloads;}
+
+private:
+    // a parsed request, answered by a worker
+    struct Request {
+        std::vector<int> indices;
+        std::vector<float> values;
+        bool binary = false;
+        std::string error; // parse error, answered without scoring
+        
+        double score = 0.0;
+        int assignment = -1;
+        bool done = false;
+    };
+    
+    // requests of a connection in flight, the workers signal their completion
+    struct Pending {
+        std::mutex mutex;
+        std::condition_variable completed;
+        size_t remaining = 0;
+    };
+    
+    const std::string endpoint;
+    const std::string model_file;
+    const ServerConfig config;
+    int listen_fd = -1;
+    
+    std::mutex model_mutex; // model
+    std::shared_ptr<const CPM> model;
+    
+    std::mutex queue_mutex; // queue and stopping
+    std::condition_variable queued;
+    std::deque<std::pair<Request*, Pending*>> queue;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+    
+    std::mutex connections_mutex; // connections
+    std::condition_variable closed;
+    std::vector<int> connections;
+    
+    std::atomic<bool> stop_requested{false};
+    std::atomic<size_t> requests{0};
+    std::atomic<size_t> batches{0};
+    std::atomic<size_t> reloads{0};
+    
+    std::shared_ptr<const CPM> currentModel();
+    void work();
+    void serve(int fd);
+};
+
+}
+
+#endif /* defined(__cpm__inference_server__) */
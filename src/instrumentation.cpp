@@ -0,0 +1,126 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// instrumentation.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#include <iomanip>
+#include <mutex>
+
+#include "instrumentation.h"
+#include "json_writer.h"
+
+namespace instr {
+
+static const char* phase_names[n_phases] = {"load", "shuffle", "score", "heuristic_max", "update", "decay",
+                                            "rescale", "epoch"};
+static const char* counter_names[n_counters] = {"steps", "epochs", "rescales", "allocations", "allocated_bytes"};
+
+// statistics of the exited threads
+static std::mutex mutex;
+static Stats finished;
+
+const char* phaseName(Phase phase) {
+    return phase_names[phase];
+}
+
+const char* counterName(Counter counter) {
+    return counter_names[counter];
+}
+
+Stats& Stats::operator+=(const Stats& other) {
+    for (int p = 0; p < n_phases; ++p) {
+        calls[p] += other.calls[p];
+        timed_calls[p] += other.timed_calls[p];
+        timed_ns[p] += other.timed_ns[p];
+    }
+    for (int c = 0; c < n_counters; ++c) {
+        counters[c] += other.counters[c];
+    }
+    return *this;
+}
+
+Stats& Stats::operator-=(const Stats& other) {
+    for (int p = 0; p < n_phases; ++p) {
+        calls[p] -= other.calls[p];
+        timed_calls[p] -= other.timed_calls[p];
+        timed_ns[p] -= other.timed_ns[p];
+    }
+    for (int c = 0; c < n_counters; ++c) {
+        counters[c] -= other.counters[c];
+    }
+    return *this;
+}
+
+void merge(const Stats& stats) {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished += stats;
+}
+
+Stats total() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stats res = finished;
+    res += local();
+    return res;
+}
+
+void printSummary(const Stats& stats, double wall_seconds, std::ostream& out) {
+    out << "\nPhase\tCalls\tTime (s)\tShare\n";
+    for (int p = 0; p < n_phases; ++p) {
+        if (stats.calls[p] == 0) continue;
+        double seconds = stats.seconds((Phase) p);
+        out << phase_names[p] << '\t' << stats.calls[p] << '\t' << seconds << '\t'
+        << std::fixed << std::setprecision(1) << ((wall_seconds > 0) ? 100.0 * seconds / wall_seconds : 0.0)
+        << "%\n" << std::defaultfloat << std::setprecision(6);
+    }
+    
+    out << "Counters:";
+    for (int c = 0; c < n_counters; ++c) {
+        out << ' ' << counter_names[c] << '=' << stats.counters[c];
+    }
+    out << '\n';
+}
+
+void dumpJson(const Stats& stats, std::ostream& out) {
+    JsonWriter json(out);
+    json.beginObject();
+    json.member("sample_period", sample_period);
+    
+    json.key("phases");
+    json.beginObject();
+    for (int p = 0; p < n_phases; ++p) {
+        json.key(phase_names[p]);
+        json.beginObject();
+        json.member("calls", (size_t) stats.calls[p]);
+        json.member("timed_calls", (size_t) stats.timed_calls[p]);
+        json.member("seconds", stats.seconds((Phase) p));
+        json.endObject();
+    }
+    json.endObject();
+    
+    json.key("counters");
+    json.beginObject();
+    for (int c = 0; c < n_counters; ++c) {
+        json.member(counter_names[c], (size_t) stats.counters[c]);
+    }
+    json.endObject();
+    
+    json.endObject();
+}
+
+}
@@ -0,0 +1,162 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// instrumentation.h
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#ifndef __cpm__instrumentation__
+#define __cpm__instrumentation__
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+/* Wall clock timers and event counters of the training loop, compiled in with
+ * -DCPM_INSTRUMENT (make INSTRUMENT=1) and removed entirely otherwise: the macros
+ * below then expand to nothing.
+ *
+ * Statistics are per thread, and merged into a process wide total when the thread
+ * exits. The phases of an SGD step are only recorded every sample_period steps, so
+ * that the other steps only pay for a thread local test; their calls and time are
+ * extrapolated from the sampled steps. Steps are counted once the training stops,
+ * so that only the completed ones are.
+ */
+namespace instr {
+
+enum Phase {
+    Load,         // dataset construction
+    Shuffle,      // permutation of the training set
+    Score,        // inner products of a step
+    HeuristicMax, // assignment of a positive sample
+    Update,       // sparse gradient update
+    Decay,        // L2 decay, L1 truncation and averaging
+    Rescale,      // whole matrix pass when the scales degenerate
+    Epoch,        // end of epoch statistics and validation
+    n_phases
+};
+
+enum Counter {
+    Steps,
+    Epochs,
+    Rescales,
+    Allocations,    // weight arrays, hash table growth included
+    AllocatedBytes,
+    n_counters
+};
+
+const char* phaseName(Phase phase);
+const char* counterName(Counter counter);
+
+// the step phases are recorded once every sample_period steps
+const int sample_period = 64;
+
+struct Stats {
+    uint64_t calls[n_phases] = {};
+    uint64_t timed_calls[n_phases] = {};
+    uint64_t timed_ns[n_phases] = {};
+    uint64_t counters[n_counters] = {};
+    
+    // total time of a phase in seconds, extrapolated from the timed calls
+    double seconds(Phase phase) const {
+        return timed_calls[phase] ? 1e-9 * timed_ns[phase] * calls[phase] / timed_calls[phase] : 0.0;
+    }
+    
+    Stats& operator+=(const Stats& other);
+    Stats& operator-=(const Stats& other);
+};
+
+// adds the statistics of an exiting thread to the process wide total
+void merge(const Stats& stats);
+
+struct ThreadStats {
+    Stats stats;
+    
+    ~ThreadStats() {merge(stats);}
+};
+
+// statistics of the calling thread
+inline Stats& local() {
+    static thread_local ThreadStats thread_stats;
+    return thread_stats.stats;
+}
+
+// statistics of the exited threads and of the calling thread
+Stats total();
+
+// table of the phases and counters, with their share of wall_seconds
+void printSummary(const Stats& stats, double wall_seconds, std::ostream& out);
+
+void dumpJson(const Stats& stats, std::ostream& out);
+
+// whether the current step of the calling thread is sampled, trivial to access unlike local()
+inline bool& sampledStep() {
+    static thread_local bool sampled = false;
+    return sampled;
+}
+
+inline void beginStep() {
+    static thread_local int countdown = 1;
+    sampledStep() = (--countdown == 0);
+    if (countdown == 0) countdown = sample_period;
+}
+
+class ScopedTimer {
+public:
+    // a step phase is only recorded if the current step is sampled, and then stands for sample_period calls
+    ScopedTimer(Phase phase, bool step) : phase(phase), weight(step ? sample_period : 1),
+                                          timed(!step || sampledStep()) {
+        if (timed) start = std::chrono::steady_clock::now();
+    }
+    
+    ~ScopedTimer() {
+        if (timed) {
+            Stats& stats = local();
+            stats.calls[phase] += weight;
+            stats.timed_calls[phase]++;
+            stats.timed_ns[phase] += (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+private:
+    const Phase phase;
+    const int weight;
+    const bool timed;
+    std::chrono::steady_clock::time_point start;
+};
+
+}
+
+#ifdef CPM_INSTRUMENT
+#define CPM_INSTRUMENTED 1
+// starts an SGD step, deciding whether its phases are timed
+#define CPM_STEP() instr::beginStep()
+// times the rest of the enclosing scope
+#define CPM_TIME(phase) instr::ScopedTimer cpm_timer_##phase(instr::phase, false)
+// same, for a phase of an SGD step
+#define CPM_TIME_STEP(phase) instr::ScopedTimer cpm_timer_##phase(instr::phase, true)
+#define CPM_COUNT(counter, n) (instr::local().counters[instr::counter] += (n))
+#else
+#define CPM_INSTRUMENTED 0
+#define CPM_STEP() ((void) 0)
+#define CPM_TIME(phase) ((void) 0)
+#define CPM_TIME_STEP(phase) ((void) 0)
+#define CPM_COUNT(counter, n) ((void) 0)
+#endif
+
+#endif /* defined(__cpm__instrumentation__) */
@@ -0,0 +1,123 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// json_writer.h
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#ifndef __cpm__json_writer__
+#define __cpm__json_writer__
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/* Streams indented JSON, one value per line, so that two outputs diff line by line.
+ * Keys are written in call order. Numbers have 6 significant digits, non finite ones become null.
+ */
+class JsonWriter {
+public:
+    JsonWriter(std::ostream& out) : out(out) {}
+    
+    void beginObject() {open('{');}
+    void endObject() {close('}');}
+    void beginArray() {open('[');}
+    void endArray() {close(']');}
+    
+    // the next value is the member name of the current object
+    void key(const std::string& name) {
+        separate();
+        quote(name);
+        out << ": ";
+        keyed = true;
+    }
+    
+    void value(const std::string& s) {separate(); quote(s);}
+    void value(const char* s) {value(std::string(s));}
+    void value(bool b) {separate(); out << (b ? "true" : "false");}
+    void value(int i) {separate(); out << i;}
+    void value(long long i) {separate(); out << i;}
+    void value(size_t i) {separate(); out << i;}
+    
+    void value(double d) {
+        separate();
+        if (!std::isfinite(d)) {
+            out << "null";
+            return;
+        }
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.6g", d);
+        out << buffer;
+    }
+    
+    template <class T>
+    void member(const std::string& name, T v) {
+        key(name);
+        value(v);
+    }
+
+private:
+    std::ostream& out;
+    std::vector<bool> first; // per open container, whether nothing was written in it yet
+    bool keyed = false; // a key was just written, its value follows on the same line
+    
+    void separate() {
+        if (keyed) {
+            keyed = false;
+            return;
+        }
+        if (!first.empty()) {
+            if (!first.back()) out << ',';
+            first.back() = false;
+            out << '\n' << std::string(2 * first.size(), ' ');
+        }
+    }
+    
+    void open(char c) {
+        separate();
+        out << c;
+        first.push_back(true);
+    }
+    
+    void close(char c) {
+        bool empty = first.back();
+        first.pop_back();
+        if (!empty) out << '\n' << std::string(2 * first.size(), ' ');
+        out << c;
+        if (first.empty()) out << '\n';
+    }
+    
+    void quote(const std::string& s) {
+        out << '"';
+        for (char c: s) {
+            if (c == '"' || c == '\\') {
+                out << '\\' << c;
+            } else if ((unsigned char) c < 0x20) {
+                char buffer[8];
+                std::snprintf(buffer, sizeof(buffer), "\\u%04x", (unsigned char) c);
+                out << buffer;
+            } else {
+                out << c;
+            }
+        }
+        out << '"';
+    }
+};
+
+#endif /* defined(__cpm__json_writer__) */
@@ -0,0 +1,244 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// load_client.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+/* cpm_load: load generator of cpm_server. Each connection replays the rows of a libSVM
+ * file as text or binary requests, keeping up to pipeline requests in flight, and the
+ * latency of every request is measured from its send to its answer.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "inference_server.h"
+#include "option_parser.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// results of a connection
+struct ConnectionStats {
+    std::vector<double> latencies; // microseconds
+    size_t errors = 0;
+    std::string failure; // the connection broke
+};
+
+// one answer of the server
+struct Answer {
+    double score;
+    int assignment;
+};
+
+/* replays requests i = first, first + stride, ... (modulo the rows) up to n_requests,
+ * answers in order are written to answers if not null
+ */
+static void replay(const std::string& endpoint, const std::vector<std::string>& requests, bool binary,
+                   size_t first, size_t stride, size_t n_requests, int pipeline, ConnectionStats& stats,
+                   std::vector<Answer>* answers) {
+    int fd = -1;
+    try {
+        fd = serving::connectTo(endpoint);
+    } catch (const std::exception& e) {
+        stats.failure = e.what();
+        return;
+    }
+    
+    std::deque<Clock::time_point> in_flight;
+    std::string buffer;
+    std::vector<char> chunk(1 << 16);
+    size_t next = first;
+    
+    while (next < n_requests || !in_flight.empty()) {
+        // tops the pipeline up, the requests of a round are sent at once
+        std::string out;
+        while (next < n_requests && in_flight.size() < (size_t) pipeline) {
+            out += requests[next % requests.size()];
+            in_flight.push_back(Clock::now());
+            next += stride;
+        }
+        if (!out.empty() && !serving::sendAll(fd, out.data(), out.size())) {
+            stats.failure = "connection closed by the server";
+            break;
+        }
+        
+        ssize_t n = read(fd, chunk.data(), chunk.size());
+        if (n <= 0) {
+            stats.failure = "connection closed by the server";
+            break;
+        }
+        buffer.append(chunk.data(), (size_t) n);
+        auto now = Clock::now();
+        
+        size_t pos = 0;
+        while (!in_flight.empty()) {
+            Answer answer;
+            if (binary) {
+                if (buffer.size() - pos < serving::binary_answer_bytes) break;
+                int32_t assignment;
+                std::memcpy(&answer.score, buffer.data() + pos + 1, sizeof(double));
+                std::memcpy(&assignment, buffer.data() + pos + 1 + sizeof(double), sizeof(assignment));
+                answer.assignment = assignment;
+                pos += serving::binary_answer_bytes;
+            } else {
+                size_t newline = buffer.find('\n', pos);
+                if (newline == std::string::npos) break;
+                if (buffer.compare(pos, 6, "error:") == 0) {
+                    answer.score = NAN;
+                    answer.assignment = -1;
+                } else {
+                    char* end = nullptr;
+                    answer.score = std::strtod(buffer.c_str() + pos, &end);
+                    answer.assignment = (int) std::strtol(end, nullptr, 10);
+                }
+                pos = newline + 1;
+            }
+            
+            if (answer.assignment < 0) stats.errors++;
+            if (answers) answers->push_back(answer);
+            stats.latencies.push_back(std::chrono::duration<double, std::micro>(now - in_flight.front()).count());
+            in_flight.pop_front();
+        }
+        buffer.erase(0, pos);
+    }
+    
+    close(fd);
+}
+
+// q-quantile of sorted values
+static double quantile(const std::vector<double>& sorted, double q) {
+    if (sorted.empty()) return 0.0;
+    return sorted[std::min(sorted.size() - 1, (size_t) (q * sorted.size()))];
+}
+
+int main(int argc, char* const argv[]) {
+    OptionParser op("Load generator of cpm_server: replays a libSVM file and reports the throughput and latencies.");
+    
+    op.addOption("server endpoint, unix:<path> or tcp:<port>.", 'e', "connect", true, "unix:/tmp/cpm.sock",
+                 nullptr);
+    op.addOption("libSVM file of the requests, replayed in a loop.", 'd', "data", false, "", nullptr);
+    op.addOption("total number of requests (0: one per row).", 'n', "requests", true, (size_t) 0, nullptr);
+    op.addOption("number of concurrent connections.", 'c', "connections", true, (int) 1, nullptr);
+    op.addOption("requests in flight per connection.", 'p', "pipeline", true, (int) 1, nullptr);
+    op.addOption("send binary requests instead of libSVM lines.", '\0', "binary", true, false);
+    op.addOption("write the answers (score, assignment) to this file, with a single connection.", 's', "scores",
+                 false, "", nullptr);
+    
+    op.parseCmdString(argc, argv);
+    
+    const char* data = op.getString("data");
+    const int connections = op.getInt("connections");
+    const int pipeline = op.getInt("pipeline");
+    const bool binary = op.getBool("binary");
+    const char* scores = op.getString("scores");
+    if (std::strlen(data) == 0) {
+        std::cerr << "A request file is required (--data).\n";
+        return 1;
+    }
+    if (connections < 1 || pipeline < 1) {
+        std::cerr << "At least one connection and one request in flight are needed.\n";
+        return 1;
+    }
+    if (std::strlen(scores) > 0 && connections != 1) {
+        std::cerr << "Writing the answers needs a single connection.\n";
+        return 1;
+    }
+    
+    // requests are encoded up front, sending them is all the connections do
+    std::vector<std::string> requests;
+    std::ifstream fin(data);
+    if (!fin) {
+        std::cerr << "Cannot open " << data << ".\n";
+        return 1;
+    }
+    std::string line;
+    std::vector<int> indices;
+    std::vector<float> values;
+    while (std::getline(fin, line)) {
+        if (binary) {
+            std::string request;
+            try {
+                serving::parseLine(line.data(), line.data() + line.size(), indices, values);
+            } catch (const std::runtime_error& e) {
+                std::cerr << "Line " << requests.size() + 1 << ": " << e.what() << '\n';
+                return 1;
+            }
+            serving::encodeRequest(indices.data(), values.data(), (uint32_t) indices.size(), request);
+            requests.push_back(request);
+        } else {
+            requests.push_back(line + '\n');
+        }
+    }
+    if (requests.empty()) {
+        std::cerr << "No request in " << data << ".\n";
+        return 1;
+    }
+    
+    size_t n_requests = op.getSizet("requests");
+    if (n_requests == 0) n_requests = requests.size();
+    
+    std::vector<ConnectionStats> stats(connections);
+    std::vector<Answer> answers;
+    std::vector<std::thread> threads;
+    const std::string endpoint = op.getString("connect");
+    
+    auto start = Clock::now();
+    for (int c = 0; c < connections; ++c) {
+        threads.emplace_back(replay, std::cref(endpoint), std::cref(requests), binary, (size_t) c,
+                             (size_t) connections, n_requests, pipeline, std::ref(stats[c]),
+                             (std::strlen(scores) > 0) ? &answers : nullptr);
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    
+    std::vector<double> latencies;
+    size_t errors = 0;
+    for (auto const& s: stats) {
+        if (!s.failure.empty()) std::cerr << "Connection failed: " << s.failure << '\n';
+        latencies.insert(latencies.end(), s.latencies.begin(), s.latencies.end());
+        errors += s.errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    
+    std::cout << latencies.size() << " requests in " << elapsed.count() << "s: "
+              << latencies.size() / elapsed.count() << " requests/s, " << errors << " error(s).\n"
+              << "Latency (us): p50 " << quantile(latencies, 0.5) << " p99 " << quantile(latencies, 0.99)
+              << " p999 " << quantile(latencies, 0.999) << " max " << quantile(latencies, 1.0) << '\n';
+    
+    if (std::strlen(scores) > 0) {
+        std::ofstream fout(scores);
+        for (auto const& a: answers) {
+            fout << a.score << '\t' << a.assignment << '\n';
+        }
+    }
+    
+    return (latencies.size() == n_requests) ? 0 : 1;
+}
@@ -23,11 +23,13 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <cmath>
+#include <algorithm>
 #include <chrono>
 
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <stdexcept>
 
 #include "time.h"
 
@@ -37,6 +39,141 @@
 #include "convex_polytope_machine.h"
 #include "eval_utils.h"
 #include "cpm.h"
+#include "page_allocator.h"
+#include "multiclass_cpm.h"
+#include "instrumentation.h"
+#include "telemetry.h"
+
+// one line per sub-classifier, the rates are relative to the training steps
+void printClassifierStats(const CPM& model) {
+    const std::vector<ClassifierStats> stats = model.getClassifierStats();
+    const double steps = (double) std::max((size_t) 1, model.getIterations());
+    
+    std::cout << "\nClassifier\tWins\tFired\tActive\tAssigned\tMean margin\tExclusion loss\n";
+    for (size_t i = 0; i < stats.size(); ++i) {
+        std::cout << i << '\t'
+        << stats[i].wins / steps << '\t'
+        << stats[i].fired / steps << '\t'
+        << stats[i].active / steps << '\t'
+        << stats[i].assigned / steps << '\t'
+        << stats[i].meanMargin() << '\t'
+        << stats[i].exclusion_loss / steps << '\n';
+    }
+}
+
+void printPruneReport(const PruneReport& report) {
+    std::cout << "Pruned to " << report.kept.size() << " of " << report.wins.size() << " sub-classifiers over "
+    << report.rows << " rows: " << report.changed_rows << " scores decreased (mean " << report.mean_change
+    << ", max " << report.max_change << "), " << report.flipped_rows << " positive decisions lost.\n";
+}
+
+// writes the counters and timers of the whole run to fname, if any
+void dumpInstrumentation(const char* fname) {
+    if (std::strlen(fname) == 0) return;
+#if CPM_INSTRUMENTED
+    std::ofstream out(fname);
+    if (!out) throw std::runtime_error(std::string("Cannot open ") + fname);
+    instr::dumpJson(instr::total(), out);
+#else
+    std::cerr << "Warning: built without instrumentation (make INSTRUMENT=1), " << fname << " not written.\n";
+#endif
+}
+
+int multiclassMain(const char* trainfile, const char* model_in, const char* model_out,
+                   const char* testfile, const char* scoresfile,
+                   int k, float C, int iterations, float cost_ratio, float entropy, bool reshuffle,
+                   bool average, Optimizer optimizer, float learning_rate, unsigned int seed, int threads,
+                   const char* validfile, StoppingCriteria stopping, int hash_bits, bool compact, bool sparse_weights,
+                   Precision precision, bool lazy_decay, float l1, int prefetch, telemetry::Publisher* publisher,
+                   bool classifier_stats, float max_win_rate, const char* instrument_json, bool verbose) {
+    MulticlassCPM* model = nullptr;
+    
+    if (std::strlen(trainfile) > 0) {
+        auto start_time = std::chrono::steady_clock::now();
+        
+        StochasticDataAdaptor trainset(trainfile, 1000000, hash_bits);
+        if (compact) trainset.compact();
+        
+        StochasticDataAdaptor* validset = nullptr;
+        if (std::strlen(validfile) > 0) {
+            validset = new StochasticDataAdaptor(validfile, 1000000, hash_bits);
+            if (compact) validset->remap(trainset.getFeatureIds());
+            stopping.validation = validset;
+        }
+        
+        std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start_time;
+        std::cout << "Loaded data in " << elapsed.count() << "s.\n";
+        start_time = std::chrono::steady_clock::now();
+        
+        model = new MulticlassCPM(k, 1.0f/C, entropy, cost_ratio, seed, average, optimizer, learning_rate,
+                                  sparse_weights, precision, lazy_decay, l1);
+        model->setPrefetchDistance(prefetch);
+        model->setTelemetry(publisher);
+        model->fit(trainset, iterations, reshuffle, verbose, threads, stopping);
+        
+        elapsed = std::chrono::steady_clock::now() - start_time;
+        size_t total_iterations = 0;
+        for (size_t i = 0; i < model->getNClasses(); ++i) {
+            total_iterations += model->getModel(i).getIterations();
+        }
+        
+        std::cout << "\nFinished " << total_iterations << " iterations over " << model->getNClasses()
+        << " labels in " << elapsed.count() << "s.\n";
+        
+        if (classifier_stats) {
+            for (size_t i = 0; i < model->getNClasses(); ++i) {
+                std::cout << "\n### Label " << model->getLabels()[i] << " ###";
+                printClassifierStats(model->getModel(i));
+            }
+        }
+        
+        if (max_win_rate >= 0) {
+            std::vector<PruneReport> reports;
+            model->prune(validset ? *validset : trainset, max_win_rate, &reports);
+            for (size_t i = 0; i < reports.size(); ++i) {
+                std::cout << "Label " << model->getLabels()[i] << ": ";
+                printPruneReport(reports[i]);
+            }
+        }
+        delete validset;
+        
+        if(verbose && (std::strlen(model_out) > 0)) std::cout << "Writing model to " << model_out << '\n';
+        
+        if (std::strlen(model_out) > 0) {
+            model->serializeModel(model_out);
+        }
+        
+    } else if (std::strlen(model_in) > 0) {
+        if(verbose) std::cout << "Reading model from " << model_in << '\n';
+        model = MulticlassCPM::deserializeModel(model_in);
+    }
+    
+    if (model && std::strlen(testfile) > 0) {
+        if (std::strlen(scoresfile) == 0) {
+            std::cerr << "Missing output scores file.\n";
+            exit(1);
+        }
+        
+        // hashed and compacted like the model, whether trained or read from disk
+        StochasticDataAdaptor testset(testfile, 1000000, model->getHashBits());
+        if (!model->getFeatureIds().empty()) testset.remap(model->getFeatureIds());
+        
+        std::ofstream rfile(scoresfile);
+        
+        for(size_t i = 0; i < testset.getNInstances(); ++i) {
+            const std::tuple<int, SparseVector, size_t>& lic = testset.getInstance(i);
+            
+            auto label_score = model->predict(std::get<1>(lic));
+            
+            // format: predicted label, raw score (margin) of that label, ground truth label
+            rfile << label_score.first << '\t' << label_score.second << '\t' << std::get<0>(lic) << '\n';
+        }
+    }
+    
+    delete model;
+    dumpInstrumentation(instrument_json);
+    return 0;
+}
 
 int main(int argc, char* const argv[]) {
     OptionParser op("Perform CPM training and/or inference.");
@@ -45,6 +182,8 @@ int main(int argc, char* const argv[]) {
     
     op.addOption("number of classifiers.", 'k', "classifiers", true, (int) 1, nullptr);
     op.addOption("C regularization factor.", 'C', "C", true, 1.0f, nullptr);
+    op.addOption("L1 regularization factor, on top of the L2 one (elastic net). Zeroes weights, implies lazy_decay.",
+                 '\0', "l1", true, 0.0f, nullptr);
     op.addOption("cost ratio of negatives vs positives.", '\0', "cost_ratio", true, 1.0f, nullptr);
     op.addOption("minimal (exp of) entropy to maintain in heuristic max. Value between 1 and k.", '\0',
                  "entropy", true, 1.0f, nullptr);
@@ -54,18 +193,71 @@ int main(int argc, char* const argv[]) {
     
     // op.addOption("compute aggregated metrics instead of raw scores.", '\0', "agg_scores", true, false);
     
+    op.addOption("hash the feature indices into 2^hash_bits dimensions (0: no hashing, at most 30). Test data is hashed as the model.",
+                 '\0', "hash_bits", true, (int) 0, nullptr);
+    op.addOption("renumber the features observed in training, test data is remapped as the model (unseen features dropped).",
+                 '\0', "compact", true, false);
+    
     op.addOption("outer class label (the class that will be decomposed).", '\0', "outer_label", true, (int) 1, nullptr);
 
     op.addOption("shuffle training set between epochs.", '\0', "reshuffle", true, false);
+    op.addOption("use the average of all SGD iterates as model.", '\0', "average", true, false);
+    op.addOption("store the weights in a hash table, rows are allocated for the updated features only.", '\0',
+                 "sparse_weights", true, false);
+    op.addOption("back the weights with 2MB pages (reserved huge pages, else transparent huge pages).", '\0',
+                 "huge_pages", true, false);
+    const std::vector<const char*> numa_policies = {"first_touch", "interleave"};
+    op.addOption("NUMA placement of the weights: on the node of the training thread, or spread over all nodes.", '\0',
+                 "numa", true, "first_touch", &numa_policies);
+    op.addOption("prefetch the weight rows of the sample this many steps ahead during training (0: none).", '\0',
+                 "prefetch", true, (int) 4, nullptr);
+    const std::vector<const char*> precisions = {"double", "single"};
+    op.addOption("accumulation precision of the training scores and updates (single: float, compensated sums).", '\0',
+                 "precision", true, "double", &precisions);
+    op.addOption("apply the L2 decay to each weight row when it is next used instead of through global scales (no averaging).",
+                 '\0', "lazy_decay", true, false);
     
-    op.addOption("number of iterations.", 'i',
+    const std::vector<const char*> optimizers = {"pegasos", "adagrad", "rmsprop"};
+    op.addOption("step size rule. adagrad and rmsprop adapt the step per feature and classifier.", '\0',
+                 "optimizer", true, "pegasos", &optimizers);
+    op.addOption("base learning rate of the adagrad and rmsprop optimizers.", '\0', "learning_rate", true, 0.1f, nullptr);
+    
+    op.addOption("one-vs-rest training and argmax inference over all labels.", '\0', "multiclass", true, false);
+    op.addOption("number of labels trained concurrently in multiclass mode.", '\0', "threads", true, (int) 1, nullptr);
+    
+    op.addOption("number of iterations. With a time budget, 0 removes the iteration limit.", 'i',
                  "iterations", true, (int) 50000000, nullptr);
+    op.addOption("training time budget in seconds, wall clock (negative: none).", '\0',
+                 "time_budget", true, -1.0f, nullptr);
+    op.addOption("number of steps between two reads of the clock for the time budget.", '\0',
+                 "check_every", true, (int) 1024, nullptr);
+    
+    op.addOption("stop once the rate of reassigned positives is at most this value (negative: disabled).", '\0',
+                 "stop_reassignment_rate", true, -1.0f, nullptr);
+    op.addOption("stop once the relative change of the training loss is at most this value (negative: disabled).", '\0',
+                 "stop_loss_change", true, -1.0f, nullptr);
+    op.addOption("stop once the validation AUC did not improve by more than this value.", '\0',
+                 "stop_auc_gain", true, 0.0f, nullptr);
+    op.addOption("number of consecutive epochs a stopping condition must hold.", '\0', "patience", true, (int) 3, nullptr);
     
     op.addOption("train data file.", 't', "train", false, "", nullptr);
+    op.addOption("validation data file, enables stopping on validation AUC.", '\0', "validation", false, "", nullptr);
     op.addOption("test data file.", 'c', "test", false, "", nullptr);
     op.addOption("model in file. Will be ignored if in training mode.", 'm', "model_in", false, "", nullptr);
     op.addOption("model out file.", 'o', "model_out", false, "", nullptr);
     op.addOption("scores file.", 's', "scores", false, "", nullptr);
+    op.addOption("score the test set by early exit, writing whether each score is above the threshold instead of the score (not with average, lazy_decay nor l1 when training, nor multiclass).",
+                 '\0', "early_exit", true, false);
+    op.addOption("decision threshold of early_exit.", '\0', "threshold", true, 0.0f, nullptr);
+    op.addOption("print the statistics of each sub-classifier after training (rates per step).", '\0',
+                 "classifier_stats", true, false);
+    op.addOption("after training, drop the sub-classifiers winning the max on at most this fraction of the validation (else training) rows (negative: disabled, 0: no score change).",
+                 '\0', "prune", true, -1.0f, nullptr);
+    op.addOption("publish live training metrics in the Prometheus text format to this file, or to a Unix socket with unix:<path>.",
+                 '\0', "telemetry", false, "", nullptr);
+    op.addOption("seconds between two telemetry file writes.", '\0', "telemetry_period", true, 1.0f, nullptr);
+    op.addOption("write the training loop counters and timers to this JSON file (make INSTRUMENT=1 builds).", '\0',
+                 "instrument_json", false, "", nullptr);
     
     op.parseCmdString(argc, argv);
     
@@ -81,30 +273,110 @@ int main(int argc, char* const argv[]) {
     const float cost_ratio = op.getFloat("cost_ratio");
     const float entropy = op.getFloat("entropy");
     bool reshuffle = op.getBool("reshuffle");
+    const bool average = op.getBool("average");
+    const float learning_rate = op.getFloat("learning_rate");
+    
+    Optimizer optimizer = Pegasos;
+    if (0 == std::strcmp(op.getString("optimizer"), "adagrad")) optimizer = AdaGrad;
+    if (0 == std::strcmp(op.getString("optimizer"), "rmsprop")) optimizer = RMSProp;
+    const bool multiclass = op.getBool("multiclass");
+    const int threads = op.getInt("threads");
+    const int hash_bits = op.getInt("hash_bits");
+    const bool compact = op.getBool("compact");
+    const bool sparse_weights = op.getBool("sparse_weights");
+    const int prefetch = op.getInt("prefetch");
+    const Precision precision = (0 == std::strcmp(op.getString("precision"), "single")) ? SinglePrecision :
+                                DoublePrecision;
+    const bool lazy_decay = op.getBool("lazy_decay");
+    const float l1 = op.getFloat("l1");
+    
+    pagealloc::setPolicy(op.getBool("huge_pages"), (0 == std::strcmp(op.getString("numa"), "interleave")) ?
+                         pagealloc::Interleave : pagealloc::FirstTouch);
+    
+    const char* validfile = op.getString("validation");
+    StoppingCriteria stopping(op.getFloat("stop_reassignment_rate"), op.getFloat("stop_loss_change"),
+                              op.getInt("patience"), nullptr, op.getFloat("stop_auc_gain"),
+                              op.getFloat("time_budget"), op.getInt("check_every"));
     
     seed = op.getSizet("seed");
     if (sizeof(seed) == 8) {
         seed = seed ^ (seed >> 32);
     }
     
+    // at exit, the socket is removed while the file keeps the final state of the training
+    telemetry::Publisher* publisher = nullptr;
+    if ((std::strlen(op.getString("telemetry")) > 0) && (std::strlen(trainfile) > 0)) {
+        publisher = new telemetry::Publisher(op.getString("telemetry"), op.getFloat("telemetry_period"));
+    }
+    
+    if (hash_bits < 0 || hash_bits > max_hash_bits) {
+        std::cerr << "hash_bits must be between 0 and " << max_hash_bits << ".\n";
+        exit(1);
+    }
+    
+    const bool early_exit = op.getBool("early_exit");
+    if (early_exit && multiclass) {
+        std::cerr << "Early exit is not supported in multiclass mode.\n";
+        exit(1);
+    }
+    
+    if (multiclass) {
+        int res = multiclassMain(trainfile, model_in, op.getString("model_out"), testfile, scoresfile,
+                                 k, C, iterations, cost_ratio, entropy, reshuffle, average,
+                                 optimizer, learning_rate, (unsigned int) seed,
+                                 threads, validfile, stopping, hash_bits, compact, sparse_weights, precision, lazy_decay, l1,
+                                 prefetch, publisher, op.getBool("classifier_stats"), op.getFloat("prune"),
+                                 op.getString("instrument_json"), verbose);
+        delete publisher;
+        return res;
+    }
+    
+    // l1 > 0 trains with lazy decay as well
+    if (early_exit && (std::strlen(trainfile) > 0) && (average || lazy_decay || l1 > 0)) {
+        std::cerr << "Early exit needs the final weights, save the model and score with model_in.\n";
+        exit(1);
+    }
+    
     CPM* model = nullptr;
     
     if (std::strlen(trainfile) > 0) {
-        clock_t start_time = clock();
+        auto start_time = std::chrono::steady_clock::now();
         
-        StochasticDataAdaptor trainset(trainfile);
+        StochasticDataAdaptor trainset(trainfile, 1000000, hash_bits);
+        if (compact) trainset.compact();
         
-        clock_t end_time = clock();
-        std::cout << "Loaded data in "
-        << ((float) (end_time-start_time))/CLOCKS_PER_SEC << "s.\n";
-        start_time = end_time;
+        StochasticDataAdaptor* validset = nullptr;
+        if (std::strlen(validfile) > 0) {
+            validset = new StochasticDataAdaptor(validfile, 1000000, hash_bits);
+            if (compact) validset->remap(trainset.getFeatureIds());
+            stopping.validation = validset;
+        }
+        
+        std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start_time;
+        std::cout << "Loaded data in " << elapsed.count() << "s.\n";
+        start_time = std::chrono::steady_clock::now();
         
         // train cpm
-        model = new CPM(k, outer_label, 1.0f/C, entropy, cost_ratio, (unsigned short) seed);
-        model->fit(trainset, iterations, reshuffle, verbose);
+        model = new CPM(k, outer_label, 1.0f/C, entropy, cost_ratio, (unsigned short) seed, average,
+                        optimizer, learning_rate, sparse_weights, precision, lazy_decay, l1);
+        model->setPrefetchDistance(prefetch);
+        model->setTelemetry(publisher);
+        model->fit(trainset, iterations, reshuffle, verbose, stopping);
+        
+        elapsed = std::chrono::steady_clock::now() - start_time;
+        std::cout << "\nFinished " << model->getIterations() << " iterations in " << elapsed.count() << "s.\n";
         
-        end_time = clock();
-        std::cout << "\nFinished " << iterations << " iterations in " << ((float) (end_time-start_time))/CLOCKS_PER_SEC << "s.\n";
+        if (op.getBool("classifier_stats")) printClassifierStats(*model);
+        
+        // on the validation set if any, since it is what the model will see
+        if (op.getFloat("prune") >= 0) {
+            PruneReport report;
+            CPM* pruned = model->prune(validset ? *validset : trainset, op.getFloat("prune"), &report);
+            delete model;
+            model = pruned;
+            printPruneReport(report);
+        }
+        delete validset;
         
         const char* model_out = op.getString("model_out");
         
@@ -125,19 +397,51 @@ int main(int argc, char* const argv[]) {
             exit(1);
         }
         
-        StochasticDataAdaptor testset(testfile);
+        // hashed and compacted like the model, whether trained or read from disk
+        StochasticDataAdaptor testset(testfile, 1000000, model->getHashBits());
+        if (!model->getFeatureIds().empty()) testset.remap(model->getFeatureIds());
         
         std::ofstream rfile(scoresfile);
         
-        for(size_t i = 0; i < testset.getNInstances(); ++i) {
-            const std::tuple<int, SparseVector, size_t>& lic = testset.getInstance(i);
+        if (early_exit) {
+            const float threshold = op.getFloat("threshold");
+            try {
+                model->prepareEarlyExit();
+            } catch (const std::logic_error& e) {
+                std::cerr << e.what() << '\n';
+                exit(1);
+            }
+            size_t processed = 0, total = 0;
             
-            auto score_sub = model->predict(std::get<1>(lic));
+            for(size_t i = 0; i < testset.getNInstances(); ++i) {
+                const std::tuple<int, SparseVector, size_t>& lic = testset.getInstance(i);
+                
+                size_t features;
+                bool above = model->exceeds(std::get<1>(lic), threshold, &features);
+                processed += features;
+                total += std::get<1>(lic).getSize();
+                
+                // format: score above threshold, ground truth (model_outer_label == instance_label)
+                rfile << above << '\t' << (std::get<0>(lic) == model->outer_label) << '\n';
+            }
             
-            // format: raw score (margin), assigned classifier, ground truth (model_outer_label == instance_label)
-            rfile << score_sub.first << '\t' << score_sub.second << '\t' << (std::get<0>(lic) == model->outer_label) << '\n';
+            if (verbose) {
+                std::cout << "Early exit processed " << processed << " of " << total << " features ("
+                << (total ? 100.0 * processed / total : 100.0) << "%).\n";
+            }
+        } else {
+            for(size_t i = 0; i < testset.getNInstances(); ++i) {
+                const std::tuple<int, SparseVector, size_t>& lic = testset.getInstance(i);
+                
+                auto score_sub = model->predict(std::get<1>(lic));
+                
+                // format: raw score (margin), assigned classifier, ground truth (model_outer_label == instance_label)
+                rfile << score_sub.first << '\t' << score_sub.second << '\t' << (std::get<0>(lic) == model->outer_label) << '\n';
+            }
         }
     }
     
     delete model;
+    delete publisher;
+    dumpInstrumentation(op.getString("instrument_json"));
 }
@@ -0,0 +1,240 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// multiclass_cpm.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "multiclass_cpm.h"
+
+MulticlassCPM::MulticlassCPM(int k, float lambda, float entropy, float cost_ratio, unsigned int seed,
+                             bool average, Optimizer optimizer, float learning_rate, bool sparse_weights,
+                             Precision precision, bool lazy_decay, float l1) :
+    k(k), lambda(lambda), entropy(entropy), cost_ratio(cost_ratio), seed(seed), average(average),
+    optimizer(optimizer), learning_rate(learning_rate), sparse_weights(sparse_weights), precision(precision),
+    lazy_decay(lazy_decay), l1(l1) {
+}
+
+MulticlassCPM::~MulticlassCPM() {
+    clear();
+}
+
+void MulticlassCPM::clear() {
+    for (auto model: models) {
+        delete model;
+    }
+    models.clear();
+    labels.clear();
+}
+
+void MulticlassCPM::fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuffle, bool verbose,
+                        int n_threads, const StoppingCriteria& stopping) {
+    clear();
+    
+    for (auto const& lc: trainset.getCountsPerClass()) {
+        labels.push_back(lc.first);
+    }
+    
+    if (labels.size() < 2) {
+        throw std::runtime_error("Multiclass training requires at least two labels.");
+    }
+    
+    if (n_threads < 1) n_threads = 1;
+    if ((size_t) n_threads > labels.size()) n_threads = (int) labels.size();
+    
+    // the labels trained concurrently share the cores of the whole weight passes
+    const int pass_threads = std::max(1, (int) std::thread::hardware_concurrency() / n_threads);
+    
+    // distinct seeds keep the per-label runs independent yet reproducible
+    for (size_t i = 0; i < labels.size(); ++i) {
+        models.push_back(new CPM(k, labels[i], lambda, entropy, cost_ratio, seed + (unsigned int) i, average,
+                                 optimizer, learning_rate, sparse_weights, precision, lazy_decay, l1));
+        models.back()->setPrefetchDistance(prefetch_distance);
+        models.back()->setPassThreads(pass_threads);
+        models.back()->setTelemetry(publisher);
+    }
+    
+    if (n_threads == 1) {
+        for (size_t i = 0; i < models.size(); ++i) {
+            if (verbose) std::cout << "### Label " << labels[i] << " ###\n";
+            models[i]->fit(trainset, iterations, reshuffle, verbose, stopping);
+            if (verbose) std::cout << '\n';
+        }
+        return;
+    }
+    
+    std::atomic<size_t> next(0);
+    std::mutex mutex;
+    std::exception_ptr error = nullptr;
+    
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < models.size()) {
+            try {
+                models[i]->fit(trainset, iterations, reshuffle, false, stopping);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) error = std::current_exception();
+                return;
+            }
+            
+            if (verbose) {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::cout << "Trained label " << labels[i] << " in "
+                << models[i]->getIterations() << " iterations\n";
+            }
+        }
+    };
+    
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; ++t) {
+        threads.emplace_back(worker);
+    }
+    
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    
+    if (error) std::rethrow_exception(error);
+}
+
+std::pair<int, double> MulticlassCPM::predict(const SparseVector& sv) const {
+    if (models.empty()) {
+        throw std::runtime_error("Empty model.");
+    }
+    
+    size_t best = 0;
+    double best_score = -std::numeric_limits<double>::infinity();
+    
+    for (size_t i = 0; i < models.size(); ++i) {
+        double score = models[i]->predict(sv).first;
+        if (score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    
+    return std::make_pair(labels[best], best_score);
+}
+
+void MulticlassCPM::predict(const StochasticDataAdaptor& testset, int* out_labels, float* scores) const {
+    if (testset.getHashBits() != getHashBits()) {
+        throw std::runtime_error("Test set and model feature hashing differ.");
+    }
+    
+    if (testset.getFeatureIds() != getFeatureIds()) {
+        throw std::runtime_error("Test set and model feature compaction differ.");
+    }
+    
+    for (size_t i = 0; i < testset.getNInstances(); ++i) {
+        auto ls = predict(std::get<1>(testset.getInstance(i)));
+        out_labels[i] = ls.first;
+        scores[i] = (float) ls.second;
+    }
+}
+
+const std::vector<int>& MulticlassCPM::getFeatureIds() const {
+    static const std::vector<int> none;
+    return models.empty() ? none : models[0]->getFeatureIds();
+}
+
+void MulticlassCPM::serializeModel(const char* filename) const {
+    std::ofstream ss(filename);
+    
+    ss << "multiclass: " << models.size() << '\n';
+    ss << "labels: ";
+    for (int label: labels) {
+        ss << label << ' ';
+    }
+    ss << "\n\n";
+    
+    for (auto model: models) {
+        model->serializeModel(ss);
+        ss << '\n';
+    }
+}
+
+void MulticlassCPM::prune(const StochasticDataAdaptor& data, double max_win_rate, std::vector<PruneReport>* reports) {
+    if (reports) reports->assign(models.size(), PruneReport());
+    
+    for (size_t i = 0; i < models.size(); ++i) {
+        CPM* pruned = models[i]->prune(data, max_win_rate, reports ? &(*reports)[i] : nullptr);
+        delete models[i];
+        models[i] = pruned;
+    }
+}
+
+MulticlassCPM* MulticlassCPM::deserializeModel(const char* filename) {
+    std::ifstream ss(filename);
+    
+    if (!ss) {
+        throw std::runtime_error("Cannot open model file.");
+    }
+    
+    std::string key;
+    ss >> key;
+    if (key != "multiclass:") {
+        throw std::runtime_error("Not a multiclass model file.");
+    }
+    
+    size_t n_classes;
+    ss >> n_classes;
+    
+    ss.ignore(std::numeric_limits<std::streamsize>::max(), ':');
+    std::vector<int> labels(n_classes);
+    for (size_t i = 0; i < n_classes; ++i) {
+        ss >> labels[i];
+    }
+    
+    if (ss.fail() || n_classes == 0) {
+        throw std::runtime_error("Error when reading model file.");
+    }
+    
+    MulticlassCPM* res = nullptr;
+    
+    try {
+        for (size_t i = 0; i < n_classes; ++i) {
+            CPM* model = CPM::deserializeModel(ss);
+            
+            if (!res) {
+                res = new MulticlassCPM(model->k, model->lambda, model->entropy, model->cost_ratio, model->seed,
+                                        false, Pegasos, 0.1f, model->sparse_weights);
+            }
+            
+            res->labels.push_back(labels[i]);
+            res->models.push_back(model);
+            
+            if (model->outer_label != labels[i]) {
+                throw std::runtime_error("Label mismatch in multiclass model file.");
+            }
+        }
+    } catch (...) {
+        delete res;
+        throw;
+    }
+    
+    return res;
+}
@@ -0,0 +1,98 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// multiclass_cpm.h
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#ifndef __cpm__multiclass_cpm__
+#define __cpm__multiclass_cpm__
+
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "stochastic_data_adaptor.h"
+#include "sparse_vector.h"
+#include "cpm.h"
+
+// One-vs-rest decomposition: one CPM per label, each one having its label as outer class.
+// All the models are trained over the same in-memory dataset.
+class MulticlassCPM {
+public:
+    MulticlassCPM(int k, float lambda, float entropy, float cost_ratio, unsigned int seed,
+                  bool average=false, Optimizer optimizer=Pegasos, float learning_rate=0.1f,
+                  bool sparse_weights=false, Precision precision=DoublePrecision, bool lazy_decay=false,
+                  float l1=0.0f);
+    ~MulticlassCPM();
+    
+    /* trains one model per label present in trainset
+     *
+     * n_threads: number of models trained concurrently. Each thread holds
+     *            its own model, the dataset is shared.
+     * stopping: applied to each per-label model independently, including the time budget
+     */
+    void fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuffle, bool verbose,
+             int n_threads=1, const StoppingCriteria& stopping=StoppingCriteria());
+    
+    // predicted labels and their scores (max over all per-label models)
+    void predict(const StochasticDataAdaptor& testset, int* labels, float* scores) const;
+    
+    // label and score of the best scoring model
+    std::pair<int, double> predict(const SparseVector& sv) const;
+    
+    // all models in one file
+    void serializeModel(const char* filename) const;
+    static MulticlassCPM* deserializeModel(const char* filename);
+    
+    // CPM::prune of each per-label model over data, in place. reports: one per label, if not null
+    void prune(const StochasticDataAdaptor& data, double max_win_rate=0.0, std::vector<PruneReport>* reports=nullptr);
+    
+    size_t getNClasses() const {return models.size();}
+    const std::vector<int>& getLabels() const {return labels;}
+    const CPM& getModel(size_t i) const {return *models[i];}
+    // see CPM::setPrefetchDistance, applies to the models of the next fit
+    void setPrefetchDistance(int d) {prefetch_distance = d;}
+    // see CPM::setTelemetry, each label is published as a run of its own
+    void setTelemetry(telemetry::Publisher* p) {publisher = p;}
+    
+    int getHashBits() const {return models.empty() ? 0 : models[0]->getHashBits();}
+    const std::vector<int>& getFeatureIds() const;
+    
+    const int k;
+    const float lambda;
+    const float entropy;
+    const float cost_ratio;
+    const unsigned int seed;
+    const bool average;
+    const Optimizer optimizer;
+    const float learning_rate;
+    const bool sparse_weights;
+    const Precision precision;
+    const bool lazy_decay;
+    const float l1;
+
+private:
+    std::vector<int> labels;
+    std::vector<CPM*> models;
+    int prefetch_distance = 4;
+    telemetry::Publisher* publisher = nullptr;
+    
+    void clear();
+};
+
+#endif /* defined(__cpm__multiclass_cpm__) */
@@ -0,0 +1,144 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// page_allocator.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#include <new>
+#include <cstdint>
+
+#include "page_allocator.h"
+#include "instrumentation.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace pagealloc {
+
+static bool huge_pages = false;
+static NumaPolicy numa = FirstTouch;
+
+// arrays at least that large are mapped directly, 2MB aligned
+static const size_t huge_page_size = 2 * 1024 * 1024;
+static const size_t min_mapped_size = huge_page_size;
+
+void setPolicy(bool huge, NumaPolicy policy) {
+    huge_pages = huge;
+    numa = policy;
+}
+
+bool hugePages() {
+    return huge_pages;
+}
+
+NumaPolicy numaPolicy() {
+    return numa;
+}
+
+#ifdef __linux__
+
+static size_t mappedSize(size_t n) {
+    size_t bytes = n * sizeof(float);
+    return (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+}
+
+// anonymous mapping of size bytes (a multiple of 2MB) starting on a 2MB boundary
+static void* mapAligned(size_t size) {
+    // over-map by one huge page, then trim both ends
+    void* p = mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    
+    uintptr_t start = (uintptr_t) p;
+    uintptr_t aligned = (start + huge_page_size - 1) / huge_page_size * huge_page_size;
+    
+    if (aligned > start) munmap(p, aligned - start);
+    munmap((void*) (aligned + size), start + huge_page_size - aligned);
+    
+    return (void*) aligned;
+}
+
+float* allocate(size_t n) {
+    CPM_COUNT(Allocations, 1);
+    CPM_COUNT(AllocatedBytes, n * sizeof(float));
+    
+    if (n * sizeof(float) < min_mapped_size) {
+        return new float[n]();
+    }
+    
+    const size_t size = mappedSize(n);
+    void* p = nullptr;
+    
+#ifdef MAP_HUGETLB
+    // reserved huge pages, if any
+    if (huge_pages) {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) p = nullptr;
+    }
+#endif
+    
+    if (!p) {
+        p = mapAligned(size);
+        if (!p) throw std::bad_alloc();
+        
+#ifdef MADV_HUGEPAGE
+        if (huge_pages) madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+    
+#ifdef SYS_mbind
+    if (numa == Interleave) {
+        // all nodes, the kernel restricts the mask to the allowed ones.
+        // Called before the first write, so that all the pages follow the policy.
+        const int mpol_interleave = 3;
+        unsigned long nodemask[4] = {~0UL, ~0UL, ~0UL, ~0UL};
+        syscall(SYS_mbind, p, size, mpol_interleave, nodemask, 8 * sizeof(nodemask), 0);
+    }
+#endif
+    
+    // fresh anonymous pages are zeroed and not placed until first written
+    return (float*) p;
+}
+
+void release(float* p, size_t n) {
+    if (!p) return;
+    
+    if (n * sizeof(float) < min_mapped_size) {
+        delete[] p;
+    } else {
+        munmap(p, mappedSize(n));
+    }
+}
+
+#else
+
+float* allocate(size_t n) {
+    CPM_COUNT(Allocations, 1);
+    CPM_COUNT(AllocatedBytes, n * sizeof(float));
+    return new float[n]();
+}
+
+void release(float* p, size_t n) {
+    delete[] p;
+}
+
+#endif
+
+}
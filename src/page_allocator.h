@@ -0,0 +1,51 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// page_allocator.h
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#ifndef __cpm__page_allocator__
+#define __cpm__page_allocator__
+
+#include <cstddef>
+
+// Allocation of the large weight arrays, with control over the page size and NUMA placement.
+namespace pagealloc {
+
+enum NumaPolicy {
+    FirstTouch, // pages land on the node of the thread writing them first (the kernel default)
+    Interleave  // pages are spread round robin over all the nodes
+};
+
+/* Process wide policy, applies to the arrays allocated afterwards.
+ * huge_pages: back the arrays with 2MB pages, from hugetlbfs when pages are
+ * reserved, else through transparent huge pages. Best effort, falls back to
+ * regular pages silently.
+ */
+void setPolicy(bool huge_pages, NumaPolicy numa);
+
+bool hugePages();
+NumaPolicy numaPolicy();
+
+// zeroed array of n floats, to be released with release(p, n)
+float* allocate(size_t n);
+void release(float* p, size_t n);
+
+}
+
+#endif /* defined(__cpm__page_allocator__) */
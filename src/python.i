@@ -29,7 +29,9 @@
 #include <map>
 #include "stochastic_data_adaptor.h"
 #include "cpm.h"
+#include "multiclass_cpm.h"
 #include "parallel_eval.h"
+#include "page_allocator.h"
 %}
 
 %include "std_vector.i"
@@ -65,6 +67,8 @@ from scipy import sparse
 %}
 
 %template() std::map<int, size_t>;
+%template() std::vector<int>;
+%template() std::vector<size_t>;
 
 namespace std {
   %template(VectorOfStruct) std::vector<CPMConfig>;
@@ -104,28 +108,37 @@ namespace std {
 // Directly wrapped calls
 class StochasticDataAdaptor {
 public:
-  StochasticDataAdaptor(const char* fname);
+  StochasticDataAdaptor(const char* fname, size_t n_instances, int hash_bits);
 
   ~StochasticDataAdaptor();
   
   size_t getNInstances() const;
   
   size_t getDimensions() const;
+  
+  int getHashBits() const;
+  
+  void compact();
+  
+  void remap(const std::vector<int>& feature_ids);
+  
+  const std::vector<int>& getFeatureIds() const;
 
   const std::map<int, size_t> getCountsPerClass() const;
 };
 
 %extend StochasticDataAdaptor {
-  StochasticDataAdaptor(float* data, int dim1, int dim2, int* labels, int dim_labels) {
+  StochasticDataAdaptor(float* data, int dim1, int dim2, int* labels, int dim_labels, int hash_bits) {
     if (dim1 != dim_labels) {
       PyErr_Format(PyExc_ValueError, "Dimensions mismatch.");
       return nullptr;
     }
 
-    return new StochasticDataAdaptor(data, labels, dim1, dim2);
+    return new StochasticDataAdaptor(data, labels, dim1, dim2, hash_bits);
   }
 
-  StochasticDataAdaptor(float* sparse_data, int dim1, int* indices, int dim2, int* indptr, int dim3, int* labels, int dim_labels) {
+  StochasticDataAdaptor(float* sparse_data, int dim1, int* indices, int dim2, int* indptr, int dim3, int* labels, int dim_labels, 
+                        int hash_bits) {
   if (dim1 != dim2) {
     PyErr_Format(PyExc_ValueError, "Dimension mismatch for data and indices arrays.");
     return nullptr;
@@ -136,7 +149,7 @@ public:
     return nullptr;
   }
 
-  return new StochasticDataAdaptor(sparse_data, indices, indptr, labels, dim1, dim3);
+  return new StochasticDataAdaptor(sparse_data, indices, indptr, labels, dim1, dim3, hash_bits);
   }
 
   void _getLabels(int* out_labels, int dol) const {
@@ -151,7 +164,7 @@ public:
 
 %pythoncode %{
 class Dataset(_Dataset):
-  def __init__(self, *args):
+  def __init__(self, *args, **kwargs):
     """Constructs a labeled dataset object that can be used for CPM training 
     and prediction (labels will be ignored when used for prediction). 
     This always incurs a memory copy (for either dense or sparse matrices) 
@@ -167,19 +180,39 @@ class Dataset(_Dataset):
       Y: 1d int array-like object
       
       Creates a dataset from instances X (one instance per row) and labels Y.
+
+    Keyword arguments:
+      hash_bits: int -- if > 0, feature indices are hashed (signed hashing trick) 
+        into 2**hash_bits dimensions (at most 30). Data to predict must be hashed like the 
+        training data, see CPM.getHashBits().
+      compact: bool -- renumbers the observed features 0, 1, ... so that the 
+        model only spans the features present in this (training) dataset.
+      feature_ids: sequence of int -- remaps the features with the table of a 
+        compacted model, see CPM.getFeatureIds(). Unseen features are dropped.
     """
+    hash_bits = kwargs.pop('hash_bits', 0)
+    compact = kwargs.pop('compact', False)
+    feature_ids = kwargs.pop('feature_ids', None)
+    if kwargs:
+      raise TypeError("Unexpected keyword arguments: %s" % ', '.join(kwargs))
+
     if len(args) == 1:
-      super(Dataset, self).__init__(*args)
+      super(Dataset, self).__init__(args[0], 1000000, hash_bits)
 
     if len(args) == 2:
       if sparse.isspmatrix_csr(args[0]):
-        super(Dataset, self).__init__(args[0].data, args[0].indices, args[0].indptr, args[1])
+        super(Dataset, self).__init__(args[0].data, args[0].indices, args[0].indptr, args[1], hash_bits)
       else:
-        super(Dataset, self).__init__(*args)
+        super(Dataset, self).__init__(args[0], args[1], hash_bits)
     
     if len(args) > 2:
       raise ValueError("Too many arguments.")
 
+    if compact:
+      self.compact()
+    elif feature_ids:
+      self.remap(feature_ids)
+
   def getLabels(self):
     """Returns a numpy array of labels."""
     return self._getLabels(int(self.getNInstances()))
@@ -187,22 +220,93 @@ class Dataset(_Dataset):
 
 /* ###################################################### */
 
+%rename(_setPolicy) pagealloc::setPolicy;
+
+namespace pagealloc {
+  enum NumaPolicy {FirstTouch, Interleave};
+  void setPolicy(bool huge_pages, NumaPolicy numa);
+}
+
+%pythoncode %{
+def setPagePolicy(huge_pages=False, numa='first_touch'):
+  """Page size and NUMA placement of the weights of the models trained afterwards.
+
+     Inputs:
+        huge_pages: bool -- back the weights with 2MB pages when the system allows it
+        numa: str -- 'first_touch' (node of the training thread) or 'interleave' (all nodes)
+  """
+  _setPolicy(huge_pages, {'first_touch': FirstTouch, 'interleave': Interleave}[numa])
+%}
+
+/* ###################################################### */
+
+enum Optimizer {Pegasos, AdaGrad, RMSProp};
+enum Precision {DoublePrecision, SinglePrecision};
+
+%pythoncode %{
+_optimizers = {'pegasos': Pegasos, 'adagrad': AdaGrad, 'rmsprop': RMSProp}
+_precisions = {'double': DoublePrecision, 'single': SinglePrecision}
+%}
+
+struct ClassifierStats {
+  size_t wins;
+  size_t fired;
+  size_t active;
+  size_t assigned;
+  double margin_sum;
+  double exclusion_loss;
+  
+  double meanMargin() const;
+};
+
+%template(ClassifierStatsVector) std::vector<ClassifierStats>;
+
+struct StoppingCriteria {
+  StoppingCriteria(float max_reassignment_rate, float min_loss_change, int patience,
+                   const StochasticDataAdaptor* validation, float min_auc_gain,
+                   float max_seconds, int check_every);
+};
+
+struct PruneReport {
+  std::vector<int> kept;
+  std::vector<size_t> wins;
+  size_t rows;
+  size_t changed_rows;
+  size_t flipped_rows;
+  double max_change;
+  double mean_change;
+};
+
 %rename(_CPM) CPM;
 
 class CPM {
 public:
     CPM(int k, int outer_label, float lambda, float entropy, float cost_ratio, 
-        unsigned int seed);
+        unsigned int seed, bool average, Optimizer optimizer, float learning_rate, bool sparse_weights,
+        Precision precision, bool lazy_decay, float l1);
     ~CPM();
     
-    void fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuffle, bool verbose);
+    void fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuffle, bool verbose,
+             const StoppingCriteria& stopping);
     void serializeModel(const char* filename) const;
     static CPM* deserializeModel(const char* filename);
+    size_t getIterations() const;
+    std::vector<ClassifierStats> getClassifierStats() const;
+    void prepareEarlyExit();
+    bool isEarlyExitReady() const;
+    void setPrefetchDistance(int d);
+    int getHashBits() const;
+    const std::vector<int>& getFeatureIds() const;
     
     const int outer_label;
 };
 
 %extend CPM {
+  // pruned copy of model (CPM::prune), a constructor so that the Python CPM class can wrap it
+  CPM(const CPM& model, const StochasticDataAdaptor& data, double max_win_rate, PruneReport* report) {
+    return model.prune(data, max_win_rate, report);
+  }
+  
   void predict(const StochasticDataAdaptor& testset, float* scores, int scores_dim, 
                 int* assignments, int assignments_dim) {
     if ((scores_dim != testset.getNInstances()) || (assignments_dim != testset.getNInstances())) {
@@ -212,13 +316,25 @@ public:
     
     return $self->predict(testset, scores, assignments);
   }
+  
+  void exceeds(const StochasticDataAdaptor& testset, float threshold, int* out_labels, int dol) {
+    if (dol != testset.getNInstances()) {
+      PyErr_Format(PyExc_RuntimeError, "Internal error.");
+      return;
+    }
+    
+    for (size_t i = 0; i < testset.getNInstances(); ++i) {
+      out_labels[i] = $self->exceeds(std::get<1>(testset.getInstance(i)), threshold);
+    }
+  }
 }
 
 %pythoncode %{
 class CPM(_CPM):
   def __init__(self, k, C=1.0, entropy=0.0, 
               cost_ratio=1.0, outer_label=1, 
-              seed=None):
+              seed=None, average=False, optimizer='pegasos', learning_rate=0.1,
+              sparse_weights=False, precision='double', lazy_decay=False, l1=0.0):
     """Initialize an empty CPM model.
        
        Inputs:
@@ -229,24 +345,53 @@ class CPM(_CPM):
             misclassification training errors
           outer_label: int -- outside (positive) class
           seed: (None, int) -- random seed for reproducibility
+          average: bool -- predict with the average of all SGD iterates
+          optimizer: str -- step size rule, one of 'pegasos', 'adagrad', 'rmsprop'
+          learning_rate: float -- base learning rate of 'adagrad' and 'rmsprop'
+          sparse_weights: bool -- store the weights in a hash table, allocating rows 
+            for the updated features only (for very high dimensional data)
+          precision: str -- 'double', or 'single' for float accumulation during training
+          lazy_decay: bool -- apply the L2 decay to each weight row when it is next used
+            (not compatible with average)
+          l1: float -- L1 penalty, added to the L2 one (elastic net). Weights are truncated
+            to zero, which implies lazy_decay
     """
     if seed is None:
       seed = int(random.getrandbits(32))
 
-    super(CPM, self).__init__(k, outer_label, 1.0/C, entropy, cost_ratio, seed)
+    super(CPM, self).__init__(k, outer_label, 1.0/C, entropy, cost_ratio, seed, average,
+                              _optimizers[optimizer], learning_rate, sparse_weights,
+                              _precisions[precision], lazy_decay, l1)
 
-  def fit(self, trainset, iterations=-1, reshuffle=True, verbose=False):
+  def fit(self, trainset, iterations=-1, reshuffle=True, verbose=False,
+          stop_reassignment_rate=-1.0, stop_loss_change=-1.0, patience=3,
+          validation=None, stop_auc_gain=0.0, time_budget=None, check_every=1024):
     """Trains a model via SGD.
        
        Inputs:
           trainset: Dataset
-          iterations: int -- number of SGD steps. If < 0, will be set to 10 * training set size.
+          iterations: int -- (maximal) number of SGD steps. If < 0, will be set to 10 * training set size,
+            or left unbounded when a time_budget is given.
           reshuffle: bool -- reshuffle trainingset between each epoch
           verbose: bool -- print training statistics on stdout
+          stop_reassignment_rate: float -- stop once at most this fraction of positives 
+            changed sub-classifier during an epoch (< 0: disabled)
+          stop_loss_change: float -- stop once the training loss changed by at most this 
+            relative amount since the previous epoch (< 0: disabled). When both are enabled, 
+            both conditions must hold.
+          patience: int -- number of consecutive epochs a stopping condition must hold
+          validation: (None, Dataset) -- stop once the AUC on this set did not improve 
+            by more than stop_auc_gain
+          stop_auc_gain: float -- see validation
+          time_budget: (None, float) -- wall-clock training budget in seconds
+          check_every: int -- number of SGD steps between two reads of the clock for time_budget
     """
     if iterations < 0:
-      iterations = 10 * trainset.getNInstances()
-    super(CPM, self).fit(trainset, iterations, reshuffle, verbose)
+      iterations = 0 if time_budget is not None else 10 * trainset.getNInstances()
+    stopping = StoppingCriteria(stop_reassignment_rate, stop_loss_change, patience,
+                                validation, stop_auc_gain, 
+                                -1.0 if time_budget is None else time_budget, check_every)
+    super(CPM, self).fit(trainset, iterations, reshuffle, verbose, stopping)
 
   def predict(self, testset):
     """Performs inference.
@@ -258,6 +403,136 @@ class CPM(_CPM):
           assignments: 1d int array of active sub-classifiers per instance
     """
     return super(CPM, self).predict(testset, int(testset.getNInstances()), int(testset.getNInstances()))
+
+  def above(self, testset, threshold=0.0):
+    """Thresholded inference with early exit, as predict(testset)[0] > threshold but 
+       skipping the features which cannot change the decision. Models trained with 
+       average or lazy_decay must be saved and read back (or pruned) first. The bounds 
+       of early exit are computed by the first call after fit, the next calls reuse them.
+       
+       Outputs:
+          1d bool array
+    """
+    if not self.isEarlyExitReady():
+      self.prepareEarlyExit()
+    return super(CPM, self).exceeds(testset, threshold, int(testset.getNInstances())).astype(bool)
+
+  def prune(self, dataset, max_win_rate=0.0):
+    """Drops the sub-classifiers which win the max on at most max_win_rate of the rows of
+       dataset (labels unused), keeping at least one. With max_win_rate=0, the scores of
+       dataset are unchanged.
+       
+       Outputs:
+          model: CPM -- the smaller model, for inference
+          report: PruneReport -- kept (original indices of the kept sub-classifiers), wins
+            (rows won by each original one), rows, changed_rows (scores decreased), 
+            flipped_rows (scores no longer above 0), max_change, mean_change (score decrease)
+    """
+    report = PruneReport()
+    model = CPM.__new__(CPM)
+    _CPM.__init__(model, self, dataset, max_win_rate, report)
+    return model, report
+
+  def classifierStats(self):
+    """Statistics of each sub-classifier over the training steps of the last fit.
+       
+       Outputs:
+          dict of 1d numpy arrays of length k: 'wins' (samples where it had the highest score),
+          'fired' (samples scored above 0), 'active' (steps where its hinge loss was active),
+          'assigned' (positive steps assigned to it), 'mean_margin' (mean score of these
+          positives), 'exclusion_loss' (sum of its positive scores on the positives assigned
+          elsewhere)
+    """
+    stats = self.getClassifierStats()
+    return {'wins': np.array([s.wins for s in stats]),
+            'fired': np.array([s.fired for s in stats]),
+            'active': np.array([s.active for s in stats]),
+            'assigned': np.array([s.assigned for s in stats]),
+            'mean_margin': np.array([s.meanMargin() for s in stats]),
+            'exclusion_loss': np.array([s.exclusion_loss for s in stats])}
+%}
+
+/* ######################################### */
+
+%rename(_MulticlassCPM) MulticlassCPM;
+
+class MulticlassCPM {
+public:
+    MulticlassCPM(int k, float lambda, float entropy, float cost_ratio, unsigned int seed,
+                  bool average, Optimizer optimizer, float learning_rate, bool sparse_weights,
+                  Precision precision, bool lazy_decay, float l1);
+    ~MulticlassCPM();
+    
+    void fit(const StochasticDataAdaptor& trainset, int iterations, bool reshuffle, bool verbose,
+             int n_threads, const StoppingCriteria& stopping);
+    void serializeModel(const char* filename) const;
+    static MulticlassCPM* deserializeModel(const char* filename);
+    
+    size_t getNClasses() const;
+    void setPrefetchDistance(int d);
+    const std::vector<int>& getLabels() const;
+    int getHashBits() const;
+    const std::vector<int>& getFeatureIds() const;
+};
+
+%extend MulticlassCPM {
+  void predict(const StochasticDataAdaptor& testset, int* out_labels, int dol,
+               float* scores, int scores_dim) {
+    if ((dol != testset.getNInstances()) || (scores_dim != testset.getNInstances())) {
+      PyErr_Format(PyExc_RuntimeError, "Internal error.");
+      return;
+    }
+    
+    return $self->predict(testset, out_labels, scores);
+  }
+}
+
+%pythoncode %{
+class MulticlassCPM(_MulticlassCPM):
+  def __init__(self, k, C=1.0, entropy=0.0, cost_ratio=1.0, seed=None, average=False,
+               optimizer='pegasos', learning_rate=0.1, sparse_weights=False, precision='double',
+               lazy_decay=False, l1=0.0):
+    """Initialize an empty one-vs-rest multiclass model. One CPM with k 
+       sub-classifiers is trained per label, see CPM for the parameters.
+    """
+    if seed is None:
+      seed = int(random.getrandbits(32))
+
+    super(MulticlassCPM, self).__init__(k, 1.0/C, entropy, cost_ratio, seed, average,
+                                        _optimizers[optimizer], learning_rate, sparse_weights,
+                                        _precisions[precision], lazy_decay, l1)
+
+  def fit(self, trainset, iterations=-1, reshuffle=True, verbose=False, n_threads=1,
+          stop_reassignment_rate=-1.0, stop_loss_change=-1.0, patience=3,
+          validation=None, stop_auc_gain=0.0, time_budget=None, check_every=1024):
+    """Trains one model per label of trainset, all over the same dataset.
+       
+       Inputs:
+          trainset: Dataset
+          iterations: int -- number of SGD steps per label. If < 0, will be set to 10 * training set size.
+          reshuffle: bool -- reshuffle trainingset between each epoch
+          verbose: bool -- print training statistics on stdout
+          n_threads: int -- number of labels trained concurrently
+          stop_*, patience, validation, time_budget, check_every: stopping criteria applied to each label, 
+            see CPM.fit
+    """
+    if iterations < 0:
+      iterations = 0 if time_budget is not None else 10 * trainset.getNInstances()
+    stopping = StoppingCriteria(stop_reassignment_rate, stop_loss_change, patience,
+                                validation, stop_auc_gain, 
+                                -1.0 if time_budget is None else time_budget, check_every)
+    super(MulticlassCPM, self).fit(trainset, iterations, reshuffle, verbose, n_threads, stopping)
+
+  def predict(self, testset):
+    """Performs inference.
+       Input:
+          testset: Dataset
+
+       Outputs:
+          labels: 1d int array of predicted labels (argmax over the per-label models)
+          scores: 1d float array of the winning model scores
+    """
+    return super(MulticlassCPM, self).predict(testset, int(testset.getNInstances()), int(testset.getNInstances()))
 %}
 
 /* ######################################### */
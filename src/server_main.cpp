@@ -0,0 +1,126 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// server_main.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+/* cpm_server: serves a model over a local socket, see inference_server.h for the protocol.
+ * SIGHUP reloads the model file, SIGINT and SIGTERM stop after answering the requests
+ * already received.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+
+#include "inference_server.h"
+#include "option_parser.h"
+
+int main(int argc, char* const argv[]) {
+    OptionParser op("Serve a CPM model over a Unix domain socket or loopback TCP.");
+    
+    op.addOption("model file, read again on SIGHUP.", 'm', "model", false, "", nullptr);
+    op.addOption("endpoint, unix:<path> or tcp:<port> (loopback only).", 'l', "listen", true,
+                 "unix:/tmp/cpm.sock", nullptr);
+    op.addOption("number of scoring threads (0: all cores).", '\0', "workers", true, (int) 0, nullptr);
+    op.addOption("largest number of requests scored at once by a worker.", '\0', "max_batch", true, (int) 64,
+                 nullptr);
+    op.addOption("microseconds a worker waits for a batch to fill up (0: scores what is queued).", '\0',
+                 "batch_wait", true, (int) 0, nullptr);
+    op.addOption("quiet mode.", 'q', "quiet", true, false);
+    
+    op.parseCmdString(argc, argv);
+    
+    const char* model_file = op.getString("model");
+    if (std::strlen(model_file) == 0) {
+        std::cerr << "A model file is required (--model).\n";
+        return 1;
+    }
+    const bool verbose = !op.getBool("quiet");
+    
+    serving::ServerConfig config;
+    config.workers = op.getInt("workers");
+    if (config.workers <= 0) config.workers = std::max(1, (int) std::thread::hardware_concurrency());
+    config.max_batch = (size_t) std::max(1, op.getInt("max_batch"));
+    config.batch_wait_us = op.getInt("batch_wait");
+    
+    // the signals go to the watcher thread below, the other threads inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::signal(SIGPIPE, SIG_IGN);
+    
+    serving::Server* server = nullptr;
+    try {
+        server = new serving::Server(op.getString("listen"), model_file, config);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    
+    if (verbose) {
+        std::cerr << "Serving " << model_file << " on " << op.getString("listen") << " with " << config.workers
+                  << " worker(s).\n";
+    }
+    
+    std::thread watcher([&]() {
+        while (true) {
+            int signal = 0;
+            if (sigwait(&signals, &signal) != 0) continue;
+            
+            if (signal == SIGHUP) {
+                auto start = std::chrono::steady_clock::now();
+                std::string error;
+                if (server->reload(error)) {
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                    if (verbose) std::cerr << "Reloaded " << model_file << " in " << elapsed.count() << "s.\n";
+                } else {
+                    std::cerr << "Reload failed, keeping the current model: " << error << '\n';
+                }
+            } else {
+                server->stop();
+                return;
+            }
+        }
+    });
+    
+    auto start = std::chrono::steady_clock::now();
+    server->run();
+    watcher.join();
+    
+    if (verbose) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        size_t requests = server->getRequests(), batches = server->getBatches();
+        std::cerr << "Served " << requests << " requests in " << batches << " batches (mean "
+                  << (batches ? (double) requests / batches : 0.0) << ") over " << elapsed.count() << "s, "
+                  << server->getReloads() << " reload(s).\n";
+    }
+    
+    delete server;
+    return 0;
+}
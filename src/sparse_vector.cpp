@@ -23,10 +23,12 @@
 
 #include <string.h>
 #include <sstream>
+#include <string>
 #include <stdexcept>
 #include <cmath>
+#include <algorithm>
 
-SparseVector::SparseVector(const char* lsf_string, int non_zeros) {
+SparseVector::SparseVector(const char* lsf_string, int non_zeros, int hash_bits) {
     data.clear();
     data.reserve(non_zeros);
     norm = 0.0;
@@ -68,10 +70,11 @@ SparseVector::SparseVector(const char* lsf_string, int non_zeros) {
     }
     
     norm = std::sqrt(norm);
+    if (hash_bits > 0) hash(hash_bits);
     data.shrink_to_fit();
 }
 
-SparseVector::SparseVector(float* cdata, size_t len) {
+SparseVector::SparseVector(float* cdata, size_t len, int hash_bits) {
     data.clear();
     data.reserve(len);
     norm = 0.0;
@@ -85,10 +88,11 @@ SparseVector::SparseVector(float* cdata, size_t len) {
     }
     
     norm = std::sqrt(norm);
+    if (hash_bits > 0) hash(hash_bits);
     data.shrink_to_fit();
 }
 
-SparseVector::SparseVector(int* indices, float* cdata, size_t len) {
+SparseVector::SparseVector(int* indices, float* cdata, size_t len, int hash_bits) {
     data.clear();
     data.reserve(len);
     norm = 0.0;
@@ -109,9 +113,44 @@ SparseVector::SparseVector(int* indices, float* cdata, size_t len) {
     }
     
     norm = std::sqrt(norm);
+    if (hash_bits > 0) hash(hash_bits);
     data.shrink_to_fit();
 }
 
+void SparseVector::hash(int hash_bits) {
+    if (hash_bits < 0 || hash_bits > max_hash_bits) {
+        throw std::runtime_error("At most " + std::to_string(max_hash_bits) + " hash bits are supported.");
+    }
+    
+    for (auto& iv: data) {
+        auto bucket_sign = hashFeature(iv.index, hash_bits);
+        iv.index = bucket_sign.first;
+        iv.value *= bucket_sign.second;
+    }
+    
+    std::sort(data.begin(), data.end(), [](const IValue& lhs, const IValue& rhs) {
+        return lhs.index < rhs.index;});
+    
+    // merge collisions, drop the entries that cancelled out
+    size_t last = 0;
+    for (size_t i = 0; i < data.size(); ++i) {
+        if (last > 0 && data[last - 1].index == data[i].index) {
+            data[last - 1].value += data[i].value;
+        } else {
+            data[last++] = data[i];
+        }
+    }
+    data.erase(data.begin() + last, data.end());
+    data.erase(std::remove_if(data.begin(), data.end(), [](const IValue& iv) {return iv.value == 0.0f;}),
+               data.end());
+    
+    norm = 0.0;
+    for (auto const& iv: data) {
+        norm += iv.value * iv.value;
+    }
+    norm = std::sqrt(norm);
+}
+
 void SparseVector::multiplyInplace(float weight) {
     for(auto& iv : data){
         iv.value *= weight;
@@ -119,6 +158,27 @@ void SparseVector::multiplyInplace(float weight) {
     norm *= weight;
 }
 
+void SparseVector::remap(const std::vector<int>& feature_ids) {
+    // feature_ids is sorted, so the new indices remain sorted
+    size_t last = 0;
+    for (size_t i = 0; i < data.size(); ++i) {
+        auto it = std::lower_bound(feature_ids.begin(), feature_ids.end(), data[i].index);
+        if (it != feature_ids.end() && *it == data[i].index) {
+            data[last++] = IValue((int) (it - feature_ids.begin()), data[i].value);
+        }
+    }
+    
+    if (last < data.size()) {
+        data.erase(data.begin() + last, data.end());
+        
+        norm = 0.0;
+        for (auto const& iv: data) {
+            norm += iv.value * iv.value;
+        }
+        norm = std::sqrt(norm);
+    }
+}
+
 std::unique_ptr<std::string> SparseVector::toLibSVMFormat() const {
     std::stringstream ss;
     for (auto const& iv: data){
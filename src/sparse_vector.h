@@ -24,6 +24,8 @@
 
 #include <vector>
 #include <memory>
+#include <utility>
+#include <cstdint>
 
 // element cell
 struct IValue{
@@ -33,22 +35,48 @@ struct IValue{
     float value;
 };
 
+// largest hash_bits, so that the 2^hash_bits dimensions fit in an int
+const int max_hash_bits = 30;
+
 class SparseVector {
 
 friend class DenseMatrix;
+friend class StochasticDataAdaptor;
 
 public:
     /* constructor from a libsvm-like string (without label)
      * non_zeros is a performance hint and represents the 
      * initial size of the internal data vector.
+     * hash_bits > 0 maps the indices into 2^hash_bits signed buckets,
+     * see hashFeature.
     */
-    SparseVector(const char* lsf_string, int non_zeros=1000);
+    SparseVector(const char* lsf_string, int non_zeros=1000, int hash_bits=0);
     
     // constructor from dense data
-    SparseVector(float* data, size_t len);
+    SparseVector(float* data, size_t len, int hash_bits=0);
     
     // constructor from sparse data
-    SparseVector(int* indices, float* data, size_t len);
+    SparseVector(int* indices, float* data, size_t len, int hash_bits=0);
+    
+    // 64 bits mix (murmur3 finalizer), every input bit affects every output bit
+    static inline uint64_t mixBits(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+    
+    /* hashing trick: bucket in [0, 2^hash_bits) and sign (+1 or -1) of a feature index.
+     * Both come from the same 64 bits mix of the index (low bits and top bit).
+     */
+    static inline std::pair<int, float> hashFeature(int index, int hash_bits) {
+        uint64_t h = mixBits((uint64_t) (uint32_t) index);
+        
+        int bucket = (int) (h & ((((uint64_t) 1) << hash_bits) - 1));
+        return std::make_pair(bucket, (h >> 63) ? -1.0f : 1.0f);
+    }
     
     // get number of non-zeros
     inline size_t getSize() const {return data.size();}
@@ -62,13 +90,27 @@ public:
     // x = weight * x
     void multiplyInplace(float weight);
     
+    // replaces each index by its rank in feature_ids (sorted), drops the indices not in feature_ids
+    void remap(const std::vector<int>& feature_ids);
+    
     // get ||x||_2
     inline double getNorm() const {return norm;}
     
+    // hints the cache about the non-zeros, ahead of their use
+    inline void prefetch() const {
+        const size_t per_line = 64 / sizeof(IValue);
+        for (size_t i = 0; i < data.size(); i += per_line) {
+            __builtin_prefetch(data.data() + i);
+        }
+    }
+    
 private:
     // internal array of data
     std::vector<IValue> data;
     
+    // hashes the indices, then sorts and merges the colliding entries
+    void hash(int hash_bits);
+    
     // ||x||_2
     double norm;
 };
@@ -24,15 +24,34 @@
 #include <algorithm>
 #include <fstream>
 #include <stdexcept>
+#include <string>
 
 #include "stochastic_data_adaptor.h"
+#include "instrumentation.h"
 
-StochasticDataAdaptor::StochasticDataAdaptor(const char* fname, size_t n_instances) {
+// hash_bits, checked before any row is read
+static int checkedHashBits(int hash_bits) {
+    if (hash_bits < 0 || hash_bits > max_hash_bits) {
+        throw std::runtime_error("At most " + std::to_string(max_hash_bits) + " hash bits are supported.");
+    }
+    return hash_bits;
+}
+
+StochasticDataAdaptor::StochasticDataAdaptor(const char* fname, size_t n_instances, int hash_bits) :
+    hash_bits(checkedHashBits(hash_bits)) {
+    CPM_TIME(Load);
+    
     instances.clear();
-    instances.reserve(n_instances);
     countsPerClass.clear();
     dimensions = 0;
     
+    if (isBinary(fname)) {
+        loadBinary(fname);
+        return;
+    }
+    
+    instances.reserve(n_instances);
+    
     // load data in memory
     const size_t buffer_size = 8 * 1024 * 1024;
     std::ifstream fin(fname);
@@ -60,24 +79,28 @@ StochasticDataAdaptor::StochasticDataAdaptor(const char* fname, size_t n_instanc
             it->second++;
         }
         
-        SparseVector sv(cline);
+        SparseVector sv(cline, 1000, hash_bits);
         
         instances.emplace_back(label, sv, cid);
         dimensions = std::max(sv.getMaxDimension(), dimensions);
     }
     
     ++dimensions;
+    if (hash_bits > 0) dimensions = ((size_t) 1) << hash_bits;
     instances.shrink_to_fit();
     
     fin.close();
     delete[] localBuffer;
 }
 
-StochasticDataAdaptor::StochasticDataAdaptor(float* data, int* labels, size_t n_instances, size_t n_dimensions) {
+StochasticDataAdaptor::StochasticDataAdaptor(float* data, int* labels, size_t n_instances, size_t n_dimensions,
+                                             int hash_bits) : hash_bits(checkedHashBits(hash_bits)) {
+    CPM_TIME(Load);
+    
     instances.clear();
     instances.reserve(n_instances);
     countsPerClass.clear();
-    dimensions = n_dimensions;
+    dimensions = (hash_bits > 0) ? ((size_t) 1) << hash_bits : n_dimensions;
     
     for(size_t i = 0; i < (size_t) n_instances; ++i) {
         int label = labels[i];
@@ -93,12 +116,15 @@ StochasticDataAdaptor::StochasticDataAdaptor(float* data, int* labels, size_t n_
             it->second++;
         }
         
-        SparseVector sv(data + i*n_dimensions, n_dimensions);
+        SparseVector sv(data + i*n_dimensions, n_dimensions, hash_bits);
         instances.emplace_back(label, sv, cid);
     }
 }
 
-StochasticDataAdaptor::StochasticDataAdaptor(float* data, int* indices, int* indptr, int* labels, size_t data_len, size_t indptr_len) {
+StochasticDataAdaptor::StochasticDataAdaptor(float* data, int* indices, int* indptr, int* labels, size_t data_len, size_t indptr_len,
+                                             int hash_bits) : hash_bits(checkedHashBits(hash_bits)) {
+    CPM_TIME(Load);
+    
     instances.clear();
     instances.reserve(indptr_len - 1);
     countsPerClass.clear();
@@ -117,12 +143,167 @@ StochasticDataAdaptor::StochasticDataAdaptor(float* data, int* indices, int* ind
             it->second++;
         }
         
-        SparseVector sv(indices + indptr[i], data + indptr[i], indptr[i+1] - indptr[i]);
+        SparseVector sv(indices + indptr[i], data + indptr[i], indptr[i+1] - indptr[i], hash_bits);
+        instances.emplace_back(label, sv, cid);
+        dimensions = std::max(sv.getMaxDimension(), dimensions);
+    }
+    
+    ++dimensions;
+    if (hash_bits > 0) dimensions = ((size_t) 1) << hash_bits;
+}
+
+void StochasticDataAdaptor::compact() {
+    if (!feature_ids.empty()) {
+        throw std::logic_error("Dataset is already compacted.");
+    }
+    
+    // memory in the number of distinct ids, not in the largest one
+    std::vector<int> ids;
+    for (auto const& instance: instances) {
+        for (auto const& iv: std::get<1>(instance).data) {
+            ids.push_back(iv.index);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    
+    remap(ids);
+}
+
+void StochasticDataAdaptor::remap(const std::vector<int>& ids) {
+    if (!feature_ids.empty()) {
+        throw std::logic_error("Dataset is already compacted.");
+    }
+    
+    if (ids.empty()) {
+        throw std::runtime_error("Empty feature table.");
+    }
+    
+    for (auto& instance: instances) {
+        std::get<1>(instance).remap(ids);
+    }
+    
+    feature_ids = ids;
+    dimensions = feature_ids.size();
+}
+
+bool StochasticDataAdaptor::isBinary(const char* fname) {
+    std::ifstream fin(fname, std::ios::binary);
+    char magic[sizeof(binary_magic)];
+    return fin.read(magic, sizeof(magic)) && (memcmp(magic, binary_magic, sizeof(magic)) == 0);
+}
+
+void StochasticDataAdaptor::loadBinary(const char* fname) {
+    std::ifstream fin(fname, std::ios::binary);
+    
+    char magic[sizeof(binary_magic)];
+    uint32_t version, reserved;
+    uint64_t n_rows, declared_dimensions;
+    fin.read(magic, sizeof(magic));
+    fin.read((char*) &version, sizeof(version));
+    fin.read((char*) &reserved, sizeof(reserved));
+    fin.read((char*) &n_rows, sizeof(n_rows));
+    fin.read((char*) &declared_dimensions, sizeof(declared_dimensions));
+    
+    if (!fin || version != binary_version) {
+        throw std::runtime_error("Unsupported binary cache version.");
+    }
+    
+    // the sizes of the header and of each row are checked against the bytes left before any allocation
+    const std::streamoff start = fin.tellg();
+    fin.seekg(0, std::ios::end);
+    uint64_t remaining = (uint64_t) (fin.tellg() - start);
+    fin.seekg(start);
+    
+    const uint64_t row_header = sizeof(int32_t) + sizeof(uint32_t);
+    const uint64_t entry_bytes = sizeof(int32_t) + sizeof(float);
+    if (n_rows > remaining / row_header) {
+        throw std::runtime_error("Truncated binary cache.");
+    }
+    
+    instances.reserve(n_rows);
+    std::vector<int> indices;
+    std::vector<float> values;
+    
+    for (uint64_t i = 0; i < n_rows; ++i) {
+        int32_t label;
+        uint32_t nnz;
+        fin.read((char*) &label, sizeof(label));
+        fin.read((char*) &nnz, sizeof(nnz));
+        remaining -= row_header;
+        
+        if (!fin || nnz > remaining / entry_bytes) {
+            throw std::runtime_error("Truncated binary cache.");
+        }
+        remaining -= nnz * entry_bytes;
+        
+        indices.resize(nnz);
+        values.resize(nnz);
+        fin.read((char*) indices.data(), nnz * sizeof(int32_t));
+        fin.read((char*) values.data(), nnz * sizeof(float));
+        
+        if (!fin) {
+            throw std::runtime_error("Truncated binary cache.");
+        }
+        for (uint32_t j = 0; j < nnz; ++j) {
+            if (indices[j] < 0) throw std::runtime_error("Negative feature index in binary cache.");
+        }
+        
+        size_t cid;
+        auto it = countsPerClass.find(label);
+        if (it == countsPerClass.end()) {
+            cid = 0;
+            countsPerClass[label] = 1;
+        } else {
+            cid = it->second;
+            it->second++;
+        }
+        
+        SparseVector sv(indices.data(), values.data(), nnz, hash_bits);
         instances.emplace_back(label, sv, cid);
         dimensions = std::max(sv.getMaxDimension(), dimensions);
     }
     
     ++dimensions;
+    if (hash_bits > 0) dimensions = ((size_t) 1) << hash_bits;
+}
+
+void StochasticDataAdaptor::saveBinary(const char* fname) const {
+    if (hash_bits > 0 || !feature_ids.empty()) {
+        throw std::logic_error("Only raw datasets (no hashing, no compaction) can be cached.");
+    }
+    
+    std::ofstream fout(fname, std::ios::binary);
+    if (!fout) {
+        throw std::runtime_error("Cannot open binary cache file.");
+    }
+    
+    uint32_t reserved = 0;
+    uint64_t n_rows = instances.size();
+    uint64_t declared_dimensions = dimensions;
+    fout.write(binary_magic, sizeof(binary_magic));
+    fout.write((const char*) &binary_version, sizeof(binary_version));
+    fout.write((const char*) &reserved, sizeof(reserved));
+    fout.write((const char*) &n_rows, sizeof(n_rows));
+    fout.write((const char*) &declared_dimensions, sizeof(declared_dimensions));
+    
+    for (auto const& instance: instances) {
+        const SparseVector& sv = std::get<1>(instance);
+        int32_t label = std::get<0>(instance);
+        uint32_t nnz = (uint32_t) sv.data.size();
+        fout.write((const char*) &label, sizeof(label));
+        fout.write((const char*) &nnz, sizeof(nnz));
+        for (auto const& iv: sv.data) {
+            fout.write((const char*) &iv.index, sizeof(int32_t));
+        }
+        for (auto const& iv: sv.data) {
+            fout.write((const char*) &iv.value, sizeof(float));
+        }
+    }
+    
+    if (!fout) {
+        throw std::runtime_error("Error when writing binary cache file.");
+    }
 }
 
 void StochasticDataAdaptor::getLabels(int* labels) const {
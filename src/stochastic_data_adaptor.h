@@ -26,21 +26,35 @@
 #include <vector>
 #include <map>
 #include <random>
+#include <cstdint>
 
 #include "sparse_vector.h"
 
+/* Binary cache of a dataset, native endianness:
+ * header: binary_magic (8 chars), uint32 version, uint32 0, uint64 number of rows, uint64 dimensions
+ * (informational, the dataset takes the largest index + 1 as with libsvm files), then per row:
+ * int32 label, uint32 nnz, nnz int32 increasing indices, nnz float values.
+ * Rows are self delimited, so that the file can be written as a stream.
+ */
+static const char binary_magic[8] = {'C', 'P', 'M', 'C', 'A', 'C', 'H', 'E'};
+static const uint32_t binary_version = 1;
+
 class StochasticDataAdaptor {
 public:
-    /* constructs dataset from a libsvm formatted text file.
+    /* constructs dataset from a libsvm formatted text file, or a binary cache (see binary_magic)
+     * which is recognized by its header.
      * n_instances is only a performance hint.
+     * hash_bits > 0 hashes the feature indices into 2^hash_bits dimensions
+     * (for all constructors), see SparseVector::hashFeature.
      */
-    StochasticDataAdaptor(const char* fname, size_t n_instances=1000000);
+    StochasticDataAdaptor(const char* fname, size_t n_instances=1000000, int hash_bits=0);
     
     // constructs dataset from dense in memory data
-    StochasticDataAdaptor(float* data, int* labels, size_t n_instances, size_t n_dimensions);
+    StochasticDataAdaptor(float* data, int* labels, size_t n_instances, size_t n_dimensions, int hash_bits=0);
     
     // constructs dataset from sparse in memory data
-    StochasticDataAdaptor(float* data, int* indices, int* indptr, int* labels, size_t data_len, size_t indptr_len);
+    StochasticDataAdaptor(float* data, int* indices, int* indptr, int* labels, size_t data_len, size_t indptr_len,
+                          int hash_bits=0);
     
     // get a given instance: label, sparsevector, class id
     inline const std::tuple<int, SparseVector, size_t>& getInstance(size_t i) const {
@@ -49,19 +63,47 @@ public:
     
     void getLabels(int* labels) const;
     
+    // writes the dataset as a binary cache, only for unhashed and uncompacted data
+    void saveBinary(const char* fname) const;
+    
+    // whether fname starts with the binary cache header
+    static bool isBinary(const char* fname);
+    
+    /* feature compaction: renumbers the observed feature indices 0, 1, ... in increasing order,
+     * so that the dimension becomes the number of distinct features. The original indices
+     * are kept in getFeatureIds(), to be stored with the model.
+     */
+    void compact();
+    
+    // applies the compaction table of another dataset (typically the training set),
+    // features absent from feature_ids are dropped
+    void remap(const std::vector<int>& feature_ids);
+    
+    // original index of each compacted feature, empty when not compacted
+    const std::vector<int>& getFeatureIds() const {return feature_ids;}
+    
     size_t getNInstances() const {return instances.size();}
     size_t getDimensions() const {return dimensions;}
+    int getHashBits() const {return hash_bits;}
     const std::map<int, size_t> getCountsPerClass() const {return countsPerClass;}
     
 private:
     // number of dimensions
     size_t dimensions;
     
+    // 0 when the indices are not hashed
+    int hash_bits;
+    
+    // compaction table, sorted
+    std::vector<int> feature_ids;
+    
     // label, sparsevector, class id
     std::vector<std::tuple<int, SparseVector, size_t>> instances;
     
     // number of instances per label
     std::map<int, size_t> countsPerClass;
+    
+    void loadBinary(const char* fname);
 };
 
 #endif /* defined(__cpm__stochastic_data_adaptor__) */
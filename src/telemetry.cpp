@@ -0,0 +1,258 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// telemetry.cpp
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "telemetry.h"
+
+namespace telemetry {
+
+// longest wait of the socket loop, bounds the delay to notice a stop
+static const int poll_ms = 100;
+
+static const char* unix_prefix = "unix:";
+
+// a scraper hanging up must not kill the process with SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int send_flags = MSG_NOSIGNAL;
+#else
+static const int send_flags = 0;
+#endif
+
+static bool isSocket(const std::string& endpoint) {
+    return endpoint.compare(0, std::strlen(unix_prefix), unix_prefix) == 0;
+}
+
+Publisher::Publisher(const std::string& endpoint, double period) :
+path(isSocket(endpoint) ? endpoint.substr(std::strlen(unix_prefix)) : endpoint), socket(isSocket(endpoint)),
+period(period) {
+    if (path.empty()) throw std::runtime_error("Empty telemetry endpoint.");
+    if (period <= 0) throw std::runtime_error("The telemetry period must be positive.");
+    
+    if (socket) {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Telemetry socket path too long: " + path);
+        }
+        std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        
+        listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0) throw std::runtime_error("Cannot create the telemetry socket.");
+        
+        // a socket file left over by a previous run would fail the bind
+        unlink(path.c_str());
+        if ((bind(listen_fd, (sockaddr*) &address, sizeof(address)) != 0) || (listen(listen_fd, 16) != 0)) {
+            close(listen_fd);
+            throw std::runtime_error("Cannot listen on the telemetry socket " + path + ": " + std::strerror(errno));
+        }
+        fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    }
+    
+    thread = std::thread(&Publisher::run, this);
+}
+
+Publisher::~Publisher() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    stopped.notify_all();
+    thread.join();
+    
+    if (socket) {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+}
+
+TrainingMetrics* Publisher::add(int label) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.emplace_back(new Entry(label));
+    entries.back()->last_time = std::chrono::steady_clock::now();
+    return &entries.back()->metrics;
+}
+
+void Publisher::run() {
+    auto next = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+    
+    while (true) {
+        if (socket) {
+            pollfd pfd = {listen_fd, POLLIN, 0};
+            if (poll(&pfd, 1, poll_ms) > 0) serve();
+        } else {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopped.wait_until(lock, next, [this] {return stop;});
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stop) break;
+        }
+        
+        if (std::chrono::steady_clock::now() >= next) {
+            update();
+            if (!socket) writeFile();
+            next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+        }
+    }
+    
+    // the final state of the runs
+    update();
+    if (!socket) writeFile();
+}
+
+void Publisher::update() {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+    
+    for (auto& entry: entries) {
+        uint64_t iterations = entry->metrics.iterations.load(std::memory_order_relaxed);
+        std::chrono::duration<double> elapsed = now - entry->last_time;
+        
+        entry->steps_per_second = (elapsed.count() > 0) ? (iterations - entry->last_iterations) / elapsed.count() : 0.0;
+        entry->last_iterations = iterations;
+        entry->last_time = now;
+    }
+}
+
+std::string Publisher::render() {
+    std::ostringstream out;
+    out.precision(9);
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    auto header = [&out](const char* name, const char* type, const char* help) {
+        out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    };
+    auto sample = [&out](const char* name, int label, double value) {
+        out << name << "{label=\"" << label << "\"} " << value << '\n';
+    };
+    
+    header("cpm_training_steps_total", "counter", "SGD steps performed.");
+    for (auto& e: entries) sample("cpm_training_steps_total", e->metrics.label, (double) e->metrics.iterations.load());
+    
+    header("cpm_training_steps_per_second", "gauge", "SGD steps per second over the last period.");
+    for (auto& e: entries) sample("cpm_training_steps_per_second", e->metrics.label, e->steps_per_second);
+    
+    header("cpm_training_epoch", "gauge", "Current epoch, from 0.");
+    for (auto& e: entries) sample("cpm_training_epoch", e->metrics.label, e->metrics.epoch.load());
+    
+    header("cpm_training_reassignment_rate", "gauge", "Rate of reassigned positives over the current epoch.");
+    for (auto& e: entries) sample("cpm_training_reassignment_rate", e->metrics.label, e->metrics.reassignment_rate.load());
+    
+    header("cpm_training_positive_loss", "gauge", "Mean hinge loss of the positives over the current epoch.");
+    for (auto& e: entries) sample("cpm_training_positive_loss", e->metrics.label, e->metrics.positive_loss.load());
+    
+    header("cpm_training_negative_loss", "gauge", "Mean hinge loss of the negatives over the current epoch.");
+    for (auto& e: entries) sample("cpm_training_negative_loss", e->metrics.label, e->metrics.negative_loss.load());
+    
+    header("cpm_training_redundancy", "gauge", "Mean exclusion loss of the positives over the current epoch.");
+    for (auto& e: entries) sample("cpm_training_redundancy", e->metrics.label, e->metrics.redundancy.load());
+    
+    header("cpm_training_entropy", "gauge", "Entropy of the assignments of the positives at the last epoch end.");
+    for (auto& e: entries) sample("cpm_training_entropy", e->metrics.label, e->metrics.entropy.load());
+    
+    header("cpm_training_validation_auc", "gauge", "Validation AUC at the last epoch end.");
+    for (auto& e: entries) {
+        double auc = e->metrics.validation_auc.load();
+        if (auc >= 0) sample("cpm_training_validation_auc", e->metrics.label, auc);
+    }
+    
+    header("cpm_training_done", "gauge", "1 once the training run finished.");
+    for (auto& e: entries) sample("cpm_training_done", e->metrics.label, e->metrics.done.load() ? 1 : 0);
+    
+    header("process_resident_memory_bytes", "gauge", "Resident memory size in bytes.");
+    out << "process_resident_memory_bytes " << (double) residentBytes() << '\n';
+    
+    return out.str();
+}
+
+void Publisher::writeFile() {
+    // scrapers never see a partial file
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp);
+        out << render();
+        if (!out) return;
+    }
+    std::rename(tmp.c_str(), path.c_str());
+}
+
+void Publisher::serve() {
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) return;
+        
+        // reads the request up to its blank line, a silent client only holds us for a second
+        timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0) break;
+            request.append(buffer, (size_t) n);
+        }
+        
+        std::string body = render();
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                               std::to_string(body.size()) + "\r\n\r\n" + body;
+        
+        size_t written = 0;
+        while (written < response.size()) {
+            ssize_t n = send(fd, response.data() + written, response.size() - written, send_flags);
+            if (n <= 0) break;
+            written += (size_t) n;
+        }
+        close(fd);
+    }
+}
+
+size_t residentBytes() {
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (statm >> pages >> resident) return resident * (size_t) sysconf(_SC_PAGESIZE);
+    return 0;
+#else
+    // peak rather than current, in bytes on macOS
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return (size_t) usage.ru_maxrss;
+#endif
+}
+
+}
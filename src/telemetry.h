@@ -0,0 +1,116 @@
+/*
+ Copyright 2014 Alex Kantchelian
+ 
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ 
+ http://www.apache.org/licenses/LICENSE-2.0
+ 
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// telemetry.h
+
+// Author: Alex Kantchelian, 2014
+// akant@cs.berkeley.edu
+
+#ifndef __cpm__telemetry__
+#define __cpm__telemetry__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Live training metrics in the Prometheus text format.
+ *
+ * The training threads only store into the atomic fields of their TrainingMetrics,
+ * every publish_every steps and at the end of each epoch. A background thread of the
+ * Publisher reads them every period, derives the step rate and exposes the result,
+ * either by rewriting a file (atomically, through a rename) or by answering the
+ * HTTP requests of a scraper on a Unix socket.
+ */
+namespace telemetry {
+
+// the training loop stores its progress once every publish_every steps
+const int publish_every = 1024;
+
+// progress of one CPM::fit, written by its training thread
+struct TrainingMetrics {
+    TrainingMetrics(int label) : label(label) {}
+    
+    const int label; // outer label of the model
+    
+    std::atomic<uint64_t> iterations{0};
+    std::atomic<int> epoch{0};
+    
+    // running averages over the current epoch
+    std::atomic<double> reassignment_rate{0.0};
+    std::atomic<double> positive_loss{0.0};
+    std::atomic<double> negative_loss{0.0};
+    std::atomic<double> redundancy{0.0};
+    
+    // at the end of the last epoch, negative validation_auc: none
+    std::atomic<double> entropy{0.0};
+    std::atomic<double> validation_auc{-1.0};
+    
+    std::atomic<bool> done{false};
+};
+
+class Publisher {
+public:
+    // endpoint: "unix:<path>" listens on a Unix socket, otherwise the path of the file to rewrite.
+    // period: seconds between two file writes, and over which the step rate is measured.
+    Publisher(const std::string& endpoint, double period=1.0);
+    ~Publisher();
+    
+    // metrics of a new training run, owned by the publisher. Safe to call from any thread.
+    TrainingMetrics* add(int label);
+    
+    // current metrics in the Prometheus text format
+    std::string render();
+
+private:
+    // a training run and its step rate over the last period
+    struct Entry {
+        Entry(int label) : metrics(label) {}
+        
+        TrainingMetrics metrics;
+        uint64_t last_iterations = 0;
+        std::chrono::steady_clock::time_point last_time;
+        double steps_per_second = 0.0;
+    };
+    
+    const std::string path;
+    const bool socket;
+    const std::chrono::duration<double> period;
+    int listen_fd = -1;
+    
+    std::mutex mutex; // entries and stop
+    std::vector<std::unique_ptr<Entry>> entries;
+    bool stop = false;
+    std::condition_variable stopped;
+    std::thread thread;
+    
+    void run();
+    void update(); // step rates
+    void writeFile();
+    void serve(); // answers the pending scrapers
+};
+
+// resident set size of the process in bytes, 0 if unknown
+size_t residentBytes();
+
+}
+
+#endif /* defined(__cpm__telemetry__) */